@@ -0,0 +1,308 @@
+// Copyright (C) 2020 Felipe O. Carvalho
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <optional>
+#include <queue>
+#include <utility>
+#include <vector>
+#include "lib.h"
+#include "network.h"
+#include "trace.h"
+
+// Asynchronous syncs (C++20)
+//
+// StarNetwork::syncWithServer() runs a request/response transaction inline,
+// so only one sync is ever in flight. The primitives in this file model
+// syncs as coroutines on a single-threaded executor:
+//
+//   Task<void> syncWithServer(size_t i) {
+//     auto request = transport.sendRequest(i, *replicas[i]);
+//     auto reply = co_await server.sync(request);
+//     transport.receiveReply(request, replicas[i], reply);
+//   }
+//
+// Thousands of clients can then be in flight at once without a thread per
+// client. Time is simulated: the executor keeps a virtual clock, in
+// microseconds, that jumps to the next timer when nothing is ready to run,
+// and messages take the time the LinkModel says to travel. Latencies are
+// measured on that clock.
+
+// Coroutines {{{
+
+template <typename T>
+struct TaskResult {
+  std::optional<T> value;
+
+  void return_value(T v) { value.emplace(std::move(v)); }
+  T take() { return std::move(*value); }
+};
+
+template <>
+struct TaskResult<void> {
+  void return_void() {}
+  void take() {}
+};
+
+// A lazily started coroutine that returns a T. Awaiting a Task starts it and
+// resumes the awaiting coroutine when it finishes.
+template <typename T = void>
+class [[nodiscard]] Task {
+ public:
+  struct promise_type : TaskResult<T> {
+    std::coroutine_handle<> continuation;
+
+    Task get_return_object() {
+      return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    auto final_suspend() noexcept {
+      struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+          auto continuation = h.promise().continuation;
+          return continuation ? continuation : std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+      };
+      return FinalAwaiter{};
+    }
+    void unhandled_exception() { std::terminate(); }
+  };
+
+  Task(Task &&other) noexcept : _handle(std::exchange(other._handle, nullptr)) {}
+  Task &operator=(Task &&other) noexcept {
+    if (this != &other) {
+      destroy();
+      _handle = std::exchange(other._handle, nullptr);
+    }
+    return *this;
+  }
+  Task(const Task &) = delete;
+  Task &operator=(const Task &) = delete;
+  ~Task() { destroy(); }
+
+  bool done() const { return _handle.done(); }
+  std::coroutine_handle<> handle() const { return _handle; }
+
+  bool await_ready() const noexcept { return false; }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+    _handle.promise().continuation = awaiting;
+    return _handle;
+  }
+  T await_resume() { return _handle.promise().take(); }
+
+ private:
+  explicit Task(std::coroutine_handle<promise_type> handle) : _handle(handle) {}
+
+  void destroy() {
+    if (_handle) {
+      _handle.destroy();
+      _handle = nullptr;
+    }
+  }
+
+  std::coroutine_handle<promise_type> _handle;
+};
+
+// Runs coroutines one at a time on the calling thread, on a virtual clock.
+class Executor {
+ public:
+  using Time = uint64_t;  // microseconds
+
+  Executor() = default;
+  Executor(const Executor &) = delete;
+  Executor &operator=(const Executor &) = delete;
+
+  Time now() const { return _now; }
+
+  // Starts task on the next run() and keeps it alive until it finishes.
+  void spawn(Task<void> task) {
+    _ready.push_back(task.handle());
+    _spawned.push_back(std::move(task));
+  }
+
+  // co_await sleep(delay) resumes the coroutine delay microseconds later.
+  auto sleep(Time delay) {
+    struct SleepAwaiter {
+      Executor *executor;
+      Time delay;
+
+      bool await_ready() const noexcept { return false; }
+      void await_suspend(std::coroutine_handle<> h) {
+        executor->_timers.push({executor->_now + delay, executor->_timer_seq++, h});
+      }
+      void await_resume() const noexcept {}
+    };
+    return SleepAwaiter{this, delay};
+  }
+
+  // Runs until no coroutine is ready and no timer is pending.
+  void run() {
+    TRACE_SCOPE("async", "Executor::run");
+    for (;;) {
+      if (_ready.empty()) {
+        if (_timers.empty()) {
+          break;
+        }
+        _now = std::max(_now, _timers.top().at);
+        while (!_timers.empty() && _timers.top().at <= _now) {
+          _ready.push_back(_timers.top().handle);
+          _timers.pop();
+        }
+      }
+      auto handle = _ready.front();
+      _ready.pop_front();
+      handle.resume();
+    }
+    _spawned.erase(std::remove_if(_spawned.begin(),
+                                  _spawned.end(),
+                                  [](const Task<void> &task) { return task.done(); }),
+                   _spawned.end());
+  }
+
+ private:
+  struct Timer {
+    Time at;
+    uint64_t seq;  // timers that fire at the same time resume in FIFO order
+    std::coroutine_handle<> handle;
+
+    bool operator>(const Timer &other) const {
+      return at != other.at ? at > other.at : seq > other.seq;
+    }
+  };
+
+  Time _now = 0;
+  uint64_t _timer_seq = 0;
+  std::deque<std::coroutine_handle<>> _ready;
+  std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> _timers;
+  std::vector<Task<void>> _spawned;
+};
+
+// }}}
+
+// The link of a server: messages take latency microseconds to propagate
+// after being transmitted at bytes_per_us.
+struct LinkModel {
+  Executor::Time latency = 500;  // one way, in microseconds
+  double bytes_per_us = 125;     // 1 Gbit/s
+
+  Executor::Time transmissionTime(size_t bytes) const {
+    return (Executor::Time)std::ceil((double)bytes / bytes_per_us);
+  }
+};
+
+// A server replica that answers syncs immediately and merges the request
+// right after building its reply. Syncs go through a SyncTransport, so
+// requests and replies are digests alone or deltas when CRDTTraits<CRDT>
+// allows, as in StarNetwork.
+//
+// The link of the server is shared by all clients: it transmits one incoming
+// and one outgoing message at a time, so concurrent syncs queue up and large
+// payloads delay the syncs behind them.
+template <typename CRDT>
+class AsyncServer {
+ public:
+  using Payload = typename CRDT::Payload;
+  using Transport = SyncTransport<CRDT>;
+
+  AsyncServer(Executor &executor, CRDT *replica, Transport &transport, LinkModel link = {})
+      : _executor(executor), _replica(replica), _transport(transport), _link(link) {}
+
+  // Sends request to the server and returns its reply.
+  Task<typename Transport::ExchangeReply> sync(typename Transport::ExchangeRequest request) {
+    co_await _executor.sleep(delay(request.bytes, _incoming_free_at));
+    auto reply = _transport.reply(request, _replica);
+    co_await _executor.sleep(delay(reply.bytes, _outgoing_free_at));
+    co_return reply;
+  }
+
+  CRDT *replica() const { return _replica; }
+
+ private:
+  // Time until a message sent now is received, given when the direction of
+  // the link it goes through is done transmitting earlier messages.
+  Executor::Time delay(size_t bytes, Executor::Time &free_at) {
+    const Executor::Time start = std::max(_executor.now(), free_at);
+    free_at = start + _link.transmissionTime(bytes);
+    return free_at + _link.latency - _executor.now();
+  }
+
+  Executor &_executor;
+  CRDT *_replica;
+  Transport &_transport;
+  LinkModel _link;
+  Executor::Time _incoming_free_at = 0;
+  Executor::Time _outgoing_free_at = 0;
+};
+
+// Like StarNetwork, but syncAllReplicasToServer() starts the syncs of all
+// replicas at once and lets them run concurrently.
+template <typename CRDT>
+class AsyncStarNetwork {
+ public:
+  explicit AsyncStarNetwork(CRDT *server, LinkModel link = {})
+      : _server(_executor, server, _transport, link) {}
+
+  // Returns the index of the replica among the replicas that sync with the
+  // server.
+  size_t add(CRDT *crdt) {
+    _replicas.push_back(crdt);
+    return _replicas.size() - 1;
+  }
+
+  // Runs one sync per replica, all in flight at the same time, and returns
+  // when every reply and every server-side merge was processed.
+  void syncAllReplicasToServer() {
+    TRACE_SCOPE("network", "AsyncStarNetwork::syncAllReplicasToServer");
+    for (size_t i = 0; i < _replicas.size(); i++) {
+      _executor.spawn(syncWithServer(i));
+    }
+    _executor.run();
+  }
+
+  int countPartitions() const {
+    std::unordered_set<typename CRDT::ValueType> distinct_values;
+    distinct_values.insert(_server.replica()->query());
+    for (auto *replica : _replicas) {
+      distinct_values.insert(replica->query());
+    }
+    return (int)distinct_values.size();
+  }
+
+  const Executor &executor() const { return _executor; }
+
+  // Virtual time from sending each request to merging its reply, in
+  // microseconds.
+  const std::vector<Executor::Time> &latencies() const { return _latencies; }
+
+  NetworkMetrics metrics() const { return _transport.metrics(); }
+
+ private:
+  Task<void> syncWithServer(size_t i) {
+    CRDT *replica = _replicas[i];
+    const Executor::Time start = _executor.now();
+    auto request = _transport.sendRequest(i, *replica);
+    // The request carries a copy, since the replica may change while it is
+    // in flight.
+    std::optional<typename CRDT::Payload> payload;
+    if (request.payload) {
+      request.payload = &payload.emplace(*request.payload);
+    }
+    auto reply = co_await _server.sync(request);
+    _transport.receiveReply(request, replica, reply);
+    _latencies.push_back(_executor.now() - start);
+  }
+
+  Executor _executor;
+  SyncTransport<CRDT> _transport;
+  AsyncServer<CRDT> _server;
+  std::vector<CRDT *> _replicas;
+  std::vector<Executor::Time> _latencies;
+};
@@ -0,0 +1,186 @@
+// Copyright (C) 2020 Felipe O. Carvalho
+#pragma once
+
+// Tiny benchmarking toolkit shared by the bench_* targets.
+//
+// NOTE: this header replaces the global operator new/delete to count heap
+// allocations, so it must be included by exactly one translation unit of the
+// executable being built.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+
+namespace bench {
+
+struct AllocStats {
+  uint64_t allocations = 0;
+  uint64_t deallocations = 0;
+  uint64_t bytes = 0;
+};
+
+inline AllocStats &threadAllocStats() {
+  static thread_local AllocStats stats;
+  return stats;
+}
+
+}  // namespace bench
+
+void *operator new(std::size_t size) {
+  auto &stats = bench::threadAllocStats();
+  stats.allocations += 1;
+  stats.bytes += size;
+  if (void *p = std::malloc(size ? size : 1)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void *operator new[](std::size_t size) { return ::operator new(size); }
+
+void operator delete(void *p) noexcept {
+  if (p) {
+    bench::threadAllocStats().deallocations += 1;
+    std::free(p);
+  }
+}
+
+void operator delete[](void *p) noexcept { ::operator delete(p); }
+void operator delete(void *p, std::size_t) noexcept { ::operator delete(p); }
+void operator delete[](void *p, std::size_t) noexcept { ::operator delete(p); }
+
+namespace bench {
+
+// Keeps the compiler from optimizing away a computed value.
+template <typename T>
+inline void doNotOptimize(const T &value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+struct Config {
+  double min_time_ms = 100;
+  size_t max_ops = 50'000'000;
+  const char *filter = nullptr;
+
+  // Accepts --min-time-ms=N, --quick and --filter=SUBSTRING.
+  void parse(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+      if (strncmp(argv[i], "--min-time-ms=", 14) == 0) {
+        min_time_ms = atof(argv[i] + 14);
+      } else if (strcmp(argv[i], "--quick") == 0) {
+        min_time_ms = 5;
+      } else if (strncmp(argv[i], "--filter=", 9) == 0) {
+        filter = argv[i] + 9;
+      } else {
+        fprintf(stderr, "Unknown option '%s'.\n", argv[i]);
+        exit(1);
+      }
+    }
+  }
+
+  bool selected(const std::string &name) const {
+    return !filter || name.find(filter) != std::string::npos;
+  }
+};
+
+inline Config &config() {
+  static Config c;
+  return c;
+}
+
+struct Stats {
+  uint64_t ops = 0;
+  double total_ns = 0;
+  double allocs_per_op = 0;
+  double alloc_bytes_per_op = 0;
+  double p50_ns = 0;  // percentiles over per-batch averages
+  double p99_ns = 0;
+
+  double nsPerOp() const { return ops ? total_ns / (double)ops : 0; }
+  double opsPerSec() const { return total_ns > 0 ? (double)ops * 1e9 / total_ns : 0; }
+};
+
+// Runs op(i) for i in [0, batch) repeatedly until the time budget is spent,
+// at least once.
+// prepare(batch) runs before every batch and is not timed, so ops that
+// consume their input (e.g. merging into a fresh copy) can be measured
+// without the cost of producing the input. Use batch = 1 to get true per-op
+// latency percentiles.
+template <typename Prepare, typename Op>
+Stats measure(size_t batch, Prepare &&prepare, Op &&op) {
+  using Clock = std::chrono::steady_clock;
+  const auto &cfg = config();
+  Stats stats;
+  std::vector<double> samples;
+  AllocStats &alloc = threadAllocStats();
+  uint64_t allocations = 0;
+  uint64_t alloc_bytes = 0;
+  do {
+    prepare(batch);
+    const uint64_t allocations_before = alloc.allocations;
+    const uint64_t bytes_before = alloc.bytes;
+    const auto start = Clock::now();
+    for (size_t i = 0; i < batch; i++) {
+      op(i);
+    }
+    const auto end = Clock::now();
+    allocations += alloc.allocations - allocations_before;
+    alloc_bytes += alloc.bytes - bytes_before;
+    const double ns =
+        (double)std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    stats.total_ns += ns;
+    stats.ops += batch;
+    samples.push_back(ns / (double)batch);
+  } while (stats.total_ns < cfg.min_time_ms * 1e6 && stats.ops < cfg.max_ops);
+  std::sort(samples.begin(), samples.end());
+  stats.p50_ns = samples[samples.size() / 2];
+  stats.p99_ns = samples[std::min(samples.size() - 1, samples.size() * 99 / 100)];
+  stats.allocs_per_op = (double)allocations / (double)stats.ops;
+  stats.alloc_bytes_per_op = (double)alloc_bytes / (double)stats.ops;
+  return stats;
+}
+
+template <typename Op>
+Stats measure(size_t batch, Op &&op) {
+  return measure(
+      batch, [](size_t) {}, std::forward<Op>(op));
+}
+
+// Rows optionally carry the number of bytes each op touches, in which case
+// two extra columns (bytes/op and MB/s) are printed.
+inline void printHeader(bool with_bytes = false) {
+  printf("%-56s %12s %12s %12s %12s %12s",
+         "benchmark",
+         "ns/op",
+         "p50 ns",
+         "p99 ns",
+         "allocs/op",
+         "ops/s");
+  if (with_bytes) {
+    printf(" %12s %12s", "bytes/op", "MB/s");
+  }
+  putchar('\n');
+}
+
+inline void printRow(const std::string &name, const Stats &stats, double bytes_per_op = -1) {
+  printf("%-56s %12.1f %12.1f %12.1f %12.2f %12.0f",
+         name.c_str(),
+         stats.nsPerOp(),
+         stats.p50_ns,
+         stats.p99_ns,
+         stats.allocs_per_op,
+         stats.opsPerSec());
+  if (bytes_per_op >= 0) {
+    printf(" %12.0f %12.1f", bytes_per_op, bytes_per_op * stats.opsPerSec() / 1e6);
+  }
+  putchar('\n');
+  fflush(stdout);
+}
+
+}  // namespace bench
@@ -0,0 +1,158 @@
+// Copyright (C) 2020 Felipe O. Carvalho
+
+// Heap allocation budgets of the hot paths of the CRDTs in crdt.h.
+//
+// Every check runs an operation many times after a warm-up run and counts
+// the allocations it made through the operator new replacement in bench.h.
+// The process exits with a non-zero status when any operation exceeds its
+// budget, so the check is registered with ctest and allocation regressions
+// fail CI. The budgets describe steady states: the replicas involved already
+// know every replica name and element, so nothing needs to grow.
+//
+// Usage: bench_alloc [--filter=SUBSTRING]
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include "bench.h"
+#include "crdt.h"
+
+namespace {
+
+constexpr size_t kIterations = 1000;
+constexpr size_t kReplicas = 16;
+constexpr size_t kElements = 256;
+
+// Longer than the small string buffer, so that copies would allocate.
+std::string replicaName(size_t i) { return "replica-with-a-long-name-" + std::to_string(i); }
+std::string element(size_t i) { return "element-with-a-long-name-" + std::to_string(i); }
+
+struct Budget {
+  const char *name;
+  uint64_t allocations_per_op;
+};
+
+const char *filter = nullptr;
+size_t failures = 0;
+
+// Runs op(i) for i in [0, kIterations) after a warm-up call and compares the
+// allocations against the budget.
+template <typename Op>
+void check(const Budget &budget, Op &&op) {
+  if (filter && !strstr(budget.name, filter)) {
+    return;
+  }
+  op(0);
+  bench::AllocStats &alloc = bench::threadAllocStats();
+  const uint64_t allocations_before = alloc.allocations;
+  for (size_t i = 0; i < kIterations; i++) {
+    op(i);
+  }
+  const uint64_t allocations = alloc.allocations - allocations_before;
+  const bool ok = allocations <= budget.allocations_per_op * kIterations;
+  printf("%-40s %12.2f %12" PRIu64 "  %s\n",
+         budget.name,
+         (double)allocations / (double)kIterations,
+         budget.allocations_per_op,
+         ok ? "ok" : "OVER BUDGET");
+  failures += ok ? 0 : 1;
+}
+
+// Replicas a and b both know every replica, b is ahead on all of them.
+template <typename CRDT>
+void makeCounters(CRDT &a, CRDT &b) {
+  for (size_t i = 0; i < kReplicas; i++) {
+    CRDT r(replicaName(i));
+    r.increment(1);
+    a.merge(r.payload());
+    r.increment(1);
+    b.merge(r.payload());
+  }
+}
+
+void checkGCounter() {
+  GCounter a(replicaName(0));
+  GCounter b(replicaName(1));
+  makeCounters(a, b);
+  check({"GCounter/increment", 0}, [&](size_t) { a.increment(1); });
+  check({"GCounter/query", 0}, [&](size_t) { bench::doNotOptimize(a.query()); });
+  check({"GCounter/merge/steady", 0}, [&](size_t) {
+    b.increment(1);
+    a.merge(b.payload());
+  });
+  check({"GCounter/merge/noop", 0}, [&](size_t) { a.merge(b.payload()); });
+}
+
+void checkPNCounter() {
+  PNCounter a(replicaName(0));
+  PNCounter b(replicaName(1));
+  makeCounters(a, b);
+  b.increment(-1);
+  a.merge(b.payload());
+  check({"PNCounter/increment", 0}, [&](size_t i) { a.increment(i % 2 ? 1 : -1); });
+  check({"PNCounter/query", 0}, [&](size_t) { bench::doNotOptimize(a.query()); });
+  check({"PNCounter/merge/steady", 0}, [&](size_t i) {
+    b.increment(i % 2 ? 1 : -1);
+    a.merge(b.payload());
+  });
+  check({"PNCounter/merge/noop", 0}, [&](size_t) { a.merge(b.payload()); });
+}
+
+void checkLWWRegister() {
+  LWWRegister<std::string> a(replicaName(0));
+  LWWRegister<std::string> b(replicaName(1));
+  const std::string value = element(0);
+  a.assign(value);
+  b.assign(value);
+  a.merge(b.payload());
+  check({"LWWRegister/merge/steady", 0}, [&](size_t) {
+    b.assign(value);
+    a.merge(b.payload());
+  });
+  check({"LWWRegister/merge/noop", 0}, [&](size_t) { a.merge(b.payload()); });
+  check({"LWWRegister/query", 0}, [&](size_t) { bench::doNotOptimize(a.query()); });
+}
+
+void check2PSet() {
+  _2PSet<std::string> a(replicaName(0));
+  _2PSet<std::string> b(replicaName(1));
+  std::vector<std::string> elements;
+  for (size_t i = 0; i < kElements; i++) {
+    elements.push_back(element(i));
+    b.add(elements.back());
+  }
+  for (size_t i = 0; i < kElements; i += 2) {
+    (void)b.remove(elements[i]);
+  }
+  a.merge(b.payload());
+  check({"2PSet/contains", 0}, [&](size_t i) {
+    bench::doNotOptimize(a.contains(elements[i % kElements]));
+  });
+  check({"2PSet/merge/noop", 0}, [&](size_t) { a.merge(b.payload()); });
+  check({"2PSet/query", 0}, [&](size_t) { bench::doNotOptimize(a.query().size()); });
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--filter=", 9) == 0) {
+      filter = argv[i] + 9;
+    } else {
+      fprintf(stderr, "Unknown option '%s'.\n", argv[i]);
+      return 1;
+    }
+  }
+  verboseLogging() = false;
+  printf("%-40s %12s %12s\n", "operation", "allocs/op", "budget");
+  checkGCounter();
+  checkPNCounter();
+  checkLWWRegister();
+  check2PSet();
+  if (failures) {
+    fprintf(stderr, "%zu operation(s) over their allocation budget.\n", failures);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,147 @@
+// Copyright (C) 2020 Felipe O. Carvalho
+
+// Many clients syncing with a server at the same time, modeled with the
+// coroutines in async.h.
+//
+// Every client updates its replica and then all of them sync with the server
+// concurrently, in rounds, until all replicas converge. Latencies are per
+// request, from sending the payload to merging the reply, in virtual
+// microseconds; "wall ms" is the real time it took to run a round.
+//
+// Usage: bench_async [--crdt=gcounter|lww] [--clients=N] [--latency-us=L]
+//   [--bytes-per-us=B]
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+#include "async.h"
+#include "crdt.h"
+
+namespace {
+
+struct Params {
+  const char *crdt = nullptr;
+  size_t clients = 0;  // 0 runs 100, 1000 and 10000 clients
+  LinkModel link;
+};
+
+Executor::Time percentile(std::vector<Executor::Time> latencies, double p) {
+  if (latencies.empty()) {
+    return 0;
+  }
+  const size_t i = std::min(latencies.size() - 1, (size_t)((double)latencies.size() * p));
+  std::nth_element(latencies.begin(), latencies.begin() + i, latencies.end());
+  return latencies[i];
+}
+
+template <typename CRDT, typename Update>
+void run(const char *crdt, size_t clients, const LinkModel &link, Update &&update) {
+  CRDT server("server");
+  std::vector<std::unique_ptr<CRDT>> replicas;
+  AsyncStarNetwork<CRDT> network(&server, link);
+  for (size_t i = 0; i < clients; i++) {
+    replicas.push_back(std::make_unique<CRDT>("client-" + std::to_string(i)));
+    update(*replicas.back(), i);
+    network.add(replicas.back().get());
+  }
+
+  size_t seen = 0;
+  NetworkTraffic before = network.metrics().traffic;
+  for (size_t round = 1; network.countPartitions() != 1; round++) {
+    const auto start = std::chrono::steady_clock::now();
+    network.syncAllReplicasToServer();
+    const double ms = std::chrono::duration<double, std::milli>(
+                          std::chrono::steady_clock::now() - start)
+                          .count();
+    const std::vector<Executor::Time> latencies(network.latencies().begin() + seen,
+                                                network.latencies().end());
+    seen = network.latencies().size();
+    const NetworkTraffic &after = network.metrics().traffic;
+    printf("%-10s %8zu %6zu %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64
+           " %14" PRIu64 " %10.3f\n",
+           crdt,
+           clients,
+           round,
+           percentile(latencies, 0.5),
+           percentile(latencies, 0.99),
+           percentile(latencies, 1),
+           after.messages - before.messages,
+           after.bytes - before.bytes,
+           ms);
+    fflush(stdout);
+    before = after;
+  }
+}
+
+bool selected(const char *option, const char *value) {
+  return !option || strcmp(option, value) == 0;
+}
+
+void runAll(const Params &params, size_t clients) {
+  // Every GCounter ends up with an entry per client, so unless --clients is
+  // given they stop at 1000 clients.
+  if (selected(params.crdt, "gcounter") && (params.clients || clients <= 1000)) {
+    run<GCounter>("gcounter", clients, params.link, [](GCounter &counter, size_t i) {
+      counter.increment(i + 1);
+    });
+  }
+  if (selected(params.crdt, "lww")) {
+    run<LWWRegister<std::string>>(
+        "lww", clients, params.link, [](LWWRegister<std::string> &reg, size_t i) {
+          reg.assign("value-" + std::to_string(i));
+        });
+  }
+}
+
+Params parseParams(int argc, char *argv[]) {
+  Params params;
+  for (int i = 1; i < argc; i++) {
+    const char *eq = strchr(argv[i], '=');
+    const std::string key = eq ? std::string(argv[i], (size_t)(eq - argv[i])) : argv[i];
+    const char *value = eq ? eq + 1 : "";
+    if (key == "--crdt") {
+      params.crdt = value;
+    } else if (key == "--clients") {
+      params.clients = (size_t)atoll(value);
+    } else if (key == "--latency-us") {
+      params.link.latency = (Executor::Time)atoll(value);
+    } else if (key == "--bytes-per-us") {
+      params.link.bytes_per_us = atof(value);
+    } else {
+      fprintf(stderr, "Unknown option '%s'.\n", argv[i]);
+      exit(1);
+    }
+  }
+  return params;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  const Params params = parseParams(argc, argv);
+  verboseLogging() = false;
+  printf("%-10s %8s %6s %10s %10s %10s %10s %14s %10s\n",
+         "crdt",
+         "clients",
+         "round",
+         "p50 us",
+         "p99 us",
+         "max us",
+         "messages",
+         "bytes",
+         "wall ms");
+  if (params.clients) {
+    runAll(params, params.clients);
+  } else {
+    for (size_t clients : {100, 1000, 10000}) {
+      runAll(params, clients);
+    }
+  }
+  return 0;
+}
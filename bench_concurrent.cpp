@@ -0,0 +1,488 @@
+// Copyright (C) 2020 Felipe O. Carvalho
+
+// Read throughput of shared replicas while a writer thread keeps merging
+// into them, for 1, 2, 4... reader threads up to the number of cores.
+//
+// "mutex" guards a plain CRDT with a std::mutex, which is what callers had to
+// do before concurrent.h, "rcu" is ConcurrentReplica and "seqlock" is
+// SeqLockLWWRegister. The writer merges a payload that keeps growing, so
+// readers observe a changing replica.
+//
+// The set benchmarks mix add() and contains() calls from every thread on a
+// mutex-guarded set and on the striped sets.
+//
+// Before the benchmarks, checks named "check/..." compare the concurrent
+// replicas against the plain CRDTs under the same operations and make sure
+// readers never see a torn or freed state. The process exits with a non-zero
+// status when a check fails, so the checks are registered with ctest
+// (--filter=check/ runs nothing else).
+//
+// Usage: bench_concurrent [--min-time-ms=N] [--quick] [--filter=SUBSTRING]
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "bench.h"
+#include "concurrent.h"
+#include "crdt.h"
+#include "hash.h"
+
+namespace {
+
+template <typename CRDT>
+class MutexReplica {
+ public:
+  using Payload = typename CRDT::Payload;
+
+  explicit MutexReplica(std::string name) : _replica(std::move(name)) {}
+
+  auto query() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _replica.query();
+  }
+
+  void merge(const Payload &other) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _replica.merge(other);
+  }
+
+  template <typename T>
+  bool contains(const T &value) const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _replica.contains(value);
+  }
+
+  template <typename T>
+  void add(const T &value) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _replica.add(value);
+  }
+
+ private:
+  mutable std::mutex _mutex;
+  CRDT _replica;
+};
+
+// Returns the number of reads per second across all readers.
+template <typename Shared, typename Update>
+double measureReads(size_t readers, Update &&update) {
+  Shared shared("shared");
+  std::atomic<bool> stop{false};
+  std::atomic<uint64_t> reads{0};
+
+  std::thread writer([&] {
+    for (uint64_t i = 0; !stop.load(std::memory_order_relaxed); i++) {
+      update(shared, i);
+    }
+  });
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < readers; t++) {
+    threads.emplace_back([&] {
+      uint64_t n = 0;
+      while (!stop.load(std::memory_order_relaxed)) {
+        bench::doNotOptimize(shared.query());
+        n += 1;
+      }
+      reads += n;
+    });
+  }
+
+  const auto duration = std::chrono::duration<double, std::milli>(bench::config().min_time_ms);
+  std::this_thread::sleep_for(duration);
+  stop = true;
+  writer.join();
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  return (double)reads.load() * 1e3 / duration.count();
+}
+
+template <typename Shared, typename Update>
+void benchmarkReads(const std::string &name, Update &&update) {
+  const size_t cores = std::max(1u, std::thread::hardware_concurrency());
+  for (size_t readers = 1; readers <= cores; readers *= 2) {
+    const std::string full_name = name + "/readers=" + std::to_string(readers);
+    if (bench::config().selected(full_name)) {
+      const double reads = measureReads<Shared>(readers, update);
+      printf("%-56s %16.0f\n", full_name.c_str(), reads);
+      fflush(stdout);
+    }
+  }
+}
+
+// Every thread adds one element per 8 contains() calls on a set that
+// starts with kSetElements elements. Returns operations per second across
+// all threads.
+constexpr uint64_t kSetElements = 100000;
+
+template <typename Shared>
+double measureSetOps(size_t threads_count) {
+  Shared shared("shared");
+  for (uint64_t i = 0; i < kSetElements; i++) {
+    shared.add(i);
+  }
+  std::atomic<bool> stop{false};
+  std::atomic<uint64_t> ops{0};
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < threads_count; t++) {
+    threads.emplace_back([&, t] {
+      uint64_t n = 0;
+      uint64_t key = t * 0x9e3779b97f4a7c15ull;
+      while (!stop.load(std::memory_order_relaxed)) {
+        key = key * 6364136223846793005ull + 1442695040888963407ull;
+        if (n % 8 == 0) {
+          shared.add(key % (2 * kSetElements));
+        } else {
+          bench::doNotOptimize(shared.contains(key % (2 * kSetElements)));
+        }
+        n += 1;
+      }
+      ops += n;
+    });
+  }
+  const auto duration = std::chrono::duration<double, std::milli>(bench::config().min_time_ms);
+  std::this_thread::sleep_for(duration);
+  stop = true;
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  return (double)ops.load() * 1e3 / duration.count();
+}
+
+template <typename Shared>
+void benchmarkSetOps(const std::string &name) {
+  const size_t cores = std::max(1u, std::thread::hardware_concurrency());
+  for (size_t threads = 1; threads <= cores; threads *= 2) {
+    const std::string full_name = name + "/threads=" + std::to_string(threads);
+    if (bench::config().selected(full_name)) {
+      const double ops = measureSetOps<Shared>(threads);
+      printf("%-56s %16.0f\n", full_name.c_str(), ops);
+      fflush(stdout);
+    }
+  }
+}
+
+// Checks {{{
+
+size_t failures = 0;
+
+void expect(const char *check, bool ok, const char *what) {
+  if (!ok) {
+    fprintf(stderr, "%s: %s\n", check, what);
+    failures += 1;
+  }
+}
+
+// Prints whether the check failed since it started with failures_before
+// failures.
+void report(const char *check, size_t failures_before) {
+  printf("%-56s %16s\n", check, failures == failures_before ? "ok" : "FAILED");
+  fflush(stdout);
+}
+
+size_t checkThreads() {
+  return std::clamp<size_t>(std::thread::hardware_concurrency(), 2, 8);
+}
+
+// A GCounter that knows whether it was destroyed, so that readers can tell
+// when the replica of their snapshot was freed under them.
+class CanaryGCounter : public GCounter {
+ public:
+  using GCounter::GCounter;
+  CanaryGCounter(const CanaryGCounter &other) : GCounter(other) {}
+  ~CanaryGCounter() { _canary = 0; }
+
+  bool alive() const { return _canary == kAlive; }
+
+ private:
+  static constexpr uint64_t kAlive = 0x5afe5afe5afe5afeull;
+  volatile uint64_t _canary = kAlive;
+};
+
+// Readers check that their snapshot is alive, that its cached query matches
+// its payload and that values never go back while a writer merges. Once
+// they stop, the next write reclaims every retired copy.
+void checkConcurrentReplica() {
+  const char *check = "check/rcu";
+  if (!bench::config().selected(check)) {
+    return;
+  }
+  const size_t failures_before = failures;
+  constexpr uint64_t kMerges = 20000;
+  ConcurrentReplica<CanaryGCounter> shared("shared");
+  std::atomic<bool> stop{false};
+  std::atomic<uint64_t> dead{0};
+  std::atomic<uint64_t> torn{0};
+  std::atomic<uint64_t> backwards{0};
+  std::vector<std::thread> readers;
+  for (size_t t = 0; t < checkThreads(); t++) {
+    readers.emplace_back([&] {
+      uint64_t last = 0;
+      while (!stop.load(std::memory_order_relaxed)) {
+        auto snapshot = shared.snapshot();
+        uint64_t sum = 0;
+        for (auto & [ replica, version ] : snapshot->payload()) {
+          (void)replica;
+          sum += version;
+        }
+        const uint64_t value = snapshot->query();
+        dead += snapshot->alive() ? 0 : 1;
+        torn += value == sum ? 0 : 1;
+        backwards += value >= last ? 0 : 1;
+        last = value;
+      }
+    });
+  }
+  std::vector<GCounter> remotes;
+  for (size_t i = 0; i < 16; i++) {
+    remotes.emplace_back("R" + std::to_string(i));
+  }
+  for (uint64_t i = 0; i < kMerges; i++) {
+    GCounter &remote = remotes[i % remotes.size()];
+    remote.increment(1);
+    shared.merge(remote.payload());
+  }
+  stop = true;
+  for (auto &reader : readers) {
+    reader.join();
+  }
+  expect(check, dead == 0, "a reader saw a freed replica");
+  expect(check, torn == 0, "a reader saw a query that doesn't match the payload");
+  expect(check, backwards == 0, "a reader saw the counter go back");
+  expect(check, shared.query() == kMerges, "merges were lost");
+  shared.update([](CanaryGCounter &) {});
+  expect(check, shared.retiredCount() == 0, "retired replicas weren't reclaimed");
+  report(check, failures_before);
+}
+
+// The same random assigns, clears and merges (of newer, older and equal
+// timestamps) on a SeqLockLWWRegister and on an LWWRegister leave them in
+// the same state. Then writers merge concurrently while readers check that
+// every value matches its timestamp.
+void checkSeqLockLWWRegister() {
+  const char *check = "check/seqlock";
+  if (!bench::config().selected(check)) {
+    return;
+  }
+  const size_t failures_before = failures;
+  {
+    SeqLockLWWRegister<uint64_t> seqlock("A");
+    LWWRegister<uint64_t> plain("A");
+    std::vector<LWWRegister<uint64_t>> remotes;
+    for (size_t i = 0; i < 4; i++) {
+      remotes.emplace_back("R" + std::to_string(i));
+    }
+    std::mt19937_64 rng(42);
+    bool same = true;
+    for (size_t i = 0; i < 10000; i++) {
+      const uint64_t value = rng();
+      LWWRegister<uint64_t> &remote = remotes[rng() % remotes.size()];
+      switch (rng() % 4) {
+        case 0:
+          seqlock.assign(value);
+          plain.assign(value);
+          break;
+        case 1:
+          seqlock.clear();
+          plain.clear();
+          break;
+        case 2:
+          remote.assign(value);
+          // fallthrough
+        default:
+          seqlock.merge(remote.payload());
+          plain.merge(remote.payload());
+          break;
+      }
+      same = same && seqlock.query() == plain.query() &&
+             seqlock.payload().timestamp() == plain.payload().timestamp();
+    }
+    expect(check, same, "SeqLockLWWRegister and LWWRegister diverged");
+  }
+
+  // Writer t assigns (time << 8 | t) at every time.
+  constexpr uint64_t kAssigns = 20000;
+  const size_t writers_count = checkThreads() / 2;
+  std::vector<size_t> hashed_names;
+  std::vector<LWWRegister<uint64_t>> remotes;
+  for (size_t t = 0; t < writers_count; t++) {
+    remotes.emplace_back("W" + std::to_string(t));
+    hashed_names.push_back((size_t)hashing::hash(remotes.back().name()));
+  }
+  SeqLockLWWRegister<uint64_t> shared("shared");
+  std::atomic<bool> stop{false};
+  std::atomic<uint64_t> torn{0};
+  std::vector<std::thread> readers;
+  for (size_t t = 0; t < checkThreads() - writers_count; t++) {
+    readers.emplace_back([&] {
+      while (!stop.load(std::memory_order_relaxed)) {
+        const auto payload = shared.payload();
+        if (const uint64_t *value = payload.query()) {
+          const auto &[time, replica] = payload.timestamp();
+          const size_t writer = *value & 0xff;
+          torn += *value >> 8 == time && writer < hashed_names.size() &&
+                          hashed_names[writer] == replica
+                      ? 0
+                      : 1;
+        }
+      }
+    });
+  }
+  std::vector<std::thread> writers;
+  for (size_t t = 0; t < writers_count; t++) {
+    writers.emplace_back([&, t] {
+      for (uint64_t time = 1; time <= kAssigns; time++) {
+        remotes[t].assign(time << 8 | t);
+        shared.merge(remotes[t].payload());
+      }
+    });
+  }
+  for (auto &writer : writers) {
+    writer.join();
+  }
+  stop = true;
+  for (auto &reader : readers) {
+    reader.join();
+  }
+  LWWRegister<uint64_t> plain("shared");
+  for (auto &remote : remotes) {
+    plain.merge(remote.payload());
+  }
+  expect(check, torn == 0, "a reader saw a value that doesn't match its timestamp");
+  expect(check,
+         shared.query() == plain.query() &&
+             shared.payload().timestamp() == plain.payload().timestamp(),
+         "concurrent merges ended in a different state than sequential ones");
+  report(check, failures_before);
+}
+
+// Threads add overlapping ranges of elements (and remove every third one
+// from 2PSets) while the payload of a plain replica is merged. The striped
+// set must end with what the plain set gets from the same operations in
+// sequence.
+template <typename Striped, typename Plain, bool kRemoves>
+void checkStripedSet(const char *check) {
+  if (!bench::config().selected(check)) {
+    return;
+  }
+  const size_t failures_before = failures;
+  constexpr uint64_t kElements = 20000;
+  const size_t threads_count = checkThreads();
+  auto removed = [](uint64_t element) { return kRemoves && element % 3 == 0; };
+  Striped striped("striped", 16);
+  Plain plain("plain");
+  for (size_t t = 0; t < threads_count; t++) {
+    for (uint64_t e = t * kElements / 2; e < t * kElements / 2 + kElements; e++) {
+      plain.add(e);
+    }
+  }
+  // The remote replica has elements of its own and tombstones for some of
+  // the elements the threads add.
+  Plain remote("remote");
+  const uint64_t last = (threads_count + 1) * kElements / 2;
+  for (uint64_t e = last - kElements; e < last + kElements; e++) {
+    remote.add(e);
+    if constexpr (kRemoves) {
+      if (e % 5 == 0) {
+        REQUIRE(remote.remove(e));
+      }
+    }
+  }
+  for (uint64_t e = 0; e < last + kElements; e++) {
+    if constexpr (kRemoves) {
+      if (removed(e) && plain.contains(e)) {
+        REQUIRE(plain.remove(e));
+      }
+    }
+  }
+  plain.merge(remote.payload());
+
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < threads_count; t++) {
+    threads.emplace_back([&, t] {
+      for (uint64_t e = t * kElements / 2; e < t * kElements / 2 + kElements; e++) {
+        striped.add(e);
+        if constexpr (kRemoves) {
+          if (removed(e)) {
+            REQUIRE(striped.remove(e));
+          }
+        }
+      }
+    });
+  }
+  striped.merge(remote.payload());
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  bool same_contains = true;
+  for (uint64_t e = 0; e < last + kElements; e++) {
+    same_contains = same_contains && striped.contains(e) == plain.contains(e);
+  }
+  Plain copy("copy");
+  copy.merge(striped.payload());
+  expect(check, striped.query() == plain.query(), "query() differs from the plain set");
+  expect(check, same_contains, "contains() differs from the plain set");
+  expect(check, copy.query() == plain.query(), "payload() differs from the plain set");
+  report(check, failures_before);
+}
+
+// }}}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  bench::config().parse(argc, argv);
+  verboseLogging() = false;
+  printf("%-56s %16s\n", "check", "result");
+  checkConcurrentReplica();
+  checkSeqLockLWWRegister();
+  checkStripedSet<StripedGSet<uint64_t>, GSet<uint64_t>, false>("check/striped/GSet");
+  checkStripedSet<Striped2PSet<uint64_t>, _2PSet<uint64_t>, true>("check/striped/2PSet");
+  if (failures) {
+    fprintf(stderr, "%zu check(s) failed.\n", failures);
+    return 1;
+  }
+
+  printf("\n%-56s %16s\n", "benchmark", "reads/s");
+
+  auto update_gcounter = [](auto &shared, uint64_t i) {
+    GCounter remote("R" + std::to_string(i % 64));
+    remote.increment(i);
+    shared.merge(remote.payload());
+  };
+  benchmarkReads<MutexReplica<GCounter>>("GCounter/mutex", update_gcounter);
+  benchmarkReads<ConcurrentReplica<GCounter>>("GCounter/rcu", update_gcounter);
+
+  auto update_lww = [](auto &shared, uint64_t i) {
+    LWWRegister<std::string> remote("R" + std::to_string(i % 64));
+    remote.assign("value-" + std::to_string(i));
+    shared.merge(remote.payload());
+  };
+  using StringRegister = LWWRegister<std::string>;
+  benchmarkReads<MutexReplica<StringRegister>>("LWWRegister<string>/mutex", update_lww);
+  benchmarkReads<ConcurrentReplica<StringRegister>>("LWWRegister<string>/rcu", update_lww);
+
+  auto update_lww_int = [](auto &shared, uint64_t i) {
+    LWWRegister<uint64_t> remote("R" + std::to_string(i % 64));
+    remote.assign(i);
+    shared.merge(remote.payload());
+  };
+  using IntRegister = LWWRegister<uint64_t>;
+  benchmarkReads<MutexReplica<IntRegister>>("LWWRegister<uint64_t>/mutex", update_lww_int);
+  benchmarkReads<ConcurrentReplica<IntRegister>>("LWWRegister<uint64_t>/rcu", update_lww_int);
+  benchmarkReads<SeqLockLWWRegister<uint64_t>>("LWWRegister<uint64_t>/seqlock", update_lww_int);
+
+  printf("\n%-56s %16s\n", "benchmark", "ops/s");
+  benchmarkSetOps<MutexReplica<_2PSet<uint64_t>>>("2PSet/mutex/add+contains");
+  benchmarkSetOps<Striped2PSet<uint64_t>>("2PSet/striped/add+contains");
+  benchmarkSetOps<MutexReplica<GSet<uint64_t>>>("GSet/mutex/add+contains");
+  benchmarkSetOps<StripedGSet<uint64_t>>("GSet/striped/add+contains");
+  return 0;
+}
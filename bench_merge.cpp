@@ -0,0 +1,291 @@
+// Copyright (C) 2020 Felipe O. Carvalho
+
+// Merge throughput and latency of every CRDT in crdt.h and sketch.h.
+//
+// Every benchmark merges the payload of replica B into replica A twice: into
+// a fresh copy of A (the copy is not timed) and into A after it has already
+// seen B (the steady state of anti-entropy, where merges are no-ops).
+//
+// "bytes/op" is the logical size of both payloads -- replica names, counters
+// and values -- which is what a merge has to read at least once.
+
+#include <cstdarg>
+#include <cstdio>
+#include <optional>
+#include <string>
+#include <vector>
+#include "bench.h"
+#include "crdt.h"
+#include "sharded.h"
+#include "sketch.h"
+
+namespace {
+
+constexpr size_t kReplicaNameLen = 16;
+
+std::string paddedName(const char *prefix, size_t i, size_t len) {
+  std::string name = prefix + std::to_string(i);
+  if (name.size() < len) {
+    name.append(len - name.size(), '.');
+  }
+  return name;
+}
+
+// Ranges [0, n) and [start, start + n) that share overlap * n elements.
+size_t overlapStart(size_t n, double overlap) { return n - (size_t)((double)n * overlap); }
+
+std::string suffix(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+std::string suffix(const char *fmt, ...) {
+  char buf[128];
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(buf, sizeof(buf), fmt, args);
+  va_end(args);
+  return buf;
+}
+
+template <typename CRDT>
+void benchmarkMerge(const std::string &name, const CRDT &a, const CRDT &b, double bytes) {
+  const auto &cfg = bench::config();
+  if (cfg.selected(name)) {
+    std::optional<CRDT> local;
+    const auto stats = bench::measure(
+        1, [&](size_t) { local.emplace(a); }, [&](size_t) { local->merge(b.payload()); });
+    bench::printRow(name, stats, bytes);
+  }
+  if (cfg.selected(name + "/noop")) {
+    CRDT local = a;
+    local.merge(b.payload());
+    const auto stats = bench::measure(1, [&](size_t) { local.merge(b.payload()); });
+    bench::printRow(name + "/noop", stats, bytes);
+  }
+}
+
+VersionVec makeVersionVec(size_t start, size_t n, uint64_t step) {
+  VersionVec v;
+  for (size_t i = start; i < start + n; i++) {
+    v.increment(paddedName("R", i, kReplicaNameLen), 1 + i % step);
+  }
+  return v;
+}
+
+void benchmarkGCounter(size_t n, double overlap) {
+  GCounter a("A");
+  GCounter b("B");
+  a.merge(makeVersionVec(0, n, 7));
+  b.merge(makeVersionVec(overlapStart(n, overlap), n, 5));
+  const double bytes = (double)(2 * n * (kReplicaNameLen + sizeof(uint64_t)));
+  benchmarkMerge("GCounter" + suffix("/n=%zu/overlap=%.2f", n, overlap), a, b, bytes);
+}
+
+void benchmarkPNCounter(size_t n, double overlap) {
+  PNCounter a("A");
+  PNCounter b("B");
+  const size_t start = overlapStart(n, overlap);
+  a.merge(PNCounter::Payload{makeVersionVec(0, n, 7), makeVersionVec(0, n, 3)});
+  b.merge(PNCounter::Payload{makeVersionVec(start, n, 5), makeVersionVec(start, n, 2)});
+  const double bytes = (double)(4 * n * (kReplicaNameLen + sizeof(uint64_t)));
+  benchmarkMerge("PNCounter" + suffix("/n=%zu/overlap=%.2f", n, overlap), a, b, bytes);
+}
+
+template <size_t N>
+FixedVersionVec<N> makeFixedVersionVec(uint64_t step) {
+  FixedVersionVec<N> v;
+  for (size_t i = 0; i < N; i++) {
+    v.increment(i, 1 + i % step);
+  }
+  return v;
+}
+
+// Same membership as the GCounter and PNCounter benchmarks with n = N and
+// overlap = 1, on version vectors with a slot per replica.
+template <size_t N>
+void benchmarkFixedCounters() {
+  FixedGCounter<N> a("A", 0);
+  FixedGCounter<N> b("B", 1);
+  a.merge(makeFixedVersionVec<N>(7));
+  b.merge(makeFixedVersionVec<N>(5));
+  const double bytes = (double)(2 * N * sizeof(uint64_t));
+  benchmarkMerge("FixedGCounter" + suffix("/n=%zu", N), a, b, bytes);
+
+  FixedPNCounter<N> c("A", 0);
+  FixedPNCounter<N> d("B", 1);
+  c.merge({makeFixedVersionVec<N>(7), makeFixedVersionVec<N>(3)});
+  d.merge({makeFixedVersionVec<N>(5), makeFixedVersionVec<N>(2)});
+  benchmarkMerge("FixedPNCounter" + suffix("/n=%zu", N), c, d, 2 * bytes);
+}
+
+void benchmarkLWWRegister(size_t value_size) {
+  LWWRegister<std::string> a("A");
+  LWWRegister<std::string> b("B");
+  a.assign(std::string(value_size, 'a'));
+  b.assign(std::string(value_size, 'b'));
+  b.assign(std::string(value_size, 'c'));  // B's timestamp is ahead of A's
+  const double bytes = (double)(2 * (value_size + 2 * sizeof(uint64_t)));
+  benchmarkMerge("LWWRegister" + suffix("/value=%zu", value_size), a, b, bytes);
+}
+
+// A and B each hold `siblings` concurrently written values, overlap *
+// siblings of which are common to both.
+void benchmarkMVRegister(size_t siblings, double overlap, size_t value_size) {
+  const size_t start = overlapStart(siblings, overlap);
+  std::vector<MVRegister<std::string>> writers;
+  for (size_t i = 0; i < start + siblings; i++) {
+    writers.emplace_back(paddedName("R", i, kReplicaNameLen));
+    writers.back().assign({paddedName("v", i, value_size)});
+  }
+  MVRegister<std::string> a = writers[0];
+  for (size_t i = 1; i < siblings; i++) {
+    a.merge(writers[i].payload());
+  }
+  MVRegister<std::string> b = writers[start];
+  for (size_t i = start + 1; i < start + siblings; i++) {
+    b.merge(writers[i].payload());
+  }
+  const size_t node_bytes = value_size + kReplicaNameLen + sizeof(uint64_t);
+  const double bytes = (double)(2 * siblings * node_bytes);
+  benchmarkMerge(
+      "MVRegister" + suffix("/siblings=%zu/overlap=%.2f/value=%zu", siblings, overlap, value_size),
+      a,
+      b,
+      bytes);
+}
+
+// A and B each added n elements, overlap * n of which are common to both, and
+// removed every 10th element they added.
+template <typename Set>
+void benchmark2PSet(const char *name, size_t n, double overlap, size_t value_size) {
+  Set a("A");
+  Set b("B");
+  const size_t start = overlapStart(n, overlap);
+  size_t removed = 0;
+  for (size_t i = 0; i < n; i++) {
+    a.add(paddedName("e", i, value_size));
+    b.add(paddedName("e", start + i, value_size));
+    if (i % 10 == 0) {
+      REQUIRE(a.remove(paddedName("e", i, value_size)));
+      REQUIRE(b.remove(paddedName("e", start + i, value_size)));
+      removed += 1;
+    }
+  }
+  const double bytes = (double)(2 * (n + removed) * value_size);
+  benchmarkMerge(
+      name + suffix("/n=%zu/overlap=%.2f/value=%zu", n, overlap, value_size), a, b, bytes);
+}
+
+// A and B each added n distinct elements, overlap * n of which are common
+// to both. Payloads of 1000 elements are sparse, larger ones dense.
+void benchmarkHyperLogLog(size_t n, double overlap) {
+  HyperLogLog<> a("A");
+  HyperLogLog<> b("B");
+  const size_t start = overlapStart(n, overlap);
+  for (size_t i = 0; i < n; i++) {
+    a.add(i);
+    b.add(start + i);
+  }
+  const double bytes = (double)(a.payload().encodedSize() + b.payload().encodedSize());
+  benchmarkMerge("HyperLogLog" + suffix("/n=%zu/overlap=%.2f", n, overlap), a, b, bytes);
+}
+
+// A and B each hold the sketches of n replicas, overlap * n of which are
+// common to both, and B's common sketches are newer.
+void benchmarkCountMinSketch(size_t n, double overlap) {
+  const size_t start = overlapStart(n, overlap);
+  std::vector<CountMinSketch<>> writers;
+  for (size_t i = 0; i < start + n; i++) {
+    writers.emplace_back(paddedName("R", i, kReplicaNameLen));
+    for (size_t j = 0; j < 100; j++) {
+      writers.back().add(paddedName("k", j * 7919 % 1000, 16));
+    }
+  }
+  CountMinSketch<> a("A");
+  for (size_t i = 0; i < n; i++) {
+    a.merge(writers[i].payload());
+  }
+  for (size_t i = start; i < n; i++) {
+    writers[i].add("newer");
+  }
+  CountMinSketch<> b("B");
+  for (size_t i = start; i < start + n; i++) {
+    b.merge(writers[i].payload());
+  }
+  const double bytes = (double)(a.payload().encodedSize() + b.payload().encodedSize());
+  benchmarkMerge("CountMinSketch" + suffix("/n=%zu/overlap=%.2f", n, overlap), a, b, bytes);
+}
+
+// Same as the CountMinSketch benchmark, with TopK summaries that are full.
+void benchmarkTopK(size_t n, double overlap) {
+  const size_t start = overlapStart(n, overlap);
+  std::vector<TopK<>> writers;
+  for (size_t i = 0; i < start + n; i++) {
+    writers.emplace_back(paddedName("R", i, kReplicaNameLen));
+    for (size_t j = 0; j < 100; j++) {
+      writers.back().add(paddedName("k", j * 7919 % 1000, 16));
+    }
+  }
+  TopK<> a("A");
+  for (size_t i = 0; i < n; i++) {
+    a.merge(writers[i].payload());
+  }
+  for (size_t i = start; i < n; i++) {
+    writers[i].add("newer");
+  }
+  TopK<> b("B");
+  for (size_t i = start; i < start + n; i++) {
+    b.merge(writers[i].payload());
+  }
+  const double bytes = (double)(a.payload().encodedSize() + b.payload().encodedSize());
+  benchmarkMerge("TopK" + suffix("/n=%zu/overlap=%.2f", n, overlap), a, b, bytes);
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  bench::config().parse(argc, argv);
+  verboseLogging() = false;
+  bench::printHeader(true);
+  for (size_t n : {4, 64, 1024, 10000}) {
+    for (double overlap : {0.0, 0.5, 1.0}) {
+      benchmarkGCounter(n, overlap);
+      benchmarkPNCounter(n, overlap);
+    }
+  }
+  benchmarkFixedCounters<4>();
+  benchmarkFixedCounters<64>();
+  for (size_t value_size : {8, 256, 4096}) {
+    benchmarkLWWRegister(value_size);
+  }
+  for (size_t siblings : {1, 4, 16, 64}) {
+    for (double overlap : {0.0, 0.5, 1.0}) {
+      for (size_t value_size : {8, 256}) {
+        benchmarkMVRegister(siblings, overlap, value_size);
+      }
+    }
+  }
+  for (size_t n : {16, 1024, 65536}) {
+    for (double overlap : {0.0, 0.5, 1.0}) {
+      for (size_t value_size : {8, 64}) {
+        benchmark2PSet<_2PSet<std::string>>("2PSet", n, overlap, value_size);
+      }
+    }
+  }
+  for (size_t n : {1000, 100000}) {
+    for (double overlap : {0.0, 0.5}) {
+      benchmarkHyperLogLog(n, overlap);
+    }
+  }
+  for (size_t n : {4, 64}) {
+    for (double overlap : {0.0, 0.5, 1.0}) {
+      benchmarkCountMinSketch(n, overlap);
+      benchmarkTopK(n, overlap);
+    }
+  }
+  for (size_t n : {65536, 1 << 20}) {
+    for (double overlap : {0.0, 0.5}) {
+      benchmark2PSet<_2PSet<std::string>>("2PSet", n, overlap, 16);
+      benchmark2PSet<Sharded2PSet<std::string>>("Sharded2PSet", n, overlap, 16);
+    }
+  }
+  return 0;
+}
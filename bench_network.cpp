@@ -0,0 +1,333 @@
+// Copyright (C) 2020 Felipe O. Carvalho
+
+// Convergence time and message cost of the network topologies in network.h.
+//
+// N replicas of the chosen CRDT run a random update workload for a number of
+// rounds (optionally with random disconnects). Then every replica is brought
+// back online and sync rounds run until all replicas agree. The table reports
+// the rounds, messages, merges (payloads the receivers merged; digest-only
+// messages aren't merged), bytes and wall time (of the sync rounds only) it
+// took to converge after the workload stopped.
+//
+// Usage: bench_network [--topology=p2p|star|ring] [--crdt=gcounter|pncounter|
+//   lww|mvregister|2pset|hll|cms|topk] [--replicas=N] [--rounds=R] [--updates=U]
+//   [--disconnect=P] [--seed=S] [--max-rounds=M] [--json-metrics]
+//   [--trace=FILE] [--record=FILE] [--lazy] [--full-state]
+//
+// --json-metrics enables merge instrumentation and prints the metrics of the
+// whole run (workload and convergence rounds) and the memory held by all
+// replica payloads at the end as JSON after each row.
+//
+// --trace=FILE records merges, queries and network operations and writes them
+// to FILE in the Chrome trace-event format.
+//
+// --record=FILE writes the workload (updates, disconnects and sync rounds) to
+// FILE so that bench_replay can replay it. It needs --topology, --crdt and
+// --replicas since only a single run can be recorded.
+//
+// --lazy wraps every replica in a LazyReplica, which defers merges until the
+// replica is read.
+//
+// --full-state wraps every replica in a FullStateReplica, which makes the
+// networks ship full state on every sync instead of using the digests,
+// deltas and batch merges the CRDT supports (see traits.h).
+//
+// Options that are not given are swept over.
+
+#include <chrono>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <optional>
+#include <random>
+#include <string>
+#include <vector>
+#include "crdt.h"
+#include "lazy.h"
+#include "lib.h"
+#include "network.h"
+#include "sketch.h"
+#include "traits.h"
+#include "workload.h"
+
+namespace {
+
+struct Params {
+  const char *topology = nullptr;
+  const char *crdt = nullptr;
+  size_t replicas = 0;
+  size_t rounds = 10;
+  size_t updates = 0;  // per round, defaults to the number of replicas
+  double disconnect = 0;
+  uint64_t seed = 42;
+  size_t max_rounds = 100000;
+  bool json_metrics = false;
+  const char *trace_path = nullptr;
+  const char *record_path = nullptr;
+  bool lazy = false;
+  bool full_state = false;
+};
+
+using Rng = std::mt19937_64;
+
+// Random updates
+
+std::string randomString(Rng &rng, size_t keyspace) {
+  return "v" + std::to_string(rng() % keyspace);
+}
+
+template <typename CRDT>
+WorkloadOp randomUpdate(Rng &rng, uint32_t replica);
+
+template <>
+WorkloadOp randomUpdate<GCounter>(Rng &rng, uint32_t replica) {
+  return {WorkloadOpCode::kIncrement, replica, (int64_t)(1 + rng() % 10), {}};
+}
+
+template <>
+WorkloadOp randomUpdate<PNCounter>(Rng &rng, uint32_t replica) {
+  return {WorkloadOpCode::kIncrement, replica, (int64_t)(rng() % 21) - 10, {}};
+}
+
+template <>
+WorkloadOp randomUpdate<LWWRegister<std::string>>(Rng &rng, uint32_t replica) {
+  return {WorkloadOpCode::kAssign, replica, 0, {randomString(rng, 1000)}};
+}
+
+template <>
+WorkloadOp randomUpdate<MVRegister<std::string>>(Rng &rng, uint32_t replica) {
+  return {WorkloadOpCode::kAssign, replica, 0, {randomString(rng, 1000)}};
+}
+
+template <>
+WorkloadOp randomUpdate<_2PSet<std::string>>(Rng &rng, uint32_t replica) {
+  const auto code = rng() % 4 == 0 ? WorkloadOpCode::kRemove : WorkloadOpCode::kAdd;
+  return {code, replica, 0, {randomString(rng, 10000)}};
+}
+
+template <>
+WorkloadOp randomUpdate<HyperLogLog<>>(Rng &rng, uint32_t replica) {
+  return {WorkloadOpCode::kAdd, replica, 0, {randomString(rng, 10000)}};
+}
+
+template <>
+WorkloadOp randomUpdate<CountMinSketch<>>(Rng &rng, uint32_t replica) {
+  return {WorkloadOpCode::kAdd, replica, 0, {randomString(rng, 10000)}};
+}
+
+template <>
+WorkloadOp randomUpdate<TopK<>>(Rng &rng, uint32_t replica) {
+  // Zipf-like: item i is picked with probability ~1/i.
+  const double u = std::uniform_real_distribution<double>(0, 1)(rng);
+  return {WorkloadOpCode::kAdd, replica, 0, {"v" + std::to_string((size_t)std::exp(u * 9))}};
+}
+
+// Replica is CRDT or a wrapper of it, like LazyReplica<CRDT>.
+template <template <typename> class Network, typename CRDT, typename Replica>
+void run(const char *topology, const char *crdt, const Params &params, size_t n) {
+  Rng rng(params.seed);
+  std::bernoulli_distribution disconnect(params.disconnect);
+  std::bernoulli_distribution reconnect(0.5);
+  const size_t updates = params.updates ? params.updates : n;
+
+  std::optional<WorkloadRecorder> recorder;
+  if (params.record_path) {
+    recorder.emplace((uint32_t)n);
+  }
+  WorkloadRunner<Network, Replica> runner(n, recorder ? &*recorder : nullptr);
+  auto &network = runner.network();
+  const WorkloadOp sync_round{syncRoundOpCode<Network<Replica>>(), 0, 0, {}};
+
+  std::vector<bool> offline(n, false);
+  for (size_t round = 0; round < params.rounds; round++) {
+    for (size_t u = 0; u < updates; u++) {
+      runner.apply(randomUpdate<CRDT>(rng, (uint32_t)(rng() % n)));
+    }
+    if (params.disconnect > 0) {
+      for (size_t i = 0; i < n; i++) {
+        if (!offline[i] && disconnect(rng)) {
+          runner.apply({WorkloadOpCode::kDisconnect, (uint32_t)i, 0, {}});
+          offline[i] = true;
+        } else if (offline[i] && reconnect(rng)) {
+          runner.apply({WorkloadOpCode::kReconnect, (uint32_t)i, 0, {}});
+          offline[i] = false;
+        }
+      }
+    }
+    runner.apply(sync_round);
+  }
+  for (size_t i = 0; i < n; i++) {
+    if (offline[i]) {
+      runner.apply({WorkloadOpCode::kReconnect, (uint32_t)i, 0, {}});
+    }
+  }
+
+  const NetworkTraffic before = network.traffic();
+  size_t rounds = 0;
+  std::chrono::steady_clock::duration elapsed{};
+  while (network.countPartitions() != 1 && rounds < params.max_rounds) {
+    const auto start = std::chrono::steady_clock::now();
+    runner.apply(sync_round);
+    elapsed += std::chrono::steady_clock::now() - start;
+    rounds += 1;
+  }
+  const NetworkTraffic &after = network.traffic();
+  const double ms =
+      (double)std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count() / 1e3;
+  printf("%-6s %-12s %8zu %8zu %12" PRIu64 " %12" PRIu64 " %14" PRIu64 " %12.3f%s\n",
+         topology,
+         crdt,
+         n,
+         rounds,
+         after.messages - before.messages,
+         after.merges - before.merges,
+         after.bytes - before.bytes,
+         ms,
+         rounds == params.max_rounds ? "  (did not converge)" : "");
+  if (params.json_metrics) {
+    MemoryUsage memory;
+    for (auto &replica : runner.replicas()) {
+      memory += replica.payload().memoryUsage();
+    }
+    printf("{\"network\": %s, \"memory\": %s}\n",
+           network.metrics().toJSON().c_str(),
+           memory.toJSON().c_str());
+  }
+  if (recorder && !recorder->save(params.record_path)) {
+    fprintf(stderr, "Could not write workload to '%s'.\n", params.record_path);
+    exit(1);
+  }
+  fflush(stdout);
+}
+
+template <template <typename> class Network, typename CRDT, typename Replica>
+void runFullState(const char *topology, const char *crdt, const Params &params, size_t n) {
+  if (params.full_state) {
+    run<Network, CRDT, FullStateReplica<Replica>>(topology, crdt, params, n);
+  } else {
+    run<Network, CRDT, Replica>(topology, crdt, params, n);
+  }
+}
+
+template <template <typename> class Network, typename CRDT>
+void run(const char *topology, const char *crdt, const Params &params, size_t n) {
+  if (params.lazy) {
+    runFullState<Network, CRDT, LazyReplica<CRDT>>(topology, crdt, params, n);
+  } else {
+    runFullState<Network, CRDT, CRDT>(topology, crdt, params, n);
+  }
+}
+
+bool selected(const char *option, const char *value) {
+  return !option || strcmp(option, value) == 0;
+}
+
+template <template <typename> class Network>
+void runTopology(const char *topology, const Params &params, size_t n) {
+  if (!selected(params.topology, topology)) {
+    return;
+  }
+  if (selected(params.crdt, "gcounter")) {
+    run<Network, GCounter>(topology, "gcounter", params, n);
+  }
+  if (selected(params.crdt, "pncounter")) {
+    run<Network, PNCounter>(topology, "pncounter", params, n);
+  }
+  if (selected(params.crdt, "lww")) {
+    run<Network, LWWRegister<std::string>>(topology, "lww", params, n);
+  }
+  if (selected(params.crdt, "mvregister")) {
+    run<Network, MVRegister<std::string>>(topology, "mvregister", params, n);
+  }
+  if (selected(params.crdt, "2pset")) {
+    run<Network, _2PSet<std::string>>(topology, "2pset", params, n);
+  }
+  if (selected(params.crdt, "hll")) {
+    run<Network, HyperLogLog<>>(topology, "hll", params, n);
+  }
+  if (selected(params.crdt, "cms")) {
+    run<Network, CountMinSketch<>>(topology, "cms", params, n);
+  }
+  if (selected(params.crdt, "topk")) {
+    run<Network, TopK<>>(topology, "topk", params, n);
+  }
+}
+
+Params parseParams(int argc, char *argv[]) {
+  Params params;
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    const char *eq = strchr(arg, '=');
+    const std::string key(arg, eq ? (size_t)(eq - arg) : strlen(arg));
+    const char *value = eq ? eq + 1 : "";
+    if (key == "--topology") {
+      params.topology = value;
+    } else if (key == "--crdt") {
+      params.crdt = value;
+    } else if (key == "--replicas") {
+      params.replicas = strtoull(value, nullptr, 10);
+    } else if (key == "--rounds") {
+      params.rounds = strtoull(value, nullptr, 10);
+    } else if (key == "--updates") {
+      params.updates = strtoull(value, nullptr, 10);
+    } else if (key == "--disconnect") {
+      params.disconnect = atof(value);
+    } else if (key == "--seed") {
+      params.seed = strtoull(value, nullptr, 10);
+    } else if (key == "--max-rounds") {
+      params.max_rounds = strtoull(value, nullptr, 10);
+    } else if (key == "--json-metrics") {
+      params.json_metrics = true;
+    } else if (key == "--trace") {
+      params.trace_path = value;
+    } else if (key == "--record") {
+      params.record_path = value;
+    } else if (key == "--lazy") {
+      params.lazy = true;
+    } else if (key == "--full-state") {
+      params.full_state = true;
+    } else {
+      fprintf(stderr, "Unknown option '%s'.\n", arg);
+      exit(1);
+    }
+  }
+  if (params.record_path && (!params.topology || !params.crdt || !params.replicas)) {
+    fprintf(stderr, "--record needs --topology, --crdt and --replicas.\n");
+    exit(1);
+  }
+  return params;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  const Params params = parseParams(argc, argv);
+  verboseLogging() = false;
+  metricsEnabled() = params.json_metrics;
+  tracingEnabled() = params.trace_path != nullptr;
+  printf("%-6s %-12s %8s %8s %12s %12s %14s %12s\n",
+         "topo",
+         "crdt",
+         "replicas",
+         "rounds",
+         "messages",
+         "merges",
+         "bytes",
+         "wall ms");
+  std::vector<size_t> replica_counts = {8, 64, 256};
+  if (params.replicas) {
+    replica_counts = {params.replicas};
+  }
+  for (size_t n : replica_counts) {
+    runTopology<P2PNetwork>("p2p", params, n);
+    runTopology<StarNetwork>("star", params, n);
+    runTopology<RingNetwork>("ring", params, n);
+  }
+  if (params.trace_path && !Tracer::instance().writeChromeTrace(params.trace_path)) {
+    fprintf(stderr, "Could not write trace to '%s'.\n", params.trace_path);
+    return 1;
+  }
+  return 0;
+}
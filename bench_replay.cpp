@@ -0,0 +1,158 @@
+// Copyright (C) 2020 Felipe O. Carvalho
+
+// Replays a recorded workload (see workload.h) at full speed.
+//
+// The trace is decoded up front, so only applying the operations is timed.
+// Each selected CRDT type and topology replays the same trace, which makes it
+// possible to compare implementations on identical, production-shaped
+// traffic. Operations a CRDT or topology doesn't support are skipped.
+//
+// Usage: bench_replay TRACE [--topology=p2p|star|ring] [--crdt=gcounter|
+//   pncounter|lww|mvregister|2pset|hll|cms|topk] [--repeat=N]
+//
+// Options that are not given are swept over. The fastest of N (default 3)
+// replays is reported.
+
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <optional>
+#include <string>
+#include "crdt.h"
+#include "lib.h"
+#include "network.h"
+#include "sketch.h"
+#include "workload.h"
+
+namespace {
+
+struct Params {
+  const char *trace_path = nullptr;
+  const char *topology = nullptr;
+  const char *crdt = nullptr;
+  size_t repeat = 3;
+};
+
+template <template <typename> class Network, typename CRDT>
+void replay(const char *topology, const char *crdt, const WorkloadTrace &trace, size_t repeat) {
+  std::optional<WorkloadRunner<Network, CRDT>> runner;
+  double best_ms = -1;
+  for (size_t r = 0; r < repeat; r++) {
+    runner.emplace(trace.replicas);
+    const auto start = std::chrono::steady_clock::now();
+    for (auto &op : trace.ops) {
+      runner->apply(op);
+    }
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    const double ms =
+        (double)std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count() / 1e3;
+    if (best_ms < 0 || ms < best_ms) {
+      best_ms = ms;
+    }
+  }
+  const auto &traffic = runner->network().traffic();
+  printf("%-6s %-12s %10zu %10" PRIu64 " %10" PRIu64 " %12.3f %12.0f %10d %12" PRIu64
+         " %14" PRIu64 "\n",
+         topology,
+         crdt,
+         trace.ops.size(),
+         runner->applied(),
+         runner->skipped(),
+         best_ms,
+         best_ms > 0 ? (double)trace.ops.size() * 1e3 / best_ms : 0,
+         runner->network().countPartitions(),
+         traffic.messages,
+         traffic.bytes);
+  fflush(stdout);
+}
+
+bool selected(const char *option, const char *value) {
+  return !option || strcmp(option, value) == 0;
+}
+
+template <template <typename> class Network>
+void replayTopology(const char *topology, const Params &params, const WorkloadTrace &trace) {
+  if (!selected(params.topology, topology)) {
+    return;
+  }
+  if (selected(params.crdt, "gcounter")) {
+    replay<Network, GCounter>(topology, "gcounter", trace, params.repeat);
+  }
+  if (selected(params.crdt, "pncounter")) {
+    replay<Network, PNCounter>(topology, "pncounter", trace, params.repeat);
+  }
+  if (selected(params.crdt, "lww")) {
+    replay<Network, LWWRegister<std::string>>(topology, "lww", trace, params.repeat);
+  }
+  if (selected(params.crdt, "mvregister")) {
+    replay<Network, MVRegister<std::string>>(topology, "mvregister", trace, params.repeat);
+  }
+  if (selected(params.crdt, "2pset")) {
+    replay<Network, _2PSet<std::string>>(topology, "2pset", trace, params.repeat);
+  }
+  if (selected(params.crdt, "hll")) {
+    replay<Network, HyperLogLog<>>(topology, "hll", trace, params.repeat);
+  }
+  if (selected(params.crdt, "cms")) {
+    replay<Network, CountMinSketch<>>(topology, "cms", trace, params.repeat);
+  }
+  if (selected(params.crdt, "topk")) {
+    replay<Network, TopK<>>(topology, "topk", trace, params.repeat);
+  }
+}
+
+Params parseParams(int argc, char *argv[]) {
+  Params params;
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    const char *eq = strchr(arg, '=');
+    const std::string key(arg, eq ? (size_t)(eq - arg) : strlen(arg));
+    const char *value = eq ? eq + 1 : "";
+    if (key == "--topology") {
+      params.topology = value;
+    } else if (key == "--crdt") {
+      params.crdt = value;
+    } else if (key == "--repeat") {
+      params.repeat = std::max<size_t>(1, strtoull(value, nullptr, 10));
+    } else if (arg[0] != '-' && !params.trace_path) {
+      params.trace_path = arg;
+    } else {
+      fprintf(stderr, "Unknown option '%s'.\n", arg);
+      exit(1);
+    }
+  }
+  if (!params.trace_path) {
+    fprintf(stderr, "Usage: %s TRACE [--topology=T] [--crdt=C] [--repeat=N]\n", argv[0]);
+    exit(1);
+  }
+  return params;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  const Params params = parseParams(argc, argv);
+  verboseLogging() = false;
+  const auto trace = WorkloadTrace::load(params.trace_path);
+  if (!trace) {
+    fprintf(stderr, "Could not load workload from '%s'.\n", params.trace_path);
+    return 1;
+  }
+  printf("%-6s %-12s %10s %10s %10s %12s %12s %10s %12s %14s\n",
+         "topo",
+         "crdt",
+         "ops",
+         "applied",
+         "skipped",
+         "wall ms",
+         "ops/s",
+         "partitions",
+         "messages",
+         "bytes");
+  replayTopology<P2PNetwork>("p2p", params, *trace);
+  replayTopology<StarNetwork>("star", params, *trace);
+  replayTopology<RingNetwork>("ring", params, *trace);
+  return 0;
+}
@@ -0,0 +1,178 @@
+// Copyright (C) 2020 Felipe O. Carvalho
+
+// Cost of syncing a keyspace of GCounters from one ReplicaStore to another
+// after a fraction of the objects changed.
+//
+// "per-object" sends every object in its own message, which is what running
+// a network per object amounts to. "batched" sends a single syncBatch() with
+// the objects that changed since the previous sync. Updates happen between
+// syncs and are not timed. "per-core" sends the batches of a PerCoreStore,
+// one per core, which its cores build in parallel. Allocations are only
+// counted on the calling thread, so they don't include the work of cores.
+//
+// The second table compares the throughput of local updates applied to a
+// ReplicaStore by the calling thread with updates routed to the cores of a
+// PerCoreStore.
+//
+// Usage: bench_store [--min-time-ms=N] [--quick] [--filter=SUBSTRING]
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+#include "bench.h"
+#include "crdt.h"
+#include "per_core.h"
+#include "store.h"
+
+namespace {
+
+using Store = ReplicaStore<GCounter>;
+
+std::string key(size_t i) { return "object-" + std::to_string(i); }
+
+struct SyncCost {
+  uint64_t messages = 0;
+  uint64_t bytes = 0;
+};
+
+SyncCost syncPerObject(const Store &from, Store &to) {
+  SyncCost cost;
+  from.forEach([&](const std::string &key, const GCounter &counter) {
+    cost.messages += 1;
+    cost.bytes += encodedSize(key) + counter.payload().encodedSize();
+    to.update(key, [&](GCounter &local) { local.merge(counter.payload()); });
+  });
+  return cost;
+}
+
+SyncCost syncBatched(Store &from, Store &to) {
+  const auto batch = from.syncBatch(to.name());
+  to.merge(from.name(), batch);
+  return {1, batch.encodedSize()};
+}
+
+template <typename PerCore>
+SyncCost syncPerCore(PerCore &from, PerCore &to) {
+  auto batches = from.syncBatches(to.name());
+  SyncCost cost{batches.size(), 0};
+  for (auto &batch : batches) {
+    cost.bytes += batch.encodedSize();
+  }
+  to.merge(from.name(), std::move(batches));
+  to.drain();
+  return cost;
+}
+
+std::string benchmarkName(const char *name, size_t objects, double dirty_fraction) {
+  char buf[128];
+  snprintf(buf, sizeof(buf), "%s/objects=%zu/dirty=%g%%", name, objects, dirty_fraction * 100);
+  return buf;
+}
+
+const size_t kCores = std::max(1u, std::thread::hardware_concurrency());
+
+// Makes a and b hold the same objects, then times sync(a, b) after every
+// round of updates to a.
+template <typename S, typename Sync>
+void benchmarkSync(const std::string &name,
+                   S &a,
+                   S &b,
+                   size_t objects,
+                   double dirty_fraction,
+                   Sync &&sync) {
+  for (size_t i = 0; i < objects; i++) {
+    a.update(key(i), [](GCounter &counter) { counter.increment(1); });
+  }
+  sync(a, b);
+
+  const size_t dirty = std::max<size_t>(1, (size_t)((double)objects * dirty_fraction));
+  size_t next = 0;
+  SyncCost cost;
+  const bench::Stats stats = bench::measure(
+      1,
+      [&](size_t) {
+        for (size_t i = 0; i < dirty; i++) {
+          a.update(key(next), [](GCounter &counter) { counter.increment(1); });
+          next = (next + 7919) % objects;
+        }
+      },
+      [&](size_t) { cost = sync(a, b); });
+  printf("%-48s %12.3f %12.0f %12" PRIu64 " %14" PRIu64 "\n",
+         name.c_str(),
+         stats.nsPerOp() / 1e6,
+         stats.allocs_per_op,
+         cost.messages,
+         cost.bytes);
+  fflush(stdout);
+}
+
+void benchmarkStores(size_t objects, double dirty_fraction) {
+  std::string name = benchmarkName("per-object", objects, dirty_fraction);
+  if (bench::config().selected(name)) {
+    Store a("A");
+    Store b("B");
+    benchmarkSync(name, a, b, objects, dirty_fraction, syncPerObject);
+  }
+  name = benchmarkName("batched", objects, dirty_fraction);
+  if (bench::config().selected(name)) {
+    Store a("A");
+    Store b("B");
+    benchmarkSync(name, a, b, objects, dirty_fraction, syncBatched);
+  }
+  name = benchmarkName("per-core", objects, dirty_fraction) + "/cores=" + std::to_string(kCores);
+  if (bench::config().selected(name)) {
+    PerCoreStore<GCounter> a("A", kCores);
+    PerCoreStore<GCounter> b("B", kCores);
+    benchmarkSync(name, a, b, objects, dirty_fraction, syncPerCore<PerCoreStore<GCounter>>);
+  }
+}
+
+constexpr size_t kUpdateObjects = 100000;
+constexpr size_t kUpdateBatch = 10000;
+
+void benchmarkUpdates() {
+  std::vector<std::string> keys;
+  for (size_t i = 0; i < kUpdateObjects; i++) {
+    keys.push_back(key(i));
+  }
+  auto increment = [](GCounter &counter) { counter.increment(1); };
+  if (bench::config().selected("store/update")) {
+    Store store("A");
+    bench::printRow("store/update", bench::measure(kUpdateBatch, [&](size_t i) {
+                      store.update(keys[i * 7919 % kUpdateObjects], increment);
+                    }));
+  }
+  for (size_t cores = 1; cores <= kCores; cores *= 2) {
+    const std::string name = "per-core/update/cores=" + std::to_string(cores);
+    if (bench::config().selected(name)) {
+      PerCoreStore<GCounter> store("A", cores);
+      bench::printRow(name, bench::measure(kUpdateBatch, [&](size_t i) {
+                        store.update(keys[i * 7919 % kUpdateObjects], increment);
+                        if (i == kUpdateBatch - 1) {
+                          store.drain();
+                        }
+                      }));
+    }
+  }
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  bench::config().parse(argc, argv);
+  verboseLogging() = false;
+  printf("%-48s %12s %12s %12s %14s\n", "benchmark", "ms/sync", "allocs/sync", "messages", "bytes");
+  for (size_t objects : {10000, 100000}) {
+    for (double dirty_fraction : {0.001, 0.01, 0.1}) {
+      benchmarkStores(objects, dirty_fraction);
+    }
+  }
+  putchar('\n');
+  bench::printHeader();
+  benchmarkUpdates();
+  return 0;
+}
@@ -0,0 +1,122 @@
+// Copyright (C) 2020 Felipe O. Carvalho
+
+// Micro-benchmarks for VersionVec.
+//
+// Sweeps the number of replicas, the fraction of replica names two version
+// vectors have in common and the length of the replica names.
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "bench.h"
+#include "crdt.h"
+
+namespace {
+
+std::string replicaName(size_t i, size_t len) {
+  std::string name = std::to_string(i);
+  if (name.size() < len) {
+    name.insert(0, len - name.size(), '#');
+  }
+  return name;
+}
+
+struct Fixture {
+  std::vector<std::string> a_names;
+  std::vector<std::string> b_names;
+  VersionVec a;
+  VersionVec b;
+  VersionVec joined;  // a merged with b
+
+  // a and b both have n replicas, overlap * n of which are shared.
+  Fixture(size_t n, double overlap, size_t name_len) {
+    const size_t b_start = n - (size_t)((double)n * overlap);
+    for (size_t i = 0; i < n; i++) {
+      a_names.push_back(replicaName(i, name_len));
+      b_names.push_back(replicaName(b_start + i, name_len));
+      a.increment(a_names.back(), 1 + i % 7);
+      b.increment(b_names.back(), 1 + i % 5);
+    }
+    joined = a;
+    joined.merge(b);
+  }
+};
+
+void benchmarkFixture(size_t n, double overlap, size_t name_len) {
+  const auto &cfg = bench::config();
+  char buf[64];
+  snprintf(buf, sizeof(buf), "/n=%zu/overlap=%.2f/len=%zu", n, overlap, name_len);
+  const std::string suffix = buf;
+
+  Fixture f(n, overlap, name_len);
+  const size_t batch = std::max<size_t>(1, 4096 / n);
+
+  if (cfg.selected("increment" + suffix)) {
+    VersionVec v = f.a;
+    const auto stats = bench::measure(1024, [&](size_t i) { v.increment(f.a_names[i % n], 1); });
+    bench::printRow("increment" + suffix, stats);
+  }
+
+  if (cfg.selected("merge" + suffix)) {
+    // Merging into a fresh copy of a every time. The copies are made outside
+    // of the timed region.
+    std::vector<VersionVec> copies;
+    const auto stats = bench::measure(
+        batch,
+        [&](size_t batch) { copies.assign(batch, f.a); },
+        [&](size_t i) { copies[i].merge(f.b); });
+    bench::printRow("merge" + suffix, stats);
+  }
+
+  if (cfg.selected("merge_noop" + suffix)) {
+    // Steady state: everything in b is already known locally.
+    VersionVec v = f.joined;
+    const auto stats = bench::measure(batch, [&](size_t) { v.merge(f.b); });
+    bench::printRow("merge_noop" + suffix, stats);
+  }
+
+  if (cfg.selected("lt" + suffix)) {
+    const auto stats = bench::measure(batch, [&](size_t) { bench::doNotOptimize(f.a < f.joined); });
+    bench::printRow("lt" + suffix, stats);
+  }
+
+  if (cfg.selected("leq" + suffix)) {
+    const auto stats =
+        bench::measure(batch, [&](size_t) { bench::doNotOptimize(f.a <= f.joined); });
+    bench::printRow("leq" + suffix, stats);
+  }
+
+  if (cfg.selected("eq" + suffix)) {
+    VersionVec copy = f.joined;
+    const auto stats =
+        bench::measure(batch, [&](size_t) { bench::doNotOptimize(copy == f.joined); });
+    bench::printRow("eq" + suffix, stats);
+  }
+
+  if (cfg.selected("max" + suffix)) {
+    const auto stats = bench::measure(batch, [&](size_t) { bench::doNotOptimize(f.joined.max()); });
+    bench::printRow("max" + suffix, stats);
+  }
+
+  if (cfg.selected("hash" + suffix)) {
+    std::hash<VersionVec> hasher;
+    const auto stats =
+        bench::measure(batch, [&](size_t) { bench::doNotOptimize(hasher(f.joined)); });
+    bench::printRow("hash" + suffix, stats);
+  }
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  bench::config().parse(argc, argv);
+  bench::printHeader();
+  for (size_t n : {2, 16, 128, 1024, 10000}) {
+    for (double overlap : {0.0, 0.5, 1.0}) {
+      for (size_t name_len : {8, 32, 128}) {
+        benchmarkFixture(n, overlap, name_len);
+      }
+    }
+  }
+  return 0;
+}
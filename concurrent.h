@@ -0,0 +1,616 @@
+// Copyright (C) 2020 Felipe O. Carvalho
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "crdt.h"
+#include "thread_pool.h"
+
+// Concurrent replicas
+//
+// The CRDTs in crdt.h are not thread-safe. The wrappers in this file let
+// many threads read a replica while others update it.
+
+// Epoch-based reclamation {{{
+
+// Readers announce the epoch they started reading in; memory retired in an
+// epoch can be freed once no reader announced that epoch or an earlier one.
+// Announcing takes a fixed number of atomic operations, so reading is
+// wait-free. Each reading thread claims a slot the first time it reads and
+// releases it when it exits. At most kMaxThreads threads can be reading at
+// once: the process aborts when one more tries to claim a slot.
+class EpochDomain {
+ public:
+  static constexpr size_t kMaxThreads = 256;
+
+  static EpochDomain &instance() {
+    static EpochDomain domain;
+    return domain;
+  }
+
+  // Critical sections nest: only the outermost one announces an epoch.
+  void enter() {
+    ThreadState &state = threadState();
+    if (state.depth++ == 0) {
+      _slots[state.slot].epoch.store(_epoch.load());
+    }
+  }
+
+  void exit() {
+    ThreadState &state = threadState();
+    assert(state.depth > 0);
+    if (--state.depth == 0) {
+      _slots[state.slot].epoch.store(0);
+    }
+  }
+
+  // Called after the retired memory was unpublished: readers that start
+  // after this call can't reach it anymore.
+  uint64_t retireEpoch() { return _epoch.fetch_add(1); }
+
+  // Whether memory retired in the given epoch can be freed.
+  bool safeToReclaim(uint64_t retire_epoch) const {
+    for (auto &slot : _slots) {
+      const uint64_t epoch = slot.epoch.load();
+      if (epoch != 0 && epoch <= retire_epoch) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+ private:
+  struct alignas(64) Slot {
+    std::atomic<bool> claimed{false};
+    std::atomic<uint64_t> epoch{0};  // 0 when not reading
+  };
+
+  struct ThreadState {
+    EpochDomain *domain;
+    size_t slot;
+    size_t depth = 0;
+
+    explicit ThreadState(EpochDomain *d) : domain(d), slot(d->claimSlot()) {}
+    ~ThreadState() { domain->_slots[slot].claimed.store(false); }
+  };
+
+  EpochDomain() = default;
+
+  ThreadState &threadState() {
+    static thread_local ThreadState state(this);
+    return state;
+  }
+
+  size_t claimSlot() {
+    for (size_t i = 0; i < kMaxThreads; i++) {
+      bool expected = false;
+      if (_slots[i].claimed.compare_exchange_strong(expected, true)) {
+        return i;
+      }
+    }
+    fprintf(stderr, "EpochDomain: more than %zu threads are reading replicas.\n", kMaxThreads);
+    abort();
+  }
+
+  std::atomic<uint64_t> _epoch{1};
+  Slot _slots[kMaxThreads];
+};
+
+// }}}
+
+// RCU replicas {{{
+
+// Wraps a CRDT so that readers get consistent snapshots without locks while
+// writers update it. Writers are serialized: each write copies the current
+// replica, applies the update to the private copy and publishes the copy
+// with an atomic pointer swap. The replaced copy is freed once no reader can
+// still be looking at it.
+//
+// Writes cost a full copy of the replica, so this pays off for read-mostly
+// replicas with small payloads: counters and registers.
+//
+//   ConcurrentReplica<GCounter> counter("A");
+//   counter.update([](GCounter &c) { c.increment(1); });  // any thread
+//   counter.merge(payload);                               // any thread
+//   auto value = counter.query();                          // any thread
+template <typename CRDT>
+class ConcurrentReplica {
+ public:
+  using Payload = typename CRDT::Payload;
+  using ValueType = typename CRDT::ValueType;
+
+  // Keeps the replica it points to alive. Must not outlive the thread that
+  // took it.
+  class Snapshot {
+   public:
+    explicit Snapshot(const CRDT *replica) : _replica(replica) {}
+    Snapshot(const Snapshot &) = delete;
+    Snapshot &operator=(const Snapshot &) = delete;
+    ~Snapshot() { EpochDomain::instance().exit(); }
+
+    const CRDT &operator*() const { return *_replica; }
+    const CRDT *operator->() const { return _replica; }
+
+   private:
+    const CRDT *_replica;
+  };
+
+  template <typename... Args>
+  explicit ConcurrentReplica(Args &&... args)
+      : _current(new CRDT(std::forward<Args>(args)...)) {
+    warmQueryCache(*_current.load());
+  }
+
+  ConcurrentReplica(const ConcurrentReplica &) = delete;
+  ConcurrentReplica &operator=(const ConcurrentReplica &) = delete;
+
+  // No thread may be reading or writing anymore.
+  ~ConcurrentReplica() {
+    delete _current.load();
+    for (auto &retired : _retired) {
+      delete retired.second;
+    }
+  }
+
+  Snapshot snapshot() const {
+    EpochDomain::instance().enter();
+    return Snapshot(_current.load());
+  }
+
+  ValueType query() const { return snapshot()->query(); }
+
+  // Runs f(CRDT &) on a private copy and publishes it.
+  template <typename F>
+  void update(F &&f) {
+    std::lock_guard<std::mutex> lock(_write_mutex);
+    const CRDT *current = _current.load();
+    auto next = std::make_unique<CRDT>(*current);
+    f(*next);
+    warmQueryCache(*next);
+    _current.store(next.release());
+    retire(current);
+  }
+
+  void merge(const Payload &other) {
+    update([&](CRDT &replica) { replica.merge(other); });
+  }
+
+  // Merges many payloads with a single copy and publication.
+  template <typename Iterator>
+  void mergeAll(Iterator begin, Iterator end) {
+    update([&](CRDT &replica) {
+      for (auto it = begin; it != end; ++it) {
+        replica.merge(*it);
+      }
+    });
+  }
+
+  // Copies retired by writes whose memory is not reclaimed yet.
+  size_t retiredCount() const {
+    std::lock_guard<std::mutex> lock(_write_mutex);
+    return _retired.size();
+  }
+
+ private:
+  // CRDTs cache their query results, and filling the cache is a write.
+  // Published replicas must have a warm cache so that readers only read.
+  static void warmQueryCache(const CRDT &replica) { (void)replica.query(); }
+
+  // Called with _write_mutex held.
+  void retire(const CRDT *replica) {
+    auto &domain = EpochDomain::instance();
+    _retired.emplace_back(domain.retireEpoch(), replica);
+    size_t kept = 0;
+    for (auto &retired : _retired) {
+      if (domain.safeToReclaim(retired.first)) {
+        delete retired.second;
+      } else {
+        _retired[kept++] = retired;
+      }
+    }
+    _retired.resize(kept);
+  }
+
+  std::atomic<const CRDT *> _current;
+  mutable std::mutex _write_mutex;
+  std::vector<std::pair<uint64_t, const CRDT *>> _retired;  // (epoch, replica)
+};
+
+// }}}
+
+// Seqlock registers {{{
+
+// An LWWRegister<T> for small trivially copyable T (timestamps, IDs, small
+// structs) that any number of threads can read and write.
+//
+// The register state lives in atomic words guarded by a sequence number
+// that is odd while a write is in progress. Readers copy the words and retry
+// if the sequence number changed in the meantime, so they never block
+// writers nor each other. Writers take the write side with a CAS on the
+// sequence number.
+template <typename T>
+class SeqLockLWWRegister {
+ public:
+  static_assert(std::is_trivially_copyable_v<T>, "T must be trivially copyable");
+
+  using ValueType = std::optional<T>;
+  using Payload = typename LWWRegister<T>::Payload;
+
+  explicit SeqLockLWWRegister(std::string name) : _name(std::move(name)) {
+    storeWords(State{});
+  }
+
+  SeqLockLWWRegister(const SeqLockLWWRegister &) = delete;
+  SeqLockLWWRegister &operator=(const SeqLockLWWRegister &) = delete;
+
+  ValueType query() const {
+    const State state = load();
+    return state.empty ? std::nullopt : std::optional(state.value);
+  }
+
+  Payload payload() const {
+    const State state = load();
+    return Payload(state.empty ? nullptr : &state.value, {state.time, state.replica});
+  }
+
+  void assign(const T &value) { assignLocal(&value); }
+  void clear() { assignLocal(nullptr); }
+
+  // Like LWWRegister, only a newer timestamp is a change. Payloads that are
+  // not newer don't take the write side, so readers don't retry for them.
+  void merge(const Payload &other) {
+    if (!(load().timestamp() < other.timestamp())) {
+      return;
+    }
+    const uint64_t seq = lockForWriting();
+    const bool changed = loadWords().timestamp() < other.timestamp();
+    if (changed) {
+      storeWords(State::from(other));
+    }
+    unlock(seq, changed);
+  }
+
+  const std::string &name() const { return _name; }
+
+  void dump() {
+    printf("SeqLockLWWRegister('%s', ", _name.c_str());
+    ValuePrinter<ValueType> printer;
+    printer.print(query());
+    puts(")");
+  }
+
+ private:
+  struct State {
+    T value{};
+    uint64_t time = 0;
+    size_t replica = 0;
+    bool empty = true;
+
+    typename Payload::Timestamp timestamp() const { return {time, replica}; }
+
+    static State from(const Payload &payload) {
+      State state;
+      if (auto *value = payload.query()) {
+        state.value = *value;
+        state.empty = false;
+      }
+      state.time = payload.timestamp().first;
+      state.replica = payload.timestamp().second;
+      return state;
+    }
+  };
+
+  static constexpr size_t kWords = (sizeof(State) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+  void assignLocal(const T *value) {
+    const uint64_t seq = lockForWriting();
+    _now += 1;
+    Payload payload;
+    payload.assign(value, _now, _name);
+    storeWords(State::from(payload));
+    unlock(seq, true);
+  }
+
+  State load() const {
+    for (;;) {
+      const uint64_t seq = _seq.load(std::memory_order_acquire);
+      if (seq & 1) {
+        continue;
+      }
+      const State state = loadWords();
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (_seq.load(std::memory_order_relaxed) == seq) {
+        return state;
+      }
+    }
+  }
+
+  // Returns the (even) sequence number the write started from.
+  uint64_t lockForWriting() {
+    uint64_t seq = _seq.load(std::memory_order_relaxed);
+    for (;;) {
+      if (!(seq & 1) && _seq.compare_exchange_weak(seq, seq + 1, std::memory_order_acquire)) {
+        std::atomic_thread_fence(std::memory_order_release);
+        return seq;
+      }
+      seq = _seq.load(std::memory_order_relaxed);
+    }
+  }
+
+  // A write that changed nothing restores the sequence number, so readers
+  // that raced with it don't retry.
+  void unlock(uint64_t seq, bool changed) {
+    _seq.store(changed ? seq + 2 : seq, std::memory_order_release);
+  }
+
+  State loadWords() const {
+    uint64_t words[kWords];
+    for (size_t i = 0; i < kWords; i++) {
+      words[i] = _words[i].load(std::memory_order_relaxed);
+    }
+    State state;
+    memcpy(&state, words, sizeof(State));
+    return state;
+  }
+
+  void storeWords(const State &state) {
+    uint64_t words[kWords] = {};
+    memcpy(words, &state, sizeof(State));
+    for (size_t i = 0; i < kWords; i++) {
+      _words[i].store(words[i], std::memory_order_relaxed);
+    }
+  }
+
+  const std::string _name;
+  uint64_t _now = 0;  // guarded by the write side of _seq
+  std::atomic<uint64_t> _seq{0};
+  std::atomic<uint64_t> _words[kWords];
+};
+
+// }}}
+
+// Striped sets {{{
+
+// Elements are partitioned by hash into shards, each guarded by its own
+// reader-writer lock, so threads working on different elements rarely
+// contend. Every element lives in exactly one shard.
+template <typename Shard>
+class StripedShards {
+ public:
+  using T = typename Shard::Element;
+
+  static constexpr size_t kDefaultShards = 64;
+
+  explicit StripedShards(size_t shards) : _shards(std::max<size_t>(1, shards)) {}
+
+  size_t size() const { return _shards.size(); }
+
+  size_t shardFor(const T &value) const {
+    return (size_t)(hashing::hash(value) % _shards.size());
+  }
+
+  template <typename F>
+  auto read(const T &value, F &&f) const {
+    const Shard &shard = _shards[shardFor(value)];
+    std::shared_lock<std::shared_mutex> lock(shard.mutex);
+    return f(shard);
+  }
+
+  template <typename F>
+  auto write(const T &value, F &&f) {
+    Shard &shard = _shards[shardFor(value)];
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+    return f(shard);
+  }
+
+  // Calls f(shard) on every shard in turn. Each shard is consistent on its
+  // own, but shards are visited at different times.
+  template <typename F>
+  void forEachShard(F &&f) const {
+    for (const Shard &shard : _shards) {
+      std::shared_lock<std::shared_mutex> lock(shard.mutex);
+      f(shard);
+    }
+  }
+
+  // Inserts the elements of source into the member set of their shards.
+  // Buckets of source are split into one range per task; each task groups its
+  // elements by shard and locks every shard once.
+  void parallelInsert(ThreadPool &pool,
+                      const std::unordered_set<T> &source,
+                      std::unordered_set<T> Shard::*member) {
+    const size_t buckets = source.bucket_count();
+    const size_t tasks = std::min(buckets, pool.size() * 4);
+    pool.parallelFor(tasks, [&](size_t task) {
+      std::vector<std::vector<const T *>> batches(_shards.size());
+      for (size_t b = buckets * task / tasks; b < buckets * (task + 1) / tasks; b++) {
+        for (auto it = source.begin(b); it != source.end(b); ++it) {
+          batches[shardFor(*it)].push_back(&*it);
+        }
+      }
+      for (size_t i = 0; i < batches.size(); i++) {
+        if (batches[i].empty()) {
+          continue;
+        }
+        std::unique_lock<std::shared_mutex> lock(_shards[i].mutex);
+        auto &target = _shards[i].*member;
+        for (const T *value : batches[i]) {
+          target.insert(*value);
+        }
+      }
+    });
+  }
+
+ private:
+  std::vector<Shard> _shards;
+};
+
+template <typename T>
+struct alignas(64) GSetShard {
+  using Element = T;
+
+  mutable std::shared_mutex mutex;
+  std::unordered_set<T> add;
+};
+
+template <typename T>
+struct alignas(64) _2PSetShard {
+  using Element = T;
+
+  mutable std::shared_mutex mutex;
+  std::unordered_set<T> add;
+  std::unordered_set<T> rem;
+};
+
+// A GSet that many threads can add to and query at the same time.
+template <typename T>
+class StripedGSet {
+ public:
+  using ValueType = std::unordered_set<T>;
+  using Payload = typename GSet<T>::Payload;
+
+  explicit StripedGSet(std::string name, size_t shards = Shards::kDefaultShards)
+      : _name(std::move(name)), _shards(shards) {}
+
+  bool contains(const T &value) const {
+    return _shards.read(value, [&](auto &shard) { return ::contains(shard.add, value); });
+  }
+
+  void add(const T &value) {
+    _shards.write(value, [&](auto &shard) { shard.add.insert(value); });
+  }
+
+  void merge(const Payload &other, ThreadPool &pool = ThreadPool::shared()) {
+    TRACE_SCOPE("crdt", "StripedGSet::merge");
+    _shards.parallelInsert(pool, other.query(), &Shard::add);
+  }
+
+  ValueType query() const {
+    ValueType ret;
+    _shards.forEachShard([&](auto &shard) { ret.insert(shard.add.begin(), shard.add.end()); });
+    return ret;
+  }
+
+  // A copy of the state that plain GSet replicas can merge.
+  Payload payload() const {
+    Payload payload;
+    _shards.forEachShard([&](auto &shard) {
+      for (const auto &value : shard.add) {
+        payload.add(value);
+      }
+    });
+    return payload;
+  }
+
+  const std::string &name() const { return _name; }
+
+  void dump() {
+    printf("StripedGSet('%s', ", _name.c_str());
+    ValuePrinter<ValueType> printer;
+    printer.print(query());
+    puts(")");
+  }
+
+ private:
+  using Shard = GSetShard<T>;
+  using Shards = StripedShards<Shard>;
+
+  const std::string _name;
+  Shards _shards;
+};
+
+// A _2PSet that many threads can add to, remove from and query at the same
+// time. An element and its tombstone live in the same shard.
+template <typename T>
+class Striped2PSet {
+ public:
+  using ValueType = std::unordered_set<T>;
+  using Payload = typename _2PSet<T>::Payload;
+
+  explicit Striped2PSet(std::string name, size_t shards = Shards::kDefaultShards)
+      : _name(std::move(name)), _shards(shards) {}
+
+  bool contains(const T &value) const {
+    return _shards.read(value, [&](auto &shard) {
+      return ::contains(shard.add, value) && !::contains(shard.rem, value);
+    });
+  }
+
+  void add(const T &value) {
+    _shards.write(value, [&](auto &shard) { shard.add.insert(value); });
+  }
+
+  [[nodiscard]] bool remove(const T &value) {
+    return _shards.write(value, [&](auto &shard) {
+      if (::contains(shard.add, value)) {
+        shard.rem.insert(value);
+        return true;
+      }
+      return false;
+    });
+  }
+
+  // Tombstones are inserted after the elements they remove, so concurrent
+  // readers never see a tombstone without its element.
+  void merge(const Payload &other, ThreadPool &pool = ThreadPool::shared()) {
+    TRACE_SCOPE("crdt", "Striped2PSet::merge");
+    _shards.parallelInsert(pool, other.added(), &Shard::add);
+    _shards.parallelInsert(pool, other.removed(), &Shard::rem);
+  }
+
+  ValueType query() const {
+    ValueType ret;
+    _shards.forEachShard([&](auto &shard) {
+      for (const auto &value : shard.add) {
+        if (!::contains(shard.rem, value)) {
+          ret.insert(value);
+        }
+      }
+    });
+    return ret;
+  }
+
+  // A copy of the state that plain _2PSet replicas can merge.
+  Payload payload() const {
+    Payload payload;
+    _shards.forEachShard([&](auto &shard) {
+      for (const auto &value : shard.add) {
+        payload.add(value);
+      }
+      for (const auto &value : shard.rem) {
+        REQUIRE(payload.remove(value));
+      }
+    });
+    return payload;
+  }
+
+  const std::string &name() const { return _name; }
+
+  void dump() {
+    printf("Striped2PSet('%s', ", _name.c_str());
+    ValuePrinter<ValueType> printer;
+    printer.print(query());
+    puts(")");
+  }
+
+ private:
+  using Shard = _2PSetShard<T>;
+  using Shards = StripedShards<Shard>;
+
+  const std::string _name;
+  Shards _shards;
+};
+
+// }}}
@@ -1,30 +1,36 @@
 // Copyright (C) 2020 Felipe O. Carvalho
 #pragma once
 
+#include <array>
 #include <cstdint>
 #include <cstdio>
 #include <optional>
 #include <string>
+#include <type_traits>
 #include <unordered_map>
 #include <unordered_set>
 #include <utility>
 #include <vector>
 #include "lib.h"
+#include "memory.h"
+#include "metrics.h"
+#include "trace.h"
 
 // Primitives {{{
 
+// The sum of all versions and an order-independent digest of the entries
+// are maintained on every update, so that summing, comparing for equality
+// and hashing a version vector are O(1).
 struct VersionVec {
   using Repr = std::unordered_map<std::string, uint64_t>;
+  using Replica = std::string;  // replicas are identified by name
 
-  uint64_t max() const {
-    uint64_t sum = 0;
-    for (auto & [ _, v ] : data) {
-      sum += v;
-    }
-    return sum;
-  }
+  uint64_t max() const { return _total; }
 
-  void increment(const std::string &replica_name, uint64_t delta) { data[replica_name] += delta; }
+  void increment(const std::string &replica_name, uint64_t delta) {
+    auto it = data.try_emplace(replica_name, 0).first;
+    setVersion(it, it->second + delta);
+  }
 
   uint64_t localVersionForReplica(const std::string &replica_name) const {
     if (auto *value = lookup(data, replica_name)) {
@@ -40,19 +46,11 @@ struct VersionVec {
   // (3) v = w : For all i, v[i] = w[i]; and
   // (4) v || w : otherwise -- concurrent version vectors -- not(v < w) and not(v >= w).
 
+  // Replicas missing from a version vector are at version 0, so only the
+  // entries of one side have to be compared in either direction.
   bool operator<=(const VersionVec &other) const {
-    std::vector<const std::string *> replica_names;
-    for (auto & [ replica_name, _ ] : data) {
-      replica_names.push_back(&replica_name);
-    }
-    for (auto & [ replica_name, _ ] : other.data) {
-      replica_names.push_back(&replica_name);
-    }
-
-    for (auto *replica_name : replica_names) {
-      const bool leq =
-          localVersionForReplica(*replica_name) <= other.localVersionForReplica(*replica_name);
-      if (!leq) {
+    for (auto & [ replica_name, v ] : data) {
+      if (v > other.localVersionForReplica(replica_name)) {
         return false;
       }
     }
@@ -72,154 +70,473 @@ struct VersionVec {
   //  <=> not(v < w)                                              (v >= w implies not(v < w)
   //                                                               so it can be dropped).
   bool operator<(const VersionVec &other) const {
-    std::vector<const std::string *> replica_names;
-    for (auto & [ replica_name, _ ] : data) {
-      replica_names.push_back(&replica_name);
-    }
-    for (auto & [ replica_name, _ ] : other.data) {
-      replica_names.push_back(&replica_name);
-    }
-
     bool at_least_one_strict_lt = false;
-    for (auto *replica_name : replica_names) {
-      const auto v = localVersionForReplica(*replica_name);
-      const auto w = other.localVersionForReplica(*replica_name);
+    for (auto & [ replica_name, v ] : data) {
+      const auto w = other.localVersionForReplica(replica_name);
       if (v < w) {
         at_least_one_strict_lt = true;
       } else if (v > w) {
         return false;
       }
     }
-    return at_least_one_strict_lt;
+    if (at_least_one_strict_lt) {
+      return true;
+    }
+    for (auto & [ replica_name, w ] : other.data) {
+      if (localVersionForReplica(replica_name) < w) {
+        return true;
+      }
+    }
+    return false;
   }
 
   bool dominatedBy(const VersionVec &other) const { return *this < other; }
 
-  bool operator==(const VersionVec &other) const { return data == other.data; }
+  bool operator==(const VersionVec &other) const {
+    return sameDigest(other) && data == other.data;
+  }
 
   uint64_t mergeVersionForReplica(const std::string &replica_name, uint64_t other_version) {
     if (other_version == 0) {
       auto *version = lookup(data, replica_name);
       return version ? *version : 0;
     }
-    auto &max_version = data[replica_name];
-    max_version = std::max(max_version, other_version);
-    return max_version;
+    auto it = data.try_emplace(replica_name, 0).first;
+    if (other_version > it->second) {
+      setVersion(it, other_version);
+    }
+    return it->second;
   }
 
-  void merge(const VersionVec &other) {
-    std::vector<const std::string *> replica_names;
-    for (auto & [ replica_name, _ ] : data) {
-      replica_names.push_back(&replica_name);
+  // Entries only present locally are unaffected: max(v, 0) = v. Returns
+  // whether any entry changed.
+  //
+  // Merging an identical version vector, the common case once replicas
+  // converged, is detected in O(1) from the digests. Any other redundant
+  // merge is a single read-only pass over other.
+  bool merge(const VersionVec &other, MergeMetrics *metrics = nullptr) {
+    if (other._total == 0 || sameDigest(other)) {
+      return false;
+    }
+    bool changed = false;
+    for (auto & [ replica_name, other_version ] : other.data) {
+      if (metrics) {
+        metrics->entries_examined += 1;
+      }
+      if (other_version == 0) {
+        continue;
+      }
+      auto[it, inserted] = data.try_emplace(replica_name, 0);
+      if (other_version > it->second) {
+        setVersion(it, other_version);
+        changed = true;
+        if (metrics) {
+          metrics->entries_updated += 1;
+          metrics->allocations += inserted ? 1 : 0;
+        }
+      }
+    }
+    return changed;
+  }
+
+  // The entries that are newer than in known: merging the result into known
+  // is the same as merging *this.
+  VersionVec delta(const VersionVec &known) const {
+    VersionVec ret;
+    if (sameDigest(known)) {
+      return ret;
     }
-    for (auto & [ replica_name, _ ] : other.data) {
-      replica_names.push_back(&replica_name);
+    for (auto & [ replica_name, version ] : data) {
+      if (version > known.localVersionForReplica(replica_name)) {
+        ret.increment(replica_name, version);
+      }
     }
+    return ret;
+  }
 
-    for (auto *replica_name : replica_names) {
-      mergeVersionForReplica(*replica_name, other.localVersionForReplica(*replica_name));
+  size_t encodedSize() const {
+    size_t size = sizeof(uint32_t);
+    for (auto & [ replica_name, _ ] : data) {
+      size += ::encodedSize(replica_name) + sizeof(uint64_t);
+    }
+    return size;
+  }
+
+  // The versions are the live data of a counter. Replica names and the hash
+  // table are metadata.
+  MemoryUsage memoryUsage() const {
+    MemoryUsage usage;
+    usage.metadata = sizeof(*this) + hashTableOverhead(data);
+    for (auto & [ replica_name, _ ] : data) {
+      usage.live += sizeof(uint64_t);
+      usage.metadata += sizeof(std::string) + heapBytes(replica_name);
     }
+    return usage;
   }
 
   Repr::const_iterator begin() const { return data.begin(); }
   Repr::const_iterator end() const { return data.end(); }
 
+  // hashing::hash(*this) with the default seed.
+  uint64_t digest() const { return _digest.finish(); }
+
  private:
+  static uint64_t entryHash(uint64_t name_hash, uint64_t version) {
+    return hashing::combine(name_hash, hashing::hashInt(version));
+  }
+
+  void setVersion(Repr::iterator it, uint64_t version) {
+    const uint64_t name_hash = hashing::hash(it->first);
+    if (it->second != 0) {
+      _digest.remove(entryHash(name_hash, it->second));
+    }
+    if (version != 0) {
+      _digest.add(entryHash(name_hash, version));
+    }
+    _total += version - it->second;
+    it->second = version;
+  }
+
+  // Equal totals and digests mean equal version vectors, barring a 64-bit
+  // hash collision.
+  bool sameDigest(const VersionVec &other) const {
+    return _total == other._total && digest() == other.digest();
+  }
+
   Repr data;
+  uint64_t _total = 0;
+  hashing::UnorderedCombiner _digest;
 };
 
-namespace std {
-
 template <>
-struct hash<VersionVec> {
-  size_t operator()(const VersionVec &v) const {
-    size_t ret = 0;
+struct hashing::Hasher<VersionVec> {
+  uint64_t operator()(const VersionVec &v, uint64_t seed) const {
+    if (seed == kDefaultSeed) {
+      return v.digest();
+    }
+    UnorderedCombiner combiner(seed);
     for (const auto & [ key, value ] : v) {
       if (value != 0) {
-        size_t h = 0;
-        hash_combine(h, key);
-        hash_combine(h, value);
-        ret ^= h;
+        combiner.add(combine(hash(key, seed), hashInt(value, seed)));
       }
     }
-    return ret;
+    return combiner.finish();
+  }
+};
+
+namespace std {
+
+template <>
+struct hash<VersionVec> {
+  size_t operator()(const VersionVec &v) const { return (size_t)hashing::hash(v); }
+};
+
+}  // namespace std
+
+// A version vector for a membership of N replicas known at build time.
+// Replicas are identified by their slot in [0, N) and versions are stored
+// inline, so there is nothing to hash or allocate: comparing and merging are
+// loops over N words that the compiler unrolls, and they are constexpr.
+//
+// Semantics are the same as VersionVec's: a missing replica of a VersionVec
+// is a zero slot here.
+template <size_t N>
+class FixedVersionVec {
+ public:
+  using Replica = size_t;  // slot in [0, N)
+
+  static constexpr size_t kSlots = N;
+
+  constexpr FixedVersionVec() = default;
+  constexpr explicit FixedVersionVec(const std::array<uint64_t, N> &versions)
+      : _versions(versions) {}
+
+  constexpr uint64_t max() const {
+    return apply([&](auto... i) { return (_versions[i] + ... + 0); });
+  }
+
+  constexpr void increment(Replica slot, uint64_t delta) {
+    assert(slot < N);
+    _versions[slot] += delta;
+  }
+
+  constexpr uint64_t localVersionForReplica(Replica slot) const {
+    assert(slot < N);
+    return _versions[slot];
+  }
+
+  constexpr bool operator<=(const FixedVersionVec &other) const {
+    return apply([&](auto... i) { return ((_versions[i] <= other._versions[i]) && ...); });
+  }
+
+  constexpr bool operator<(const FixedVersionVec &other) const {
+    return *this <= other && *this != other;
   }
+
+  constexpr bool dominatedBy(const FixedVersionVec &other) const { return *this < other; }
+
+  constexpr bool operator==(const FixedVersionVec &other) const {
+    return apply([&](auto... i) { return ((_versions[i] == other._versions[i]) && ...); });
+  }
+
+  constexpr bool operator!=(const FixedVersionVec &other) const { return !(*this == other); }
+
+  // Element-wise max. Returns whether any slot changed.
+  constexpr bool merge(const FixedVersionVec &other, MergeMetrics *metrics = nullptr) {
+    const size_t updated = apply([&](auto... i) { return (mergeSlot(i, other) + ... + 0); });
+    if (metrics) {
+      metrics->entries_examined += N;
+      metrics->entries_updated += updated;
+    }
+    return updated > 0;
+  }
+
+  size_t encodedSize() const { return sizeof(_versions); }
+
+  MemoryUsage memoryUsage() const {
+    MemoryUsage usage;
+    usage.live = sizeof(_versions);
+    return usage;
+  }
+
+  const std::array<uint64_t, N> &versions() const { return _versions; }
+
+  uint64_t digest() const { return hashing::hash(*this); }
+
+ private:
+  // f(0, 1, ..., N - 1) with compile-time indexes, which is how the loops
+  // above are unrolled.
+  template <typename F>
+  static constexpr decltype(auto) apply(F &&f) {
+    return applyImpl(std::forward<F>(f), std::make_index_sequence<N>());
+  }
+
+  template <typename F, size_t... I>
+  static constexpr decltype(auto) applyImpl(F &&f, std::index_sequence<I...>) {
+    return f(std::integral_constant<size_t, I>()...);
+  }
+
+  constexpr size_t mergeSlot(size_t i, const FixedVersionVec &other) {
+    const bool newer = other._versions[i] > _versions[i];
+    _versions[i] = newer ? other._versions[i] : _versions[i];
+    return newer ? 1 : 0;
+  }
+
+  std::array<uint64_t, N> _versions{};
+};
+
+template <size_t N>
+struct hashing::Hasher<FixedVersionVec<N>> {
+  uint64_t operator()(const FixedVersionVec<N> &v, uint64_t seed) const {
+    uint64_t h = seed;
+    for (uint64_t version : v.versions()) {
+      h = combine(h, hashInt(version, seed));
+    }
+    return h;
+  }
+};
+
+namespace std {
+
+template <size_t N>
+struct hash<FixedVersionVec<N>> {
+  size_t operator()(const FixedVersionVec<N> &v) const { return (size_t)hashing::hash(v); }
 };
 
 }  // namespace std
 
+// The name of a replica and its identity in version vectors of type VV. A
+// VersionVec identifies replicas by name, a FixedVersionVec by slot:
+//
+//   GCounter a("A");
+//   FixedGCounter<3> b("B", 1);
+//
+// Slots must be in [0, VV::kSlots).
+template <typename VV, typename Enable = void>
+class ReplicaIdentity {
+ public:
+  ReplicaIdentity(std::string name, typename VV::Replica replica)
+      : _name(std::move(name)), _replica(replica) {
+    assert(replica < VV::kSlots && "replica slot out of range");
+  }
+
+  const std::string &name() const { return _name; }
+  const typename VV::Replica &replica() const { return _replica; }
+
+ private:
+  std::string _name;
+  typename VV::Replica _replica;
+};
+
+template <typename VV>
+class ReplicaIdentity<VV, std::enable_if_t<std::is_same_v<typename VV::Replica, std::string>>> {
+ public:
+  explicit ReplicaIdentity(std::string name) : _name(std::move(name)) {}
+
+  const std::string &name() const { return _name; }
+  const std::string &replica() const { return _name; }
+
+ private:
+  std::string _name;
+};
+
+// Lets a CRDT be constructed with the arguments of its ReplicaIdentity.
+template <typename VV, typename... Args>
+using EnableIfReplicaIdentity =
+    std::enable_if_t<std::is_constructible_v<ReplicaIdentity<VV>, Args &&...>, int>;
+
+// Caches the result of a query until the generation of the CRDT changes.
+// CRDTs bump their generation on every local mutation and on every merge
+// that changed their state, so repeated reads of an unchanged replica don't
+// recompute anything.
+template <typename T>
+class QueryCache {
+ public:
+  template <typename Compute>
+  const T &get(uint64_t generation, Compute &&compute) const {
+    if (!_value || _generation != generation) {
+      _value = compute();
+      _generation = generation;
+    }
+    return *_value;
+  }
+
+ private:
+  mutable std::optional<T> _value;
+  mutable uint64_t _generation = 0;
+};
+
 // }}}
 
 // Counters {{{
 
-class GCounter {
+template <typename VV>
+class BasicGCounter {
  public:
   using ValueType = uint64_t;
-  using Payload = VersionVec;
+  using Payload = VV;
 
   // GCounter definition {{{
-  explicit GCounter(std::string name) : _name(std::move(name)) {}
+  template <typename... Args, EnableIfReplicaIdentity<VV, Args...> = 0>
+  explicit BasicGCounter(Args &&... args) : _id(std::forward<Args>(args)...) {}
 
-  unsigned int query() const { return _payload.max(); }
+  unsigned int query() const {
+    TRACE_SCOPE("crdt", "GCounter::query");
+    return _query.get(_generation, [&] { return _payload.max(); });
+  }
 
   void increment(uint64_t delta = 1) {
-    printf("Incrementing by %llu at replica '%s'.\n", delta, _name.c_str());
-    _payload.increment(_name, delta);
+    LOG("Incrementing by %" PRIu64 " at replica '%s'.\n", delta, name().c_str());
+    _payload.increment(_id.replica(), delta);
+    _generation += 1;
   }
 
-  void merge(const Payload &other) { _payload.merge(other); }
+  void merge(const Payload &other) {
+    TRACE_SCOPE("crdt", "GCounter::merge");
+    MergeRecorder recorder(_metrics, other);
+    _generation += _payload.merge(other, recorder.sink()) ? 1 : 0;
+  }
   // }}}
 
-  const std::string &name() const { return _name; }
+  const std::string &name() const { return _id.name(); }
   const Payload &payload() const { return _payload; }
-  void dump() { printf("GCounter('%s', %d)\n", _name.c_str(), query()); }
+  uint64_t generation() const { return _generation; }
+  const MergeMetrics &metrics() const { return _metrics; }
+  void dump() { printf("GCounter('%s', %d)\n", name().c_str(), query()); }
 
  private:
-  const std::string _name;
+  const ReplicaIdentity<VV> _id;
   Payload _payload;
+  uint64_t _generation = 0;
+  QueryCache<ValueType> _query;
+  MergeMetrics _metrics;
 };
 
-class PNCounter {
+using GCounter = BasicGCounter<VersionVec>;
+template <size_t N>
+using FixedGCounter = BasicGCounter<FixedVersionVec<N>>;
+
+template <typename VV>
+class BasicPNCounter {
  public:
   using ValueType = int64_t;
 
   struct Payload {
-    VersionVec positive;
-    VersionVec negative;
+    VV positive;
+    VV negative;
+
+    size_t encodedSize() const { return positive.encodedSize() + negative.encodedSize(); }
+
+    MemoryUsage memoryUsage() const {
+      MemoryUsage usage = positive.memoryUsage();
+      usage += negative.memoryUsage();
+      return usage;
+    }
+
+    bool merge(const Payload &other, MergeMetrics *metrics = nullptr) {
+      const bool positive_changed = positive.merge(other.positive, metrics);
+      const bool negative_changed = negative.merge(other.negative, metrics);
+      return positive_changed || negative_changed;
+    }
+
+    uint64_t digest() const { return hashing::combine(positive.digest(), negative.digest()); }
+
+    // Only for version vectors that have deltas, which FixedVersionVec
+    // doesn't need: it is shipped as is.
+    template <typename V = VV,
+              typename = decltype(std::declval<const V &>().delta(std::declval<const V &>()))>
+    Payload delta(const Payload &known) const {
+      return {positive.delta(known.positive), negative.delta(known.negative)};
+    }
   };
 
   // PNCounter definition {{{
-  explicit PNCounter(std::string name) : _name(std::move(name)) {}
+  template <typename... Args, EnableIfReplicaIdentity<VV, Args...> = 0>
+  explicit BasicPNCounter(Args &&... args) : _id(std::forward<Args>(args)...) {}
 
   int64_t query() const {
-    return (int64_t)_payload.positive.max() - (int64_t)_payload.negative.max();
+    TRACE_SCOPE("crdt", "PNCounter::query");
+    return _query.get(_generation, [&] {
+      return (int64_t)_payload.positive.max() - (int64_t)_payload.negative.max();
+    });
   }
 
   void increment(int64_t delta) {
     if (delta >= 0) {
-      printf("Incrementing by %lld at replica '%s'.\n", delta, _name.c_str());
-      _payload.positive.increment(_name, (uint64_t)delta);
+      LOG("Incrementing by %" PRId64 " at replica '%s'.\n", delta, name().c_str());
+      _payload.positive.increment(_id.replica(), (uint64_t)delta);
     } else {
-      printf("Decrementing by %lld at replica '%s'.\n", -delta, _name.c_str());
-      _payload.negative.increment(_name, (uint64_t)-delta);
+      LOG("Decrementing by %" PRId64 " at replica '%s'.\n", -delta, name().c_str());
+      _payload.negative.increment(_id.replica(), (uint64_t)-delta);
     }
+    _generation += 1;
   }
 
   void merge(const Payload &other) {
-    _payload.positive.merge(other.positive);
-    _payload.negative.merge(other.negative);
+    TRACE_SCOPE("crdt", "PNCounter::merge");
+    MergeRecorder recorder(_metrics, other);
+    _generation += _payload.merge(other, recorder.sink()) ? 1 : 0;
   }
   // }}}
 
-  const std::string &name() const { return _name; }
+  const std::string &name() const { return _id.name(); }
   const Payload &payload() const { return _payload; }
-  void dump() { printf("PNCounter('%s', %lld)\n", _name.c_str(), query()); }
+  uint64_t generation() const { return _generation; }
+  const MergeMetrics &metrics() const { return _metrics; }
+  void dump() { printf("PNCounter('%s', %" PRId64 ")\n", name().c_str(), query()); }
 
  private:
-  const std::string _name;
+  const ReplicaIdentity<VV> _id;
   Payload _payload;
+  uint64_t _generation = 0;
+  QueryCache<ValueType> _query;
+  MergeMetrics _metrics;
 };
 
+using PNCounter = BasicPNCounter<VersionVec>;
+template <size_t N>
+using FixedPNCounter = BasicPNCounter<FixedVersionVec<N>>;
+
 // }}}
 
 // Registers {{{
@@ -231,8 +548,14 @@ class LWWRegister {
 
   class Payload {
    public:
+    // (local time, hashed replica name): ties on time are broken by replica.
+    using Timestamp = std::pair<uint64_t, size_t>;
+
     Payload() : _value{}, _timestamp(0, 0), _empty(true) {}
 
+    Payload(const T *value, Timestamp timestamp)
+        : _value(value ? *value : T{}), _timestamp(timestamp), _empty(!value) {}
+
     void assign(const T *value, uint64_t now, const std::string &replica_name) {
       if (value) {
         _value = *value;
@@ -242,24 +565,53 @@ class LWWRegister {
     }
 
     const T *query() const { return _empty ? nullptr : &_value; }
+    const Timestamp &timestamp() const { return _timestamp; }
+
+    size_t encodedSize() const {
+      return sizeof(bool) + sizeof(_timestamp) + (_empty ? 0 : ::encodedSize(_value));
+    }
+
+    MemoryUsage memoryUsage() const {
+      MemoryUsage usage;
+      const size_t value_bytes = sizeof(T) + heapBytes(_value);
+      (_empty ? usage.metadata : usage.live) += value_bytes;
+      usage.metadata += sizeof(*this) - sizeof(T);
+      return usage;
+    }
 
     bool operator<=(const Payload &other) const { return _timestamp <= other._timestamp; }
 
-    void merge(const Payload &other) {
-      if (*this <= other) {
+    // A timestamp identifies a write, and so the value it wrote.
+    uint64_t digest() const { return hashing::hash(_timestamp); }
+
+    // Nothing when known is at least as new.
+    Payload delta(const Payload &known) const {
+      return known._timestamp < _timestamp ? *this : Payload();
+    }
+
+    // Equal timestamps carry equal values, so only a newer timestamp is a
+    // change.
+    bool merge(const Payload &other, MergeMetrics *metrics = nullptr) {
+      const bool changed = _timestamp < other._timestamp;
+      if (metrics) {
+        metrics->entries_examined += 1;
+        metrics->entries_updated += changed ? 1 : 0;
+      }
+      if (changed) {
         *this = other;
       }
+      return changed;
     }
 
    private:
     static size_t hashedReplicaName(const std::string &name) {
-      // In the real and distributed world this would be a well-defined and
-      // stable hash function like SipHash-2-4, BLAKE, SHA1 etc.
-      return std::hash<std::string>{}(name);
+      // Must be stable across processes and platforms since it breaks ties
+      // between replicas: std::hash is neither.
+      return (size_t)hashing::hash(name);
     }
 
     T _value;
-    std::pair<uint64_t, size_t> _timestamp;
+    Timestamp _timestamp;
     bool _empty;
   };
 
@@ -269,23 +621,34 @@ class LWWRegister {
   void assign(const T &value) {
     _now += 1;
     _payload.assign(&value, _now, _name);
+    _generation += 1;
   }
 
   void clear() {
     _now += 1;
     _payload.assign(nullptr, _now, _name);
+    _generation += 1;
   }
 
-  const ValueType query() const {
-    const auto *value = _payload.query();
-    return value ? std::optional(*value) : std::nullopt;
+  const ValueType &query() const {
+    TRACE_SCOPE("crdt", "LWWRegister::query");
+    return _query.get(_generation, [&] {
+      const auto *value = _payload.query();
+      return value ? std::optional(*value) : std::nullopt;
+    });
   }
 
-  void merge(const Payload &other) { _payload.merge(other); }
+  void merge(const Payload &other) {
+    TRACE_SCOPE("crdt", "LWWRegister::merge");
+    MergeRecorder recorder(_metrics, other);
+    _generation += _payload.merge(other, recorder.sink()) ? 1 : 0;
+  }
   // }}}
 
   const std::string &name() const { return _name; }
   const Payload &payload() const { return _payload; }
+  uint64_t generation() const { return _generation; }
+  const MergeMetrics &metrics() const { return _metrics; }
 
   void dump() {
     printf("LWWRegister('%s', ", _name.c_str());
@@ -298,16 +661,18 @@ class LWWRegister {
   const std::string _name;
   uint64_t _now = 0;
   Payload _payload;
+  uint64_t _generation = 0;
+  QueryCache<ValueType> _query;
+  MergeMetrics _metrics;
 };
 
-template <typename T>
+template <typename T, typename VV = VersionVec>
 struct MVRegisterSetNode {
   MVRegisterSetNode() : _empty(true) {}
 
-  MVRegisterSetNode(VersionVec version_vec)
-      : _empty(true), _version_vector(std::move(version_vec)) {}
+  MVRegisterSetNode(VV version_vec) : _empty(true), _version_vector(std::move(version_vec)) {}
 
-  MVRegisterSetNode(const T &value, VersionVec version_vec)
+  MVRegisterSetNode(const T &value, VV version_vec)
       : _value(value), _empty(false), _version_vector(std::move(version_vec)) {}
 
   bool operator==(const MVRegisterSetNode &other) const {
@@ -321,27 +686,43 @@ struct MVRegisterSetNode {
   }
 
   const T *value() const { return _empty ? nullptr : &_value; }
-  const VersionVec &versionVector() const { return _version_vector; }
+  const VV &versionVector() const { return _version_vector; }
+
+  size_t encodedSize() const {
+    return sizeof(bool) + (_empty ? 0 : ::encodedSize(_value)) + _version_vector.encodedSize();
+  }
+
+  MemoryUsage memoryUsage() const {
+    MemoryUsage usage;
+    const size_t value_bytes = sizeof(T) + heapBytes(_value);
+    (_empty ? usage.metadata : usage.live) += value_bytes;
+    // Versions are causality metadata when attached to a value.
+    usage.metadata += _version_vector.memoryUsage().total();
+    usage.metadata += sizeof(*this) - sizeof(T) - sizeof(VV);
+    return usage;
+  }
 
  private:
   T _value;
   bool _empty = true;
-  VersionVec _version_vector;
+  VV _version_vector;
+};
+
+template <typename T, typename VV>
+struct hashing::Hasher<MVRegisterSetNode<T, VV>> {
+  uint64_t operator()(const MVRegisterSetNode<T, VV> &key, uint64_t seed) const {
+    auto *value = key.value();
+    uint64_t h = value ? combine(seed, hash(*value, seed)) : hashInt(0, seed);
+    return combine(h, hash(key.versionVector(), seed));
+  }
 };
 
 namespace std {
 
-template <typename T>
-struct hash<MVRegisterSetNode<T>> {
-  size_t operator()(const MVRegisterSetNode<T> &key) const {
-    size_t h = 0;
-    auto *value = key.value();
-    hash_combine(h, !!value);
-    if (value) {
-      hash_combine(h, *value);
-    }
-    hash_combine(h, key.versionVector());
-    return h;
+template <typename T, typename VV>
+struct hash<MVRegisterSetNode<T, VV>> {
+  size_t operator()(const MVRegisterSetNode<T, VV> &key) const {
+    return (size_t)hashing::hash(key);
   }
 };
 
@@ -349,16 +730,18 @@ struct hash<MVRegisterSetNode<T>> {
 
 // MV-Register does not behave like a set, contrary to what one might expect
 // since its payload is a set.
-template <typename T>
+template <typename T, typename VV = VersionVec>
 class MVRegister {
  public:
   using ValueType = std::unordered_set<T>;
+  using Node = MVRegisterSetNode<T, VV>;
 
   class Payload {
    public:
-    void assign(ValueType value, const std::string &replica_name) {
+    void assign(ValueType value, const typename VV::Replica &replica) {
+      _context.increment(replica, 1);
+      const VV &version_vec = _context;
       _set.clear();
-      const auto version_vec = bumpVersionVector(replica_name);
       if (value.empty()) {
         _set.emplace(version_vec);
       } else {
@@ -379,66 +762,280 @@ class MVRegister {
       return ret;
     }
 
-    void merge(const Payload &other) {
-      std::unordered_set<MVRegisterSetNode<T>> merged;
-      for (const MVRegisterSetNode<T> &i : _set) {
-        for (const MVRegisterSetNode<T> &j : other._set) {
-          if (!i.versionVector().dominatedBy(j.versionVector())) {
-            merged.insert(i);
-          }
-          if (!j.versionVector().dominatedBy(i.versionVector())) {
-            merged.insert(j);
-          }
+    size_t encodedSize() const {
+      size_t size = sizeof(uint32_t);
+      for (auto &node : _set) {
+        size += node.encodedSize();
+      }
+      return size;
+    }
+
+    MemoryUsage memoryUsage() const {
+      MemoryUsage usage;
+      usage.metadata = sizeof(*this) - sizeof(VV) + hashTableOverhead(_set);
+      usage.metadata += _context.memoryUsage().total();
+      for (auto &node : _set) {
+        usage += node.memoryUsage();
+      }
+      return usage;
+    }
+
+    // Keeps the nodes of either side that are not dominated by a node of the
+    // other side.
+    //
+    // The context of a payload, the join of the version vectors of its nodes,
+    // covers every write the payload has seen: a write is either one of its
+    // nodes or was overwritten by one. So when the context of other is
+    // dominated by the local one, the merge can't change anything and only
+    // the contexts are compared.
+    bool merge(const Payload &other, MergeMetrics *metrics = nullptr) {
+      if (other._set.empty() || other._context <= _context) {
+        return false;
+      }
+      std::unordered_set<Node> merged;
+      for (const Node &i : _set) {
+        if (!dominatedByAny(i, other._set)) {
+          merged.insert(i);
+        }
+      }
+      for (const Node &j : other._set) {
+        if (!dominatedByAny(j, _set)) {
+          merged.insert(j);
+        }
+      }
+      _context.merge(other._context);
+      if (metrics) {
+        metrics->entries_examined += 2 * _set.size() * other._set.size();
+      }
+      return replaceSet(std::move(merged), metrics);
+    }
+
+    // Same as merging every payload of others in turn. The nodes of all
+    // sides are deduplicated and only the ones not dominated by any other
+    // are kept, so the set is rebuilt once instead of once per payload.
+    bool mergeBatch(const std::vector<const Payload *> &others, MergeMetrics *metrics = nullptr) {
+      std::unordered_set<Node> candidates;
+      for (const Payload *other : others) {
+        // Skipped for the same reason merge() returns early: every node of
+        // other is a candidate already or dominated by one.
+        if (!other->_set.empty() && !(other->_context <= _context)) {
+          candidates.insert(other->_set.begin(), other->_set.end());
+          _context.merge(other->_context);
+        }
+      }
+      if (candidates.empty()) {
+        return false;
+      }
+      candidates.insert(_set.begin(), _set.end());
+      std::unordered_set<Node> merged;
+      for (const Node &node : candidates) {
+        if (!dominatedByAny(node, candidates)) {
+          merged.insert(node);
         }
       }
-      _set = merged;
+      if (metrics) {
+        metrics->entries_examined += candidates.size() * candidates.size();
+      }
+      return replaceSet(std::move(merged), metrics);
+    }
+
+    // The context determines the state: see merge().
+    uint64_t digest() const { return _context.digest(); }
+
+    // The nodes known doesn't have. The context goes whole.
+    Payload delta(const Payload &known) const {
+      Payload ret;
+      if (_context <= known._context) {
+        return ret;
+      }
+      for (const Node &node : _set) {
+        if (!::contains(known._set, node)) {
+          ret._set.insert(node);
+        }
+      }
+      ret._context = _context;
+      return ret;
     }
 
    private:
-    VersionVec bumpVersionVector(const std::string &replica_name) {
-      VersionVec inc_version_vec;
-      for (auto &i : _set) {
-        inc_version_vec.merge(i.versionVector());
+    static bool dominatedByAny(const Node &node, const std::unordered_set<Node> &nodes) {
+      for (const Node &other_node : nodes) {
+        if (node.versionVector().dominatedBy(other_node.versionVector())) {
+          return true;
+        }
       }
-      inc_version_vec.increment(replica_name, 1);
-      return inc_version_vec;
+      return false;
     }
 
-    std::unordered_set<MVRegisterSetNode<T>> _set;
+    bool replaceSet(std::unordered_set<Node> merged, MergeMetrics *metrics) {
+      if (metrics) {
+        size_t inserted = 0;
+        for (auto &node : merged) {
+          inserted += ::contains(_set, node) ? 0 : 1;
+        }
+        const size_t dropped = _set.size() - (merged.size() - inserted);
+        metrics->entries_updated += inserted + dropped;
+        metrics->allocations += merged.size();
+      }
+      if (merged == _set) {
+        return false;
+      }
+      _set = std::move(merged);
+      return true;
+    }
+
+    std::unordered_set<Node> _set;
+    VV _context;  // join of the version vectors of _set
   };
 
   // MVRegister definition {{{
-  explicit MVRegister(std::string name) : _name(std::move(name)) {}
+  template <typename... Args, EnableIfReplicaIdentity<VV, Args...> = 0>
+  explicit MVRegister(Args &&... args) : _id(std::forward<Args>(args)...) {}
 
-  void assign(ValueType value) { _payload.assign(std::move(value), _name); }
+  void assign(ValueType value) {
+    _payload.assign(std::move(value), _id.replica());
+    _generation += 1;
+  }
+
+  const ValueType &query() const {
+    TRACE_SCOPE("crdt", "MVRegister::query");
+    return _query.get(_generation, [&] { return _payload.query(); });
+  }
 
-  const ValueType query() const { return _payload.query(); }
+  void merge(const Payload &other) {
+    TRACE_SCOPE("crdt", "MVRegister::merge");
+    MergeRecorder recorder(_metrics, other);
+    _generation += _payload.merge(other, recorder.sink()) ? 1 : 0;
+  }
 
-  void merge(const Payload &other) { _payload.merge(other); }
+  void mergeBatch(const std::vector<const Payload *> &others) {
+    TRACE_SCOPE("crdt", "MVRegister::mergeBatch");
+    MergeRecorder recorder(_metrics, others);
+    _generation += _payload.mergeBatch(others, recorder.sink()) ? 1 : 0;
+  }
   // }}}
 
   void clear() { assign({}); }
-  const std::string &name() const { return _name; }
+  const std::string &name() const { return _id.name(); }
   const Payload &payload() const { return _payload; }
+  uint64_t generation() const { return _generation; }
+  const MergeMetrics &metrics() const { return _metrics; }
 
   void dump() {
-    printf("MVRegister('%s', ", _name.c_str());
+    printf("MVRegister('%s', ", name().c_str());
     ValuePrinter<ValueType> printer;
     printer.print(query());
     puts(")");
   }
 
  private:
-  std::string _name;
+  const ReplicaIdentity<VV> _id;
   Payload _payload;
+  uint64_t _generation = 0;
+  QueryCache<ValueType> _query;
+  MergeMetrics _metrics;
 };
 
+template <typename T, size_t N>
+using FixedMVRegister = MVRegister<T, FixedVersionVec<N>>;
+
 // }}}
 
 // Sets {{{
 
-// NOTE(philix): Grow-Only Sets (GSets) are really simple so I didn't bother
-// implementind them.
+template <typename T>
+class GSet {
+ public:
+  using ValueType = std::unordered_set<T>;
+
+  class Payload {
+   public:
+    const ValueType &query() const { return _add; }
+    bool contains(const T &value) const { return ::contains(_add, value); }
+    void add(const T &value) { _add.insert(value); }
+
+    size_t encodedSize() const {
+      size_t size = sizeof(uint32_t);
+      for (const auto &value : _add) {
+        size += ::encodedSize(value);
+      }
+      return size;
+    }
+
+    MemoryUsage memoryUsage() const {
+      MemoryUsage usage;
+      usage.metadata = sizeof(*this) + hashTableOverhead(_add);
+      for (const auto &value : _add) {
+        usage.live += sizeof(T) + heapBytes(value);
+      }
+      return usage;
+    }
+
+    bool merge(const Payload &other, MergeMetrics *metrics = nullptr) {
+      const size_t size_before = _add.size();
+      _add.insert(other._add.begin(), other._add.end());
+      const size_t inserted = _add.size() - size_before;
+      if (metrics) {
+        metrics->entries_examined += other._add.size();
+        metrics->entries_updated += inserted;
+        metrics->allocations += inserted;
+      }
+      return inserted > 0;
+    }
+
+    // The elements known doesn't have.
+    Payload delta(const Payload &known) const {
+      Payload ret;
+      for (const auto &value : _add) {
+        if (!::contains(known._add, value)) {
+          ret._add.insert(value);
+        }
+      }
+      return ret;
+    }
+
+   private:
+    std::unordered_set<T> _add;
+  };
+
+  // GSet Definition {{{
+  explicit GSet(std::string name) : _name(std::move(name)) {}
+  bool contains(const T &value) const { return _payload.contains(value); }
+  void add(const T &value) {
+    _payload.add(value);
+    _generation += 1;
+  }
+  void merge(const Payload &other) {
+    TRACE_SCOPE("crdt", "GSet::merge");
+    MergeRecorder recorder(_metrics, other);
+    _generation += _payload.merge(other, recorder.sink()) ? 1 : 0;
+  }
+  // }}}
+
+  // The payload is the query result, there is nothing to cache.
+  const ValueType &query() const {
+    TRACE_SCOPE("crdt", "GSet::query");
+    return _payload.query();
+  }
+
+  const std::string &name() const { return _name; }
+  const Payload &payload() const { return _payload; }
+  uint64_t generation() const { return _generation; }
+  const MergeMetrics &metrics() const { return _metrics; }
+
+  void dump() {
+    printf("GSet('%s', ", _name.c_str());
+    ValuePrinter<ValueType> printer;
+    printer.print(query());
+    puts(")");
+  }
+
+ private:
+  std::string _name;
+  Payload _payload;
+  uint64_t _generation = 0;
+  MergeMetrics _metrics;
+};
 
 template <typename T>
 class _2PSet {
@@ -463,6 +1060,10 @@ class _2PSet {
 
     void add(const T &value) { _add.insert(value); }
 
+    // Removed elements stay in added() as well.
+    const std::unordered_set<T> &added() const { return _add; }
+    const std::unordered_set<T> &removed() const { return _rem; }
+
     [[nodiscard]] bool remove(const T &value) {
       if (::contains(_add, value)) {
         _rem.insert(value);
@@ -471,9 +1072,65 @@ class _2PSet {
       return false;
     }
 
-    void merge(const Payload &other) {
+    size_t encodedSize() const {
+      size_t size = 2 * sizeof(uint32_t);
+      for (const auto &value : _add) {
+        size += ::encodedSize(value);
+      }
+      for (const auto &value : _rem) {
+        size += ::encodedSize(value);
+      }
+      return size;
+    }
+
+    // Removed elements are kept in both _add and _rem and count as tombstones.
+    MemoryUsage memoryUsage() const {
+      MemoryUsage usage;
+      usage.metadata = sizeof(*this) + hashTableOverhead(_add) + hashTableOverhead(_rem);
+      for (const auto &value : _add) {
+        const size_t bytes = sizeof(T) + heapBytes(value);
+        if (::contains(_rem, value)) {
+          usage.metadata += bytes;
+          usage.tombstones += bytes;
+        } else {
+          usage.live += bytes;
+        }
+      }
+      for (const auto &value : _rem) {
+        const size_t bytes = sizeof(T) + heapBytes(value);
+        usage.metadata += bytes;
+        usage.tombstones += bytes;
+      }
+      return usage;
+    }
+
+    bool merge(const Payload &other, MergeMetrics *metrics = nullptr) {
+      const size_t size_before = _add.size() + _rem.size();
       _add.insert(other._add.begin(), other._add.end());
       _rem.insert(other._rem.begin(), other._rem.end());
+      const size_t inserted = _add.size() + _rem.size() - size_before;
+      if (metrics) {
+        metrics->entries_examined += other._add.size() + other._rem.size();
+        metrics->entries_updated += inserted;
+        metrics->allocations += inserted;
+      }
+      return inserted > 0;
+    }
+
+    // The additions and removals known doesn't have.
+    Payload delta(const Payload &known) const {
+      Payload ret;
+      for (const auto &value : _add) {
+        if (!::contains(known._add, value)) {
+          ret._add.insert(value);
+        }
+      }
+      for (const auto &value : _rem) {
+        if (!::contains(known._rem, value)) {
+          ret._rem.insert(value);
+        }
+      }
+      return ret;
     }
 
    private:
@@ -484,9 +1141,20 @@ class _2PSet {
   // 2PSet Definition {{{
   explicit _2PSet(std::string name) : _name(std::move(name)) {}
   bool contains(const T &value) const { return _payload.contains(value); }
-  void add(const T &value) { _payload.add(value); }
-  [[nodiscard]] bool remove(const T &value) { return _payload.remove(value); }
-  void merge(const Payload &other) { _payload.merge(other); }
+  void add(const T &value) {
+    _payload.add(value);
+    _generation += 1;
+  }
+  [[nodiscard]] bool remove(const T &value) {
+    const bool removed = _payload.remove(value);
+    _generation += removed ? 1 : 0;
+    return removed;
+  }
+  void merge(const Payload &other) {
+    TRACE_SCOPE("crdt", "2PSet::merge");
+    MergeRecorder recorder(_metrics, other);
+    _generation += _payload.merge(other, recorder.sink()) ? 1 : 0;
+  }
   // }}}
 
   void addMany() {}
@@ -505,10 +1173,15 @@ class _2PSet {
     return removeMany(args...) && removed;
   }
 
-  ValueType query() const { return _payload.query(); }
+  const ValueType &query() const {
+    TRACE_SCOPE("crdt", "2PSet::query");
+    return _query.get(_generation, [&] { return _payload.query(); });
+  }
 
   const std::string &name() const { return _name; }
   const Payload &payload() const { return _payload; }
+  uint64_t generation() const { return _generation; }
+  const MergeMetrics &metrics() const { return _metrics; }
 
   void dump() {
     printf("2PSet('%s', ", _name.c_str());
@@ -520,6 +1193,9 @@ class _2PSet {
  private:
   std::string _name;
   Payload _payload;
+  uint64_t _generation = 0;
+  QueryCache<ValueType> _query;
+  MergeMetrics _metrics;
 };
 
 // }}}
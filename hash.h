@@ -0,0 +1,249 @@
+// Copyright (C) 2020 Felipe O. Carvalho
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+// Stable and seedable 64-bit hashing.
+//
+// std::hash is neither stable across standard libraries nor seedable, and it
+// is the identity function for integers in libstdc++. Anything that leaves the
+// process (digests, hashed replica names) or that ends up as a key of a large
+// hash table should go through this layer instead.
+//
+// The byte hash is wyhash (final version 4, public domain) by Wang Yi. It is
+// endian-independent: inputs are read as little-endian words on every host.
+//
+// The layer is pluggable: specialize hashing::Hasher<T> with
+//
+//   uint64_t operator()(const T &value, uint64_t seed) const;
+//
+// and hashing::hash(value) will pick it up. Types without a specialization
+// fall back to std::hash<T> followed by a strong mix.
+
+namespace hashing {
+
+constexpr uint64_t kDefaultSeed = 0x1d8e4e27c47d124full;
+
+namespace detail {
+
+constexpr uint64_t kSecret[4] = {
+    0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull, 0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull};
+
+inline void mum(uint64_t *a, uint64_t *b) {
+  __uint128_t r = *a;
+  r *= *b;
+  *a = (uint64_t)r;
+  *b = (uint64_t)(r >> 64);
+}
+
+inline uint64_t read8(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  v = __builtin_bswap64(v);
+#endif
+  return v;
+}
+
+inline uint64_t read4(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  v = __builtin_bswap32(v);
+#endif
+  return v;
+}
+
+inline uint64_t read3(const uint8_t *p, size_t k) {
+  return (((uint64_t)p[0]) << 16) | (((uint64_t)p[k >> 1]) << 8) | p[k - 1];
+}
+
+}  // namespace detail
+
+// Folded 128-bit multiply. The basic building block of wyhash.
+inline uint64_t mix(uint64_t a, uint64_t b) {
+  detail::mum(&a, &b);
+  return a ^ b;
+}
+
+inline uint64_t hashBytes(const void *data, size_t len, uint64_t seed = kDefaultSeed) {
+  using detail::kSecret;
+  using detail::read3;
+  using detail::read4;
+  using detail::read8;
+  const auto *p = static_cast<const uint8_t *>(data);
+  seed ^= mix(seed ^ kSecret[0], kSecret[1]);
+  uint64_t a;
+  uint64_t b;
+  if (len <= 16) {
+    if (len >= 4) {
+      a = (read4(p) << 32) | read4(p + ((len >> 3) << 2));
+      b = (read4(p + len - 4) << 32) | read4(p + len - 4 - ((len >> 3) << 2));
+    } else if (len > 0) {
+      a = read3(p, len);
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    size_t i = len;
+    if (i > 48) {
+      uint64_t see1 = seed;
+      uint64_t see2 = seed;
+      do {
+        seed = mix(read8(p) ^ kSecret[1], read8(p + 8) ^ seed);
+        see1 = mix(read8(p + 16) ^ kSecret[2], read8(p + 24) ^ see1);
+        see2 = mix(read8(p + 32) ^ kSecret[3], read8(p + 40) ^ see2);
+        p += 48;
+        i -= 48;
+      } while (i > 48);
+      seed ^= see1 ^ see2;
+    }
+    while (i > 16) {
+      seed = mix(read8(p) ^ kSecret[1], read8(p + 8) ^ seed);
+      i -= 16;
+      p += 16;
+    }
+    a = read8(p + i - 16);
+    b = read8(p + i - 8);
+  }
+  a ^= kSecret[1];
+  b ^= seed;
+  detail::mum(&a, &b);
+  return mix(a ^ kSecret[0] ^ len, b ^ kSecret[1]);
+}
+
+inline uint64_t hashInt(uint64_t value, uint64_t seed = kDefaultSeed) {
+  return mix(value ^ detail::kSecret[0], seed ^ detail::kSecret[1]);
+}
+
+// Order-dependent combination of two hashes: combine(a, b) != combine(b, a).
+inline uint64_t combine(uint64_t seed, uint64_t h) {
+  return mix(seed ^ detail::kSecret[2], h ^ detail::kSecret[3]);
+}
+
+template <typename T, typename Enable = void>
+struct Hasher {
+  uint64_t operator()(const T &value, uint64_t seed) const {
+    return hashInt(std::hash<T>{}(value), seed);
+  }
+};
+
+template <typename T>
+uint64_t hash(const T &value, uint64_t seed = kDefaultSeed) {
+  return Hasher<T>{}(value, seed);
+}
+
+// Order-independent combination of element hashes.
+//
+// Element hashes are summed (mod 2^64), so the result does not depend on
+// iteration order, but -- unlike XOR -- duplicates don't cancel each other
+// out. The element count is mixed in when finishing. Elements can also be
+// removed, which makes the accumulator usable for incrementally maintained
+// digests.
+class UnorderedCombiner {
+ public:
+  explicit UnorderedCombiner(uint64_t seed = kDefaultSeed) : _seed(seed) {}
+
+  void add(uint64_t h) {
+    _sum += h;
+    _count += 1;
+  }
+
+  void remove(uint64_t h) {
+    _sum -= h;
+    _count -= 1;
+  }
+
+  uint64_t finish() const { return mix(_sum ^ _seed, _count ^ detail::kSecret[0]); }
+
+ private:
+  uint64_t _seed;
+  uint64_t _sum = 0;
+  uint64_t _count = 0;
+};
+
+template <typename T>
+struct Hasher<T, std::enable_if_t<std::is_integral_v<T> || std::is_enum_v<T>>> {
+  uint64_t operator()(T value, uint64_t seed) const { return hashInt((uint64_t)value, seed); }
+};
+
+template <>
+struct Hasher<std::string_view> {
+  uint64_t operator()(std::string_view s, uint64_t seed) const {
+    return hashBytes(s.data(), s.size(), seed);
+  }
+};
+
+template <>
+struct Hasher<std::string> {
+  uint64_t operator()(const std::string &s, uint64_t seed) const {
+    return hashBytes(s.data(), s.size(), seed);
+  }
+};
+
+template <typename A, typename B>
+struct Hasher<std::pair<A, B>> {
+  uint64_t operator()(const std::pair<A, B> &p, uint64_t seed) const {
+    return combine(hash(p.first, seed), hash(p.second, seed));
+  }
+};
+
+template <typename T>
+struct Hasher<std::optional<T>> {
+  uint64_t operator()(const std::optional<T> &v, uint64_t seed) const {
+    return v.has_value() ? combine(seed, hash(*v, seed)) : hashInt(0, seed);
+  }
+};
+
+template <typename T>
+struct Hasher<std::vector<T>> {
+  uint64_t operator()(const std::vector<T> &v, uint64_t seed) const {
+    uint64_t h = hashInt(v.size(), seed);
+    for (const auto &elem : v) {
+      h = combine(h, hash(elem, seed));
+    }
+    return h;
+  }
+};
+
+template <typename T>
+struct Hasher<std::unordered_set<T>> {
+  uint64_t operator()(const std::unordered_set<T> &s, uint64_t seed) const {
+    UnorderedCombiner combiner(seed);
+    for (const auto &elem : s) {
+      combiner.add(hash(elem, seed));
+    }
+    return combiner.finish();
+  }
+};
+
+template <typename K, typename V>
+struct Hasher<std::unordered_map<K, V>> {
+  uint64_t operator()(const std::unordered_map<K, V> &m, uint64_t seed) const {
+    UnorderedCombiner combiner(seed);
+    for (const auto &[key, value] : m) {
+      combiner.add(combine(hash(key, seed), hash(value, seed)));
+    }
+    return combiner.finish();
+  }
+};
+
+// Adapter for using the stable hashes as the hasher of STL containers.
+template <typename T>
+struct StdHasher {
+  size_t operator()(const T &value) const { return (size_t)hash(value); }
+};
+
+}  // namespace hashing
@@ -0,0 +1,123 @@
+// Copyright (C) 2020 Felipe O. Carvalho
+#pragma once
+
+#include <cstdio>
+#include <optional>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include "crdt.h"
+#include "traits.h"
+
+// Lazy merging
+//
+// During sync storms (e.g. P2PNetwork::broadcastAll) a replica receives many
+// payloads back to back and nobody reads it in between. LazyReplica<CRDT>
+// doesn't merge them into the replica right away: incoming payloads are
+// joined together into a single pending payload, which is merged into the
+// replica once, right before the next query(), payload() or local mutation.
+//
+// Merges are associative and commutative, so the result is the same as
+// merging eagerly. Joining is cheap when incoming payloads are small compared
+// to the local state or overlap each other: for counters it is a running
+// max over version vectors, and merging into MVRegisters and sets rebuilds
+// or grows the local state once per flush instead of once per payload.
+//
+// A LazyReplica can be used wherever its CRDT is, including in networks.
+
+template <typename CRDT>
+class LazyReplica {
+ public:
+  using Payload = typename CRDT::Payload;
+  using ValueType = typename CRDT::ValueType;
+
+  // Takes the constructor arguments of the CRDT, e.g. a name, or a name and a
+  // slot for the fixed-membership counters.
+  template <typename... Args,
+            std::enable_if_t<std::is_constructible_v<CRDT, Args &&...>, int> = 0>
+  explicit LazyReplica(Args &&... args) : _replica(std::forward<Args>(args)...) {}
+
+  void merge(const Payload &other) {
+    TRACE_SCOPE("crdt", "LazyReplica::merge");
+    MergeRecorder recorder(_metrics, other);
+    if constexpr (CRDTTraits<CRDT>::has_digest) {
+      // Payloads equal to the replica or to the pending payload change
+      // nothing, so they aren't copied or joined.
+      const uint64_t digest = other.digest();
+      if (digest == _replica.payload().digest() || (_pending && digest == _pending->digest())) {
+        return;
+      }
+    }
+    if (_pending) {
+      _pending->merge(other, recorder.sink());
+    } else {
+      _pending.emplace(other);
+      if (auto *metrics = recorder.sink()) {
+        metrics->entries_updated += 1;
+      }
+    }
+  }
+
+  decltype(auto) query() const {
+    flush();
+    return _replica.query();
+  }
+
+  const Payload &payload() const {
+    flush();
+    return _replica.payload();
+  }
+
+  // Local mutations apply to the up-to-date replica.
+#define LAZY_FORWARD(method, qualifiers)                                                           \
+  template <typename... Args, typename C = CRDT>                                                   \
+  auto method(Args &&... args) qualifiers                                                          \
+      ->decltype(std::declval<qualifiers C &>().method(std::forward<Args>(args)...)) {             \
+    flush();                                                                                       \
+    return _replica.method(std::forward<Args>(args)...);                                           \
+  }
+  LAZY_FORWARD(increment, )
+  LAZY_FORWARD(assign, )
+  LAZY_FORWARD(clear, )
+  LAZY_FORWARD(add, )
+  LAZY_FORWARD(contains, const)
+#undef LAZY_FORWARD
+
+  // Written out to keep the [[nodiscard]] of the CRDTs' remove().
+  template <typename... Args, typename C = CRDT>
+  [[nodiscard]] auto remove(Args &&... args)
+      -> decltype(std::declval<C &>().remove(std::forward<Args>(args)...)) {
+    flush();
+    return _replica.remove(std::forward<Args>(args)...);
+  }
+
+  // Merges the pending payload, if any.
+  void flush() const {
+    if (_pending) {
+      _replica.merge(*_pending);
+      _pending.reset();
+    }
+  }
+
+  bool hasPending() const { return _pending.has_value(); }
+
+  const std::string &name() const { return _replica.name(); }
+
+  // Incoming merges, counting the work of joining them into the pending
+  // payload, plus the merges of the pending payload into the replica.
+  MergeMetrics metrics() const {
+    MergeMetrics metrics = _metrics;
+    metrics += _replica.metrics();
+    return metrics;
+  }
+
+  void dump() {
+    flush();
+    _replica.dump();
+  }
+
+ private:
+  mutable CRDT _replica;
+  mutable std::optional<Payload> _pending;
+  MergeMetrics _metrics;
+};
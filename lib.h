@@ -1,9 +1,43 @@
 // Copyright (C) 2020 Felipe O. Carvalho
 #pragma once
 
+#include <algorithm>
+#include <cassert>
+#include <cinttypes>
+#include <cstdio>
+#include <optional>
 #include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
+#include "hash.h"
+
+// Logging
+//
+// Simulations narrate what replicas and networks are doing. Benchmarks and
+// workload drivers turn that off since printing would dominate the run time.
+
+inline bool &verboseLogging() {
+  static bool verbose = true;
+  return verbose;
+}
+
+#define LOG(...)             \
+  do {                       \
+    if (verboseLogging()) {  \
+      printf(__VA_ARGS__);   \
+    }                        \
+  } while (0)
+
+// Like assert(), but x is evaluated even when NDEBUG is defined.
+#define REQUIRE(x)     \
+  {                    \
+    const bool _b = x; \
+    assert(_b);        \
+    (void)_b;          \
+  }
 
 // STL helpers
 
@@ -37,58 +71,52 @@ bool linearContains(const Container &s, const typename Container::value_type &v)
 
 template <typename T>
 void hash_combine(std::size_t &seed, const T &val) {
-  seed ^= std::hash<T>()(val) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+  seed = (std::size_t)hashing::combine(seed, hashing::hash(val));
 }
 
+// Encoding
+//
+// Size of values in a simple binary encoding: fixed-width integers and
+// length-prefixed strings. Used to account for the bytes replicas exchange.
+
+template <typename T>
+std::enable_if_t<std::is_arithmetic_v<T>, size_t> encodedSize(const T &) {
+  return sizeof(T);
+}
+
+inline size_t encodedSize(const std::string &s) { return sizeof(uint32_t) + s.size(); }
+
 // Hashers
+//
+// The std::hash specializations below delegate to the stable hashes in
+// hash.h. Containers are hashed as multisets, so permutations of the same
+// content collide (as they should) but duplicated content does not cancel out.
 
 namespace std {
 
 template <typename A, typename B>
 struct hash<std::pair<A, B>> {
-  size_t operator()(const std::pair<A, B> &k) const {
-    size_t h = 0;
-    hash_combine(h, k.first);
-    hash_combine(h, k.second);
-    return h;
-  }
+  size_t operator()(const std::pair<A, B> &k) const { return (size_t)hashing::hash(k); }
 };
 
 template <>
 struct hash<vector<string>> {
-  size_t operator()(const vector<string> &v) const {
-    size_t h = 0;
-    for (const auto &s : v) {
-      hash_combine(h, s);
-    }
-    return h;
-  }
+  size_t operator()(const vector<string> &v) const { return (size_t)hashing::hash(v); }
+};
+
+template <typename A, typename B>
+struct hash<vector<pair<A, B>>> {
+  size_t operator()(const vector<pair<A, B>> &v) const { return (size_t)hashing::hash(v); }
 };
 
 template <typename T>
 struct hash<unordered_set<T>> {
-  size_t operator()(const unordered_set<T> &v) const {
-    hash<T> elem_hasher;
-    size_t h = 0;
-    for (const auto &elem : v) {
-      h ^= elem_hasher(elem);
-    }
-    return h;
-  }
+  size_t operator()(const unordered_set<T> &v) const { return (size_t)hashing::hash(v); }
 };
 
 template <typename K, typename V>
 struct hash<unordered_map<K, V>> {
-  size_t operator()(const unordered_map<K, V> &v) const {
-    size_t ret = 0;
-    for (const auto & [ key, value ] : v) {
-      size_t h = 0;
-      hash_combine(h, key);
-      hash_combine(h, value);
-      ret ^= h;
-    }
-    return ret;
-  }
+  size_t operator()(const unordered_map<K, V> &v) const { return (size_t)hashing::hash(v); }
 };
 
 }  // namespace std
@@ -1,237 +1,30 @@
 // Copyright (C) 2020 Felipe O. Carvalho
 
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <chrono>
+#include <cinttypes>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <numeric>
+#include <random>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #include <utility>
 #include <vector>
 #include "crdt.h"
+#include "lazy.h"
 #include "lib.h"
-
-#define REQUIRE(x)     \
-  {                    \
-    const bool _b = x; \
-    assert(_b);        \
-  }
-
-template <typename CRDT>
-class P2PNetwork {
- public:
-  size_t add(CRDT *crdt) {
-    _replicas.push_back(crdt);
-    return _replicas.size() - 1;
-  }
-
-  void disconnect(size_t i) {
-    CRDT *replica = _replicas[i];
-    if (replica) {
-      printf("Disconnect '%s' from the network.\n", replica->name().c_str());
-      _replicas[i] = nullptr;
-      _offline_set.emplace(i, replica);
-    }
-  }
-
-  void reconnect(size_t i) {
-    for (auto it = _offline_set.begin(); it != _offline_set.end(); ++it) {
-      if (it->first == i) {
-        assert(_replicas[i] == nullptr);
-        printf("Reconnecting '%s' to the network.\n", it->second->name().c_str());
-        _replicas[i] = it->second;
-        _offline_set.erase(it);
-        break;
-      }
-    }
-  }
-
-  void broadcast(size_t i) {
-    const CRDT *replica = _replicas[i];
-    if (!replica) {
-      return;
-    }
-    printf("Broadcasting from '%s' to all connected replicas...\n", replica->name().c_str());
-    for (size_t j = 0; j < _replicas.size(); j++) {
-      if (j != i) {
-        auto *other = _replicas[j];
-        if (other) {
-          other->merge(replica->payload());
-        }
-      }
-    }
-  }
-
-  void broadcastAll() {
-    for (size_t i = 0; i < _replicas.size(); i++) {
-      broadcast(i);
-    }
-  }
-
-  int countPartitions() const {
-    std::unordered_set<typename CRDT::ValueType> distinct_values;
-    for (auto *replica : _replicas) {
-      if (replica) {
-        const auto value = replica->query();
-        distinct_values.insert(value);
-      }
-    }
-    for (auto & [ _, replica ] : _offline_set) {
-      const auto value = replica->query();
-      distinct_values.insert(value);
-    }
-    return (int)distinct_values.size();
-  }
-
-  void dump() const {
-    printf("P2P network state:\n");
-    if (!_offline_set.empty()) {
-      printf("- online:\n");
-    }
-    for (auto *replica : _replicas) {
-      if (replica) {
-        replica->dump();
-      }
-    }
-    if (!_offline_set.empty()) {
-      printf("- offline\n");
-      for (auto[_, replica] : _offline_set) {
-        replica->dump();
-      }
-    }
-    if (countPartitions() == 1) {
-      puts("ALL CONVERGED!");
-    }
-    printf("\n");
-  }
-
- private:
-  std::vector<CRDT *> _replicas;
-  std::unordered_set<std::pair<size_t, CRDT *>> _offline_set;
-};
-
-template <typename CRDT>
-class StarNetwork {
- public:
-  size_t setServerReplica(CRDT *crdt) {
-    if (_replicas.empty()) {
-      _replicas.push_back(crdt);
-    } else {
-      _replicas[0] = crdt;
-    }
-    return 0;
-  }
-
-  size_t add(CRDT *crdt) {
-    if (_replicas.empty()) {
-      _replicas.push_back(nullptr);  // The 0-th replica is the server replica
-    }
-    _replicas.push_back(crdt);
-    return _replicas.size() - 1;
-  }
-
-  void disconnect(size_t i) {
-    CRDT *replica = _replicas[i];
-    if (replica) {
-      if (i == 0) {
-        printf("Server is down.\n");
-      } else {
-        printf("Disconnect '%s' from the network.\n", replica->name().c_str());
-      }
-      _replicas[i] = nullptr;
-      _offline_set.emplace(i, replica);
-    }
-  }
-
-  void reconnect(size_t i) {
-    for (auto it = _offline_set.begin(); it != _offline_set.end(); ++it) {
-      if (it->first == i) {
-        assert(_replicas[i] == nullptr);
-        if (i == 0) {
-          printf("Server is back up.\n");
-        } else {
-          printf("Reconnecting '%s' to the network.\n", it->second->name().c_str());
-        }
-        _replicas[i] = it->second;
-        _offline_set.erase(it);
-        break;
-      }
-    }
-  }
-
-  void syncWithServer(size_t i) {
-    if (i == 0) {
-      return;  // 0 is the server
-    }
-    auto *server = _replicas[0];
-    auto *replica = _replicas[i];
-    if (!replica) {
-      return;
-    }
-    if (!server) {
-      printf("Server is not reachable from replica '%s'.\n", replica->name().c_str());
-      return;
-    }
-    printf("Replica '%s' is syncing with %s.\n", replica->name().c_str(), server->name().c_str());
-    // This simulates a request/response transaction in which the server
-    // immediatelly replies with what it has and performs the merge
-    // asynchrnously (i.e. after replying) for low-latency. Due to merge's
-    // commutativity, both replicas (client and server) will reach the same CRDT
-    // state.
-    auto local_payload = replica->payload();
-    auto payload_from_server = server->payload();
-    // Perform merges in two directions
-    replica->merge(payload_from_server);
-    server->merge(local_payload);
-    assert(replica->query() == server->query());
-  }
-
-  void syncAllReplicasToServer() {
-    // i=0 is skipped (0 is the server)
-    for (size_t i = 1; i < _replicas.size(); i++) {
-      syncWithServer(i);
-    }
-  }
-
-  int countPartitions() const {
-    std::unordered_set<unsigned int> distinct_values;
-    for (auto *replica : _replicas) {
-      if (replica) {
-        const auto value = replica->query();
-        distinct_values.insert(value);
-      }
-    }
-    for (auto & [ _, replica ] : _offline_set) {
-      const auto value = replica->query();
-      distinct_values.insert(value);
-    }
-    return (int)distinct_values.size();
-  }
-
-  void dump() const {
-    printf("Star-network state:\n");
-    if (!_offline_set.empty()) {
-      printf("- online:\n");
-    }
-    for (auto *replica : _replicas) {
-      if (replica) {
-        replica->dump();
-      }
-    }
-    if (!_offline_set.empty()) {
-      printf("- offline\n");
-      for (auto[_, replica] : _offline_set) {
-        replica->dump();
-      }
-    }
-    if (countPartitions() == 1) {
-      puts("ALL CONVERGED!");
-    }
-    printf("\n");
-  }
-
- private:
-  std::vector<CRDT *> _replicas;
-  std::unordered_set<std::pair<size_t, CRDT *>> _offline_set;
-};
+#include "network.h"
+#include "per_core.h"
+#include "sharded.h"
+#include "sketch.h"
+#include "store.h"
+#include "workload.h"
 
 void simulateGCountersInP2PNetwork() {
   P2PNetwork<GCounter> network;
@@ -287,6 +80,46 @@ void simulateGCountersInP2PNetwork() {
   assert(network.countPartitions() == 1);
 }
 
+// Replicas of a fixed membership, identified by slot, merging lazily.
+void simulateFixedGCountersInP2PNetwork() {
+  using Counter = LazyReplica<FixedGCounter<3>>;
+  P2PNetwork<Counter> network;
+
+  Counter a_counter("A", 0);
+  Counter b_counter("B", 1);
+  Counter c_counter("C", 2);
+
+  const size_t a = network.add(&a_counter);
+  const size_t b = network.add(&b_counter);
+  const size_t c = network.add(&c_counter);
+  (void)a;
+  (void)c;
+
+  a_counter.increment(1);
+  b_counter.increment(2);
+  c_counter.increment(3);
+  network.broadcastAll();
+  network.dump();
+  assert(network.countPartitions() == 1);
+  assert(a_counter.query() == 6);
+
+  network.disconnect(b);
+  a_counter.increment(10);
+  network.broadcastAll();
+  assert(b_counter.query() == 6);
+  assert(c_counter.query() == 16);
+
+  network.reconnect(b);
+  network.broadcastAll();
+  assert(network.countPartitions() == 1);
+  assert(b_counter.query() == 16);
+
+  // Redundant payloads aren't even queued.
+  a_counter.flush();
+  a_counter.merge(b_counter.payload());
+  assert(!a_counter.hasPending());
+}
+
 void simulateGCountersInStarNetwork() {
   StarNetwork<GCounter> network;
 
@@ -485,13 +318,15 @@ void simulateMVRegistersInP2PNetwork() {
 
   a_register.assign({"Pasta"});
   b_register.assign({});
+  c_register.assign({"Pop Corn", "Pasta"});
   network.dump();
   assert(network.countPartitions() == 3);
   network.broadcastAll();
   network.dump();
   assert(network.countPartitions() == 1);
-  // All items re-appear because C still has all three shopping cart items. This
-  // anomaly is noted in the Dynamo paper [Giuseppe DeCandia et al. 2007].
+  // "Pop Corn" re-appears because C wrote it concurrently with B emptying the
+  // shopping cart. This anomaly is noted in the Dynamo paper [Giuseppe
+  // DeCandia et al. 2007].
   //
   //     [Section 4.4]
   //     > Using this reconciliation mechanism, an “add to cart” operation is
@@ -500,7 +335,7 @@ void simulateMVRegistersInP2PNetwork() {
   // The problem is that, MV-Register does not behave like a set, contrary to
   // what one might expect since its payload is a set.  For set semantics, a set
   // CRDT must be used.
-  assert(c_register.query().size() == 3);
+  assert(c_register.query().size() == 2);
 
   a_register.clear();
   b_register.clear();
@@ -517,11 +352,12 @@ void simulateMVRegistersInP2PNetwork() {
   network.dump();
   network.broadcast(b);
   network.dump();
-  network.broadcast(a);  // If A doesn't broadcast again, B keeps believing on its local value.
+  network.broadcast(a);
   network.dump();
   assert(network.countPartitions() == 1);
-  assert(a_register.query().size() == 2);
-  assert(b_register.query().size() == 2);
+  // B had seen "Pasta" when it wrote "Toilet Paper", so the write replaced it.
+  assert(a_register.query().size() == 1);
+  assert(b_register.query().size() == 1);
 }
 
 void simulate2PSetsInP2PNetwork() {
@@ -572,13 +408,720 @@ void simulate2PSetsInP2PNetwork() {
   assert(c_set.query().empty());
 }
 
+void simulateSharded2PSets() {
+  using Sharded = Sharded2PSet<std::string>;
+  using Plain = _2PSet<std::string>::Payload;
+  auto element = [](size_t i) { return "e" + std::to_string(i); };
+  // Elements in [begin, end), every remove_every-th one removed.
+  auto makePayload = [&](size_t begin, size_t end, size_t remove_every) {
+    Plain payload;
+    for (size_t i = begin; i < end; i++) {
+      payload.add(element(i));
+    }
+    for (size_t i = begin; i < end; i++) {
+      if (i % remove_every == 0) {
+        REQUIRE(payload.remove(element(i)));
+      }
+    }
+    return payload;
+  };
+  const size_t universe = 50000;
+  const Plain local = makePayload(0, 30000, 7);
+  const Plain large = makePayload(20000, universe, 5);
+  const Plain small = makePayload(45000, 46000, 3);
+  assert(large.added().size() >= Sharded::kParallelMergeThreshold);
+  assert(small.added().size() < Sharded::kParallelMergeThreshold);
+
+  // partition() keeps every element and tombstone, each in its shard.
+  for (size_t shards : {1, 7, 16}) {
+    const auto partitioned = Sharded::Payload::partition(large, shards);
+    assert(partitioned.shardCount() == shards);
+    assert(partitioned.query() == large.query());
+    assert(partitioned.size() == large.added().size() + large.removed().size());
+    for (size_t i = 0; i < shards; i++) {
+      for (auto &value : partitioned.shard(i).added()) {
+        assert(partitioned.shardFor(value) == i);
+        (void)value;
+      }
+    }
+  }
+
+  // A Sharded2PSet with local_shards shards merges the payloads, partitioned
+  // into remote_shards shards, and must end up like a _2PSet that merged the
+  // plain payloads. Merging them again changes nothing.
+  auto check = [&](const char *path,
+                   size_t local_shards,
+                   size_t remote_shards,
+                   const std::vector<const Plain *> &payloads) {
+    LOG("Merging %zu payload(s) into a Sharded2PSet (%s).\n", payloads.size(), path);
+    _2PSet<std::string> plain("plain");
+    Sharded sharded("sharded", local_shards);
+    plain.merge(local);
+    sharded.merge(Sharded::Payload::partition(local, local_shards));
+    std::vector<Sharded::Payload> partitioned;
+    for (const Plain *payload : payloads) {
+      partitioned.push_back(Sharded::Payload::partition(*payload, remote_shards));
+      plain.merge(*payload);
+      sharded.merge(partitioned.back());
+    }
+    assert(sharded.query() == plain.query());
+    for (size_t i = 0; i < universe; i++) {
+      assert(sharded.contains(element(i)) == plain.contains(element(i)));
+    }
+    const uint64_t generation = sharded.generation();
+    (void)generation;
+    for (auto &payload : partitioned) {
+      sharded.merge(payload);
+    }
+    assert(sharded.generation() == generation);
+  };
+  check("sequential", 16, 16, {&small});
+  check("parallel", 16, 16, {&large, &small});
+  check("different shard counts", 16, 7, {&large, &small});
+  check("single shard", 1, 16, {&large});
+}
+
+void simulateHyperLogLogsInStarNetwork() {
+  StarNetwork<HyperLogLog<>> network;
+
+  HyperLogLog<> server_hll("Server");
+  HyperLogLog<> a_hll("A");
+  HyperLogLog<> b_hll("B");
+  HyperLogLog<> c_hll("C");
+
+  network.setServerReplica(&server_hll);
+  const size_t a = network.add(&a_hll);
+  const size_t b = network.add(&b_hll);
+  const size_t c = network.add(&c_hll);
+  (void)a;
+  (void)b;
+  (void)c;
+
+  // Every replica sees 20000 users, half of which are seen by another
+  // replica as well: 40000 distinct users.
+  auto user = [](size_t i) { return "user-" + std::to_string(i); };
+  for (size_t i = 0; i < 20000; i++) {
+    a_hll.add(user(i));
+    b_hll.add(user(10000 + i));
+    c_hll.add(user(20000 + i));
+  }
+  network.syncAllReplicasToServer();
+  network.syncAllReplicasToServer();
+  network.dump();
+  assert(network.countPartitions() == 1);
+  // The standard error is 0.8% with the default precision.
+  assert(std::abs((double)server_hll.query() - 40000) / 40000 < 0.05);
+  assert(server_hll.payload().memoryUsage().total() < 20000);
+
+  // Users that were counted already change nothing.
+  const uint64_t generation = a_hll.generation();
+  (void)generation;
+  a_hll.add(user(25000));
+  assert(a_hll.generation() == generation);
+}
+
+void simulateCountMinSketchesInP2PNetwork() {
+  P2PNetwork<CountMinSketch<>> network;
+
+  CountMinSketch<> a_sketch("A");
+  CountMinSketch<> b_sketch("B");
+  CountMinSketch<> c_sketch("C");
+
+  const size_t a = network.add(&a_sketch);
+  const size_t b = network.add(&b_sketch);
+  const size_t c = network.add(&c_sketch);
+  (void)a;
+  (void)b;
+  (void)c;
+
+  // Page i gets i views on every replica and "/home" gets 5000 more
+  // everywhere.
+  auto page = [](size_t i) { return "/page-" + std::to_string(i); };
+  for (CountMinSketch<> *sketch : {&a_sketch, &b_sketch, &c_sketch}) {
+    for (size_t i = 0; i < 100; i++) {
+      sketch->add(page(i), i);
+    }
+    sketch->add("/home", 5000);
+  }
+  assert(a_sketch.estimate("/home") >= 5000);
+  network.broadcastAll();
+  network.dump();
+  assert(network.countPartitions() == 1);
+  assert(a_sketch.query() == 3 * (4950 + 5000));
+
+  // Estimates never undercount and, with high probability, overcount by a
+  // small fraction of the total.
+  for (size_t i = 0; i < 100; i++) {
+    const uint64_t estimate = c_sketch.estimate(page(i));
+    (void)estimate;
+    assert(estimate >= 3 * i);
+    assert(estimate <= 3 * i + c_sketch.query() / 100);
+  }
+  assert(c_sketch.estimate("/home") >= 15000);
+
+  // Merging again changes nothing: sketches aren't added up twice.
+  b_sketch.add("/home", 1);
+  network.broadcast(b);
+  network.broadcastAll();
+  assert(network.countPartitions() == 1);
+  assert(a_sketch.query() == 3 * (4950 + 5000) + 1);
+}
+
+// Merges the snapshots into a fresh replica in every order, each one as a
+// full payload or as a delta against what the replica has, picked at random,
+// and calls check with every replica.
+template <typename CRDT, typename Check>
+void mergeInEveryOrder(const std::vector<typename CRDT::Payload> &snapshots, Check &&check) {
+  std::mt19937_64 rng(42);
+  std::vector<size_t> order(snapshots.size());
+  std::iota(order.begin(), order.end(), 0);
+  do {
+    CRDT replica("R");
+    for (size_t i : order) {
+      if (rng() % 2 == 0) {
+        replica.merge(snapshots[i]);
+      } else {
+        replica.merge(snapshots[i].delta(replica.payload()));
+      }
+    }
+    check(replica);
+  } while (std::next_permutation(order.begin(), order.end()));
+}
+
+// Sketches end up the same whatever the order of merges and whether they
+// merge full payloads or deltas, stale ones included.
+void simulateCountMinSketchMergeOrders() {
+  using Sketch = CountMinSketch<>;
+  std::mt19937_64 rng(7);
+  auto page = [](size_t i) { return "/page-" + std::to_string(i); };
+
+  // An early and a late snapshot of every replica.
+  std::vector<Sketch::Payload> snapshots;
+  Sketch reference("reference");
+  for (const char *name : {"A", "B", "C"}) {
+    Sketch sketch(name);
+    for (size_t round = 0; round < 2; round++) {
+      for (size_t i = 0; i < 200; i++) {
+        sketch.add(page(rng() % 50), 1 + rng() % 10);
+      }
+      snapshots.push_back(sketch.payload());
+    }
+    reference.merge(sketch.payload());
+  }
+
+  size_t orders = 0;
+  mergeInEveryOrder<Sketch>(snapshots, [&](const Sketch &sketch) {
+    assert(sketch.payload().digest() == reference.payload().digest());
+    assert(sketch.query() == reference.query());
+    for (size_t i = 0; i < 50; i++) {
+      assert(sketch.estimate(page(i)) == reference.estimate(page(i)));
+    }
+    orders++;
+  });
+  LOG("CountMinSketch: %zu merge orders converged to %" PRIu64 " views.\n", orders,
+      reference.query());
+  assert(orders == 720);
+}
+
+void simulateTopKInP2PNetwork() {
+  P2PNetwork<TopK<std::string, 3>> network;
+
+  TopK<std::string, 3> a_top("A");
+  TopK<std::string, 3> b_top("B");
+  TopK<std::string, 3> c_top("C");
+
+  const size_t a = network.add(&a_top);
+  const size_t b = network.add(&b_top);
+  const size_t c = network.add(&c_top);
+  (void)a;
+  (void)b;
+  (void)c;
+
+  // Every replica sees a long tail of 1000 players with a single point each,
+  // more than its summary of 12 counters can hold, plus a few high scores.
+  for (TopK<std::string, 3> *top : {&a_top, &b_top, &c_top}) {
+    for (size_t i = 0; i < 1000; i++) {
+      top->add("player-" + std::to_string(i));
+    }
+  }
+  a_top.add("alice", 500);
+  b_top.add("bob", 300);
+  c_top.add("alice", 200);
+  c_top.add("carol", 250);
+  b_top.add("dave", 100);
+  network.broadcastAll();
+  network.dump();
+  assert(network.countPartitions() == 1);
+
+  // Estimates are off by at most 4350 / 12 points: the total count over the
+  // 12 counters of the summary.
+  const auto top = a_top.query();
+  assert(top.size() == 3);
+  assert(top[0].first == "alice");
+  assert(top[1].first == "bob");
+  assert(top[2].first == "carol");
+  assert(top[0].second >= 700 - 4350 / 12 && top[0].second <= 700 + 4350 / 12);
+
+  // Redundant merges don't count anything twice.
+  network.broadcastAll();
+  assert(a_top.query() == top);
+  assert(a_top.payload().totalCount() == 3000 + 1350);
+}
+
+// Like simulateCountMinSketchMergeOrders(), for TopK. Two items tie at the
+// top, so replicas also agree on how ties are broken.
+void simulateTopKMergeOrders() {
+  using Top = TopK<std::string, 3>;
+  std::mt19937_64 rng(7);
+  auto player = [](size_t i) { return "player-" + std::to_string(i); };
+
+  std::vector<Top::Payload> snapshots;
+  Top reference("reference");
+  for (const char *name : {"A", "B", "C"}) {
+    Top top(name);
+    for (size_t round = 0; round < 2; round++) {
+      for (size_t i = 0; i < 200; i++) {
+        top.add(player(rng() % 50), 1 + rng() % 3);
+      }
+      top.add("bob", 300);
+      top.add("alice", 300);
+      snapshots.push_back(top.payload());
+    }
+    reference.merge(top.payload());
+  }
+  const auto expected = reference.query();
+  assert(expected.size() == 3);
+  assert(expected[0].first == "alice" && expected[1].first == "bob");
+  assert(expected[0].second == expected[1].second);
+
+  size_t orders = 0;
+  mergeInEveryOrder<Top>(snapshots, [&](const Top &top) {
+    assert(top.payload().digest() == reference.payload().digest());
+    assert(top.query() == expected);
+    for (size_t i = 0; i < 50; i++) {
+      assert(top.estimate(player(i)) == reference.estimate(player(i)));
+    }
+    orders++;
+  });
+  LOG("TopK: %zu merge orders converged to %s and %s, %" PRIu64 " points each.\n", orders,
+      expected[0].first.c_str(), expected[1].first.c_str(), expected[0].second);
+  assert(orders == 720);
+}
+
+void simulateGCounterStores() {
+  using Store = ReplicaStore<GCounter>;
+  Store a("A");
+  Store b("B");
+  Store c("C");
+  Store *stores[] = {&a, &b, &c};
+
+  // Every store sends a batch to every other store. Returns the number of
+  // objects sent.
+  auto syncAll = [&]() {
+    size_t sent = 0;
+    for (Store *from : stores) {
+      for (Store *to : stores) {
+        if (from != to) {
+          auto batch = from->syncBatch(to->name());
+          LOG("'%s' sends %zu object(s) to '%s'.\n",
+              from->name().c_str(),
+              batch.size(),
+              to->name().c_str());
+          to->merge(from->name(), batch);
+          sent += batch.size();
+        }
+      }
+    }
+    return sent;
+  };
+  auto views = [](const Store &store, const std::string &page) {
+    const GCounter *counter = store.find(page);
+    return counter ? counter->query() : 0;
+  };
+  (void)views;
+
+  a.update("/home", [](GCounter &counter) { counter.increment(3); });
+  a.update("/about", [](GCounter &counter) { counter.increment(1); });
+  b.update("/home", [](GCounter &counter) { counter.increment(2); });
+  c.update("/pricing", [](GCounter &counter) { counter.increment(5); });
+  assert(a.dirtyCount("B") == 2);
+
+  // B only sends back to A what A is missing: "/home" has B's views too,
+  // "/about" is what A sent.
+  b.merge(a.name(), a.syncBatch(b.name()));
+  assert(b.dirtyCount("A") == 1);
+  assert(b.dirtyCount("C") == 2);
+
+  syncAll();
+  for (Store *store : stores) {
+    (void)store;
+    assert(store->size() == 3);
+    assert(views(*store, "/home") == 5);
+    assert(views(*store, "/about") == 1);
+    assert(views(*store, "/pricing") == 5);
+  }
+  // Objects a store got from one peer are forwarded to the others once, then
+  // the stores are quiet.
+  syncAll();
+  REQUIRE(syncAll() == 0);
+
+  // Only the objects that changed are sent.
+  c.update("/about", [](GCounter &counter) { counter.increment(1); });
+  assert(c.dirtyCount("A") == 1);
+  assert(c.dirtyCount("B") == 1);
+  syncAll();
+  assert(views(a, "/about") == 2);
+  assert(views(b, "/about") == 2);
+
+  // Payloads that change nothing don't add keys.
+  Store::SyncBatch empty;
+  empty.objects.emplace_back("/contact", GCounter("C").payload());
+  a.merge(c.name(), empty);
+  assert(a.size() == 3);
+  assert(a.find("/contact") == nullptr);
+}
+
+void simulatePerCoreGCounterStores() {
+  // Different number of cores, so batches from one store are regrouped by
+  // the other.
+  PerCoreStore<GCounter> a("A", 4);
+  PerCoreStore<GCounter> b("B", 3);
+  auto page = [](size_t i) { return "/page-" + std::to_string(i); };
+  auto views = [](auto &store, const std::string &page) {
+    return store.read(page, [](const GCounter *counter) { return counter ? counter->query() : 0; });
+  };
+  (void)views;
+  auto sync = [](auto &from, auto &to) {
+    size_t sent = 0;
+    auto batches = from.syncBatches(to.name());
+    for (auto &batch : batches) {
+      sent += batch.size();
+    }
+    LOG("'%s' sends %zu object(s) in %zu batches to '%s'.\n",
+        from.name().c_str(),
+        sent,
+        batches.size(),
+        to.name().c_str());
+    to.merge(from.name(), std::move(batches));
+    return sent;
+  };
+
+  for (size_t i = 0; i < 8; i++) {
+    a.update(page(i), [](GCounter &counter) { counter.increment(1); });
+    b.update(page(i + 4), [](GCounter &counter) { counter.increment(2); });
+  }
+  REQUIRE(sync(a, b) == 8);
+  // B doesn't send back pages 0-3, which it got from A unchanged.
+  REQUIRE(sync(b, a) == 8);
+  for (size_t i = 0; i < 12; i++) {
+    const uint64_t expected = (i < 8 ? 1 : 0) + (i >= 4 ? 2 : 0);
+    (void)expected;
+    assert(views(a, page(i)) == expected);
+    assert(views(b, page(i)) == expected);
+  }
+  // The pages that changed when A merged the batches from B are equal to
+  // what B sent, so A doesn't echo them.
+  REQUIRE(sync(a, b) == 0);
+  REQUIRE(sync(b, a) == 0);
+}
+
+// Workload driver {{{
+
+struct DriverParams {
+  const char *simulation = nullptr;
+  const char *crdt = "gcounter";
+  const char *topology = "p2p";
+  SyntheticWorkloadParams workload;
+  uint64_t ops = 1000000;  // per thread
+  double duration = 0;     // seconds per thread, overrides ops when set
+  size_t threads = 1;
+  uint64_t seed = 42;
+  size_t max_rounds = 100000;
+};
+
+struct DriverStats {
+  uint64_t ops = 0;
+  uint64_t updates = 0;
+  uint64_t queries = 0;
+  uint64_t syncs = 0;
+  uint64_t partition_events = 0;
+  uint64_t skipped = 0;
+  double seconds = 0;
+  // Convergence after the workload stopped and every replica reconnected.
+  uint64_t rounds = 0;
+  uint64_t messages = 0;
+  uint64_t bytes = 0;
+  double converge_seconds = 0;
+  bool converged = true;
+};
+
+void countOp(DriverStats &stats, const WorkloadOp &op) {
+  stats.ops += 1;
+  switch (op.code) {
+    case WorkloadOpCode::kQuery:
+      stats.queries += 1;
+      break;
+    case WorkloadOpCode::kBroadcast:
+    case WorkloadOpCode::kSyncWithServer:
+    case WorkloadOpCode::kGossip:
+      stats.syncs += 1;
+      break;
+    case WorkloadOpCode::kDisconnect:
+    case WorkloadOpCode::kReconnect:
+      stats.partition_events += 1;
+      break;
+    default:
+      stats.updates += 1;
+      break;
+  }
+}
+
+// Every thread drives its own independent network: replicas are not
+// thread-safe.
+template <template <typename> class Network, typename CRDT>
+DriverStats driveWorkload(const DriverParams &params, uint64_t seed) {
+  using Clock = std::chrono::steady_clock;
+  DriverStats stats;
+  WorkloadRunner<Network, CRDT> runner(params.workload.replicas);
+  SyntheticWorkload<Network, CRDT> workload(params.workload, seed);
+
+  const auto start = Clock::now();
+  const auto deadline = start + std::chrono::duration_cast<Clock::duration>(
+                                    std::chrono::duration<double>(params.duration));
+  for (uint64_t i = 0;; i++) {
+    if (params.duration > 0 ? (i % 1024 == 0 && Clock::now() >= deadline) : i >= params.ops) {
+      break;
+    }
+    const WorkloadOp op = workload.next();
+    countOp(stats, op);
+    runner.apply(op);
+  }
+  for (auto &op : workload.healPartitions()) {
+    countOp(stats, op);
+    runner.apply(op);
+  }
+  stats.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+  stats.skipped = runner.skipped();
+
+  const NetworkTraffic before = runner.network().traffic();
+  const WorkloadOp sync_round{syncRoundOpCode<Network<CRDT>>(), 0, 0, {}};
+  const auto converge_start = Clock::now();
+  while (runner.network().countPartitions() != 1) {
+    if (stats.rounds == params.max_rounds) {
+      stats.converged = false;
+      break;
+    }
+    runner.apply(sync_round);
+    stats.rounds += 1;
+  }
+  stats.converge_seconds = std::chrono::duration<double>(Clock::now() - converge_start).count();
+  stats.messages = runner.network().traffic().messages - before.messages;
+  stats.bytes = runner.network().traffic().bytes - before.bytes;
+  return stats;
+}
+
+template <template <typename> class Network, typename CRDT>
+void runDriver(const DriverParams &params) {
+  std::vector<DriverStats> results(params.threads);
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < params.threads; t++) {
+    threads.emplace_back(
+        [&, t] { results[t] = driveWorkload<Network, CRDT>(params, params.seed + t); });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  DriverStats total;
+  for (auto &r : results) {
+    total.ops += r.ops;
+    total.updates += r.updates;
+    total.queries += r.queries;
+    total.syncs += r.syncs;
+    total.partition_events += r.partition_events;
+    total.skipped += r.skipped;
+    total.seconds = std::max(total.seconds, r.seconds);
+    total.rounds = std::max(total.rounds, r.rounds);
+    total.messages += r.messages;
+    total.bytes += r.bytes;
+    total.converge_seconds = std::max(total.converge_seconds, r.converge_seconds);
+    total.converged = total.converged && r.converged;
+  }
+  printf("workload: crdt=%s topology=%s replicas=%" PRIu32 " threads=%zu keys=%zu zipf=%.2f\n",
+         params.crdt,
+         params.topology,
+         params.workload.replicas,
+         params.threads,
+         params.workload.keys,
+         params.workload.zipf);
+  printf("ops: %" PRIu64 " (updates %" PRIu64 ", queries %" PRIu64 ", syncs %" PRIu64
+         ", partition events %" PRIu64 ", skipped %" PRIu64 ")\n",
+         total.ops,
+         total.updates,
+         total.queries,
+         total.syncs,
+         total.partition_events,
+         total.skipped);
+  printf("throughput: %.0f ops/s (%.0f ops/s per thread) over %.3f s\n",
+         (double)total.ops / total.seconds,
+         (double)total.ops / total.seconds / (double)params.threads,
+         total.seconds);
+  printf("convergence: %s after %" PRIu64 " rounds (max over threads), %" PRIu64
+         " messages, %" PRIu64 " bytes, %.3f ms\n",
+         total.converged ? "converged" : "DID NOT CONVERGE",
+         total.rounds,
+         total.messages,
+         total.bytes,
+         total.converge_seconds * 1e3);
+}
+
+bool selected(const char *option, const char *value) { return strcmp(option, value) == 0; }
+
+template <template <typename> class Network>
+bool runDriverOnTopology(const DriverParams &params) {
+  if (selected(params.crdt, "gcounter")) {
+    runDriver<Network, GCounter>(params);
+  } else if (selected(params.crdt, "pncounter")) {
+    runDriver<Network, PNCounter>(params);
+  } else if (selected(params.crdt, "lww")) {
+    runDriver<Network, LWWRegister<std::string>>(params);
+  } else if (selected(params.crdt, "mvregister")) {
+    runDriver<Network, MVRegister<std::string>>(params);
+  } else if (selected(params.crdt, "2pset")) {
+    runDriver<Network, _2PSet<std::string>>(params);
+  } else {
+    fprintf(stderr, "Unknown CRDT '%s'.\n", params.crdt);
+    return false;
+  }
+  return true;
+}
+
+bool runSimulation(const char *name) {
+  const bool all = selected(name, "all");
+  bool found = all;
+  const std::pair<const char *, void (*)()> simulations[] = {
+      {"gcounter-p2p", simulateGCountersInP2PNetwork},
+      {"gcounter-fixed-p2p", simulateFixedGCountersInP2PNetwork},
+      {"gcounter-star", simulateGCountersInStarNetwork},
+      {"pncounter-p2p", simulatePNCountersInP2PNetwork},
+      {"lww-p2p", simulateLWWRegistersInP2PNetwork},
+      {"mvregister-p2p", simulateMVRegistersInP2PNetwork},
+      {"2pset-p2p", simulate2PSetsInP2PNetwork},
+      {"2pset-sharded", simulateSharded2PSets},
+      {"hll-star", simulateHyperLogLogsInStarNetwork},
+      {"cms-p2p", simulateCountMinSketchesInP2PNetwork},
+      {"cms-merge-orders", simulateCountMinSketchMergeOrders},
+      {"topk-p2p", simulateTopKInP2PNetwork},
+      {"topk-merge-orders", simulateTopKMergeOrders},
+      {"gcounter-store", simulateGCounterStores},
+      {"gcounter-per-core-store", simulatePerCoreGCounterStores},
+  };
+  for (auto & [ simulation_name, simulate ] : simulations) {
+    if (all || selected(name, simulation_name)) {
+      simulate();
+      found = true;
+    }
+  }
+  if (!found) {
+    fprintf(stderr, "Unknown simulation '%s'.\n", name);
+  }
+  return found;
+}
+
+void usage(const char *argv0) {
+  fprintf(stderr,
+          "Usage: %s [--simulation=NAME|all]\n"
+          "       %s [--crdt=gcounter|pncounter|lww|mvregister|2pset] [--topology=p2p|star|ring]\n"
+          "          [--replicas=N] [--mix=UPDATE:QUERY:SYNC] [--remove-ratio=F] [--keys=K]\n"
+          "          [--zipf=S] [--value-size=B] [--partition=EVERY:LENGTH:FRACTION]\n"
+          "          [--ops=N | --duration=SECONDS] [--threads=T] [--seed=S] [--max-rounds=M]\n"
+          "\n"
+          "Without --simulation, runs a synthetic workload (per thread, on independent\n"
+          "networks) and reports throughput and convergence statistics.\n",
+          argv0,
+          argv0);
+}
+
+bool parseDriverParams(int argc, char *argv[], DriverParams *params) {
+  auto &workload = params->workload;
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    const char *eq = strchr(arg, '=');
+    const std::string key(arg, eq ? (size_t)(eq - arg) : strlen(arg));
+    const char *value = eq ? eq + 1 : "";
+    if (key == "--simulation") {
+      params->simulation = value;
+    } else if (key == "--crdt") {
+      params->crdt = value;
+    } else if (key == "--topology") {
+      params->topology = value;
+    } else if (key == "--replicas") {
+      workload.replicas = (uint32_t)std::max(1ull, strtoull(value, nullptr, 10));
+    } else if (key == "--mix") {
+      if (sscanf(value,
+                 "%lf:%lf:%lf",
+                 &workload.update_weight,
+                 &workload.query_weight,
+                 &workload.sync_weight) != 3) {
+        return false;
+      }
+    } else if (key == "--remove-ratio") {
+      workload.remove_ratio = atof(value);
+    } else if (key == "--keys") {
+      workload.keys = strtoull(value, nullptr, 10);
+    } else if (key == "--zipf") {
+      workload.zipf = atof(value);
+    } else if (key == "--value-size") {
+      workload.value_size = strtoull(value, nullptr, 10);
+    } else if (key == "--partition") {
+      if (sscanf(value,
+                 "%" SCNu64 ":%" SCNu64 ":%lf",
+                 &workload.partition_every,
+                 &workload.partition_length,
+                 &workload.partition_fraction) != 3) {
+        return false;
+      }
+    } else if (key == "--ops") {
+      params->ops = strtoull(value, nullptr, 10);
+    } else if (key == "--duration") {
+      params->duration = atof(value);
+    } else if (key == "--threads") {
+      params->threads = std::max(1ull, strtoull(value, nullptr, 10));
+    } else if (key == "--seed") {
+      params->seed = strtoull(value, nullptr, 10);
+    } else if (key == "--max-rounds") {
+      params->max_rounds = strtoull(value, nullptr, 10);
+    } else {
+      fprintf(stderr, "Unknown option '%s'.\n", arg);
+      return false;
+    }
+  }
+  return true;
+}
+
+// }}}
+
 int main(int argc, char *argv[]) {
-  // simulateGCountersInP2PNetwork();
-  // simulateGCountersInStarNetwork();
-  // simulatePNCountersInP2PNetwork();
-  // simulateLWWRegistersInP2PNetwork();
-  // simulateMVRegistersInP2PNetwork();
-  // simulateMVRegistersInP2PNetwork();
-  simulate2PSetsInP2PNetwork();
-  return 0;
+  DriverParams params;
+  if (!parseDriverParams(argc, argv, &params)) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (params.simulation) {
+    return runSimulation(params.simulation) ? 0 : 1;
+  }
+
+  verboseLogging() = false;
+  bool ok = true;
+  if (selected(params.topology, "p2p")) {
+    ok = runDriverOnTopology<P2PNetwork>(params);
+  } else if (selected(params.topology, "star")) {
+    ok = runDriverOnTopology<StarNetwork>(params);
+  } else if (selected(params.topology, "ring")) {
+    ok = runDriverOnTopology<RingNetwork>(params);
+  } else {
+    fprintf(stderr, "Unknown topology '%s'.\n", params.topology);
+    ok = false;
+  }
+  return ok ? 0 : 1;
 }
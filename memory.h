@@ -0,0 +1,58 @@
+// Copyright (C) 2020 Felipe O. Carvalho
+#pragma once
+
+#include <cstddef>
+#include <cstdio>
+#include <string>
+#include <type_traits>
+
+// Memory footprint accounting
+//
+// Estimates are modeled after libstdc++: hash table nodes hold a next pointer
+// and the cached hash next to the value, and strings keep short contents
+// inline (SSO). Allocator headers and rounding are not accounted for.
+
+struct MemoryUsage {
+  size_t live = 0;        // bytes holding user-visible values
+  size_t metadata = 0;    // causality metadata, tombstones and container overhead
+  size_t tombstones = 0;  // portion of metadata held by removed elements
+
+  size_t total() const { return live + metadata; }
+
+  MemoryUsage &operator+=(const MemoryUsage &other) {
+    live += other.live;
+    metadata += other.metadata;
+    tombstones += other.tombstones;
+    return *this;
+  }
+
+  std::string toJSON() const {
+    char buf[128];
+    snprintf(buf,
+             sizeof(buf),
+             "{\"live\": %zu, \"metadata\": %zu, \"tombstones\": %zu, \"total\": %zu}",
+             live,
+             metadata,
+             tombstones,
+             total());
+    return buf;
+  }
+};
+
+// Heap bytes owned by a value, not counting sizeof(value) itself.
+template <typename T>
+std::enable_if_t<std::is_trivially_copyable_v<T>, size_t> heapBytes(const T &) {
+  return 0;
+}
+
+inline size_t heapBytes(const std::string &s) {
+  static const size_t inline_capacity = std::string().capacity();
+  return s.capacity() > inline_capacity ? s.capacity() + 1 : 0;
+}
+
+// Bytes an unordered container spends on its bucket array and on node
+// bookkeeping (next pointer and cached hash), excluding the values.
+template <typename HashContainer>
+size_t hashTableOverhead(const HashContainer &c) {
+  return c.bucket_count() * sizeof(void *) + c.size() * (sizeof(void *) + sizeof(size_t));
+}
@@ -0,0 +1,110 @@
+// Copyright (C) 2020 Felipe O. Carvalho
+#pragma once
+
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Merge instrumentation
+//
+// Every CRDT keeps a MergeMetrics record of the merges it performed. It is
+// only updated while metricsEnabled() is set, so the cost when disabled is a
+// branch per merge.
+
+inline bool &metricsEnabled() {
+  static bool enabled = false;
+  return enabled;
+}
+
+struct MergeMetrics {
+  uint64_t merges = 0;            // merge() calls
+  uint64_t effective_merges = 0;  // merges that changed the local state
+  uint64_t entries_examined = 0;  // version vector entries, register nodes, set elements...
+  uint64_t entries_updated = 0;   // ...that were inserted, replaced or dropped
+  uint64_t allocations = 0;       // container nodes allocated by merges
+  uint64_t payload_bytes = 0;     // encodedSize() of the merged payloads
+
+  uint64_t redundantMerges() const { return merges - effective_merges; }
+
+  MergeMetrics &operator+=(const MergeMetrics &other) {
+    merges += other.merges;
+    effective_merges += other.effective_merges;
+    entries_examined += other.entries_examined;
+    entries_updated += other.entries_updated;
+    allocations += other.allocations;
+    payload_bytes += other.payload_bytes;
+    return *this;
+  }
+
+  MergeMetrics operator-(const MergeMetrics &other) const {
+    MergeMetrics ret;
+    ret.merges = merges - other.merges;
+    ret.effective_merges = effective_merges - other.effective_merges;
+    ret.entries_examined = entries_examined - other.entries_examined;
+    ret.entries_updated = entries_updated - other.entries_updated;
+    ret.allocations = allocations - other.allocations;
+    ret.payload_bytes = payload_bytes - other.payload_bytes;
+    return ret;
+  }
+
+  std::string toJSON() const {
+    char buf[256];
+    snprintf(buf,
+             sizeof(buf),
+             "{\"merges\": %" PRIu64 ", \"effective_merges\": %" PRIu64
+             ", \"redundant_merges\": %" PRIu64 ", \"entries_examined\": %" PRIu64
+             ", \"entries_updated\": %" PRIu64 ", \"allocations\": %" PRIu64
+             ", \"payload_bytes\": %" PRIu64 "}",
+             merges,
+             effective_merges,
+             redundantMerges(),
+             entries_examined,
+             entries_updated,
+             allocations,
+             payload_bytes);
+    return buf;
+  }
+};
+
+// Accounts one CRDT::merge() call. The payload merge itself reports the
+// entries it examined and updated through sink(); a merge that updated at
+// least one entry is an effective merge.
+class MergeRecorder {
+ public:
+  template <typename Payload>
+  MergeRecorder(MergeMetrics &metrics, const Payload &incoming)
+      : _metrics(metricsEnabled() ? &metrics : nullptr) {
+    if (_metrics) {
+      _metrics->merges += 1;
+      _metrics->payload_bytes += incoming.encodedSize();
+      _entries_updated = _metrics->entries_updated;
+    }
+  }
+
+  // A batch merge counts as a merge per payload.
+  template <typename Payload>
+  MergeRecorder(MergeMetrics &metrics, const std::vector<const Payload *> &incoming)
+      : _metrics(metricsEnabled() ? &metrics : nullptr) {
+    if (_metrics) {
+      _metrics->merges += incoming.size();
+      for (const Payload *payload : incoming) {
+        _metrics->payload_bytes += payload->encodedSize();
+      }
+      _entries_updated = _metrics->entries_updated;
+    }
+  }
+
+  ~MergeRecorder() {
+    if (_metrics && _metrics->entries_updated != _entries_updated) {
+      _metrics->effective_merges += 1;
+    }
+  }
+
+  MergeMetrics *sink() const { return _metrics; }
+
+ private:
+  MergeMetrics *_metrics;
+  uint64_t _entries_updated = 0;
+};
@@ -0,0 +1,576 @@
+// Copyright (C) 2020 Felipe O. Carvalho
+#pragma once
+
+#include <cassert>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include "lib.h"
+#include "metrics.h"
+#include "trace.h"
+#include "traits.h"
+
+// Messages and bytes exchanged by the replicas of a network, and how many
+// of the payloads received were merged (digest-only messages aren't).
+// Unlike MergeMetrics, these are counted even when metrics are disabled.
+struct NetworkTraffic {
+  uint64_t messages = 0;
+  uint64_t bytes = 0;
+  uint64_t merges = 0;
+};
+
+// Snapshot of the traffic of a network and of the merge work it caused on the
+// receiving replicas. Merge work is only recorded while metricsEnabled().
+struct NetworkMetrics {
+  NetworkTraffic traffic;
+  MergeMetrics merges;
+
+  std::string toJSON() const {
+    char buf[128];
+    snprintf(buf,
+             sizeof(buf),
+             "{\"messages\": %" PRIu64 ", \"bytes\": %" PRIu64 ", \"merges\": ",
+             traffic.messages,
+             traffic.bytes);
+    return buf + merges.toJSON() + "}";
+  }
+};
+
+// Sends payloads between the replicas of a network with the cheapest
+// strategy CRDTTraits<CRDT> allows, and accounts for the traffic and for the
+// merge work on the receiving replicas. Replicas are identified by their
+// index in the network.
+template <typename CRDT>
+class SyncTransport {
+ public:
+  using Payload = typename CRDT::Payload;
+  using Traits = CRDTTraits<CRDT>;
+
+  // Replica from sends payload, its state, to replica to.
+  //
+  // With digests, the digest of the last state sent to every peer is
+  // remembered and a state that didn't change since isn't sent again: the
+  // peer merged it already and states only grow.
+  void push(size_t from, size_t to, const Payload &payload, CRDT *receiver) {
+    if constexpr (Traits::has_digest) {
+      const uint64_t digest = payload.digest();
+      auto[it, inserted] = _sent_digests.try_emplace({from, to}, digest);
+      if (!inserted && it->second == digest) {
+        return;
+      }
+      it->second = digest;
+    }
+    send(wireSize<CRDT>(payload));
+    merge(receiver, payload);
+  }
+
+  // Like push() from every (from, payload) of payloads to replica to, but
+  // the receiver merges them all at once.
+  void pushBatch(const std::vector<std::pair<size_t, const Payload *>> &payloads,
+                 size_t to,
+                 CRDT *receiver) {
+    static_assert(Traits::has_batch_merge, "CRDT has no mergeBatch()");
+    std::vector<const Payload *> batch;
+    for (auto[from, payload] : payloads) {
+      if constexpr (Traits::has_digest) {
+        const uint64_t digest = payload->digest();
+        auto[it, inserted] = _sent_digests.try_emplace({from, to}, digest);
+        if (!inserted && it->second == digest) {
+          continue;
+        }
+        it->second = digest;
+      }
+      send(wireSize<CRDT>(*payload));
+      batch.push_back(payload);
+    }
+    if (!batch.empty()) {
+      const MergeMetrics before = receiver->metrics();
+      receiver->mergeBatch(batch);
+      _traffic.merges += batch.size();
+      _merge_metrics += receiver->metrics() - before;
+    }
+  }
+
+  // What a client sends in an exchange: its state, unless the server merged
+  // it already.
+  struct ExchangeRequest {
+    size_t client_index = 0;
+    const Payload *payload = nullptr;  // null when only the digest is sent
+    uint64_t digest = 0;               // with digests
+    size_t bytes = 0;
+  };
+
+  // What the server replies: its state, or a delta of it, unless the client
+  // is up to date.
+  struct ExchangeReply {
+    std::optional<Payload> payload;
+    size_t bytes = 0;
+  };
+
+  // A request/response transaction in which the client sends its state and
+  // the server replies with what it had before merging the request, so that
+  // both end up with the same state. Always two messages:
+  //
+  // - With digests, both carry the digest of the sender, a client whose
+  //   state didn't change since its previous exchange sends the digest
+  //   alone (the server merged that state already), and a server with the
+  //   same digest as the client replies with the digest alone.
+  // - With deltas, the reply to a request with a payload is the delta of the
+  //   server against it.
+  void exchange(size_t client_index, CRDT *client, CRDT *server) {
+    const ExchangeRequest request = sendRequest(client_index, *client);
+    receiveReply(request, client, reply(request, server));
+  }
+
+  // The steps of exchange(), for networks that deliver the request and the
+  // reply at different times (see async.h). request.payload must stay valid
+  // until the server replied.
+  ExchangeRequest sendRequest(size_t client_index, const CRDT &client) {
+    ExchangeRequest request;
+    request.client_index = client_index;
+    request.payload = &client.payload();
+    if constexpr (Traits::has_digest) {
+      request.digest = client.payload().digest();
+      const uint64_t *synced = lookup(_synced_digests, client_index);
+      request.payload = !synced || *synced != request.digest ? request.payload : nullptr;
+      request.bytes = sizeof(uint64_t);
+    }
+    request.bytes += request.payload ? wireSize<CRDT>(*request.payload) : 0;
+    send(request.bytes);
+    return request;
+  }
+
+  // Sends the reply of server to request, then merges the request.
+  ExchangeReply reply(const ExchangeRequest &request, CRDT *server) {
+    ExchangeReply reply;
+    if constexpr (Traits::has_digest) {
+      reply.bytes = sizeof(uint64_t);
+      if (server->payload().digest() == request.digest) {
+        send(reply.bytes);
+        return reply;
+      }
+    }
+    if constexpr (Traits::has_delta) {
+      if (request.payload) {
+        reply.payload.emplace(server->payload().delta(*request.payload));
+      }
+    }
+    // The reply is a copy since the server merges the request before the
+    // client merges the reply.
+    if (!reply.payload) {
+      reply.payload.emplace(server->payload());
+    }
+    if (request.payload) {
+      merge(server, *request.payload);
+    }
+    reply.bytes += wireSize<CRDT>(*reply.payload);
+    send(reply.bytes);
+    return reply;
+  }
+
+  void receiveReply(const ExchangeRequest &request, CRDT *client, const ExchangeReply &reply) {
+    if (reply.payload) {
+      merge(client, *reply.payload);
+    }
+    if constexpr (Traits::has_digest) {
+      _synced_digests[request.client_index] = client->payload().digest();
+    }
+  }
+
+  // Forgets what every replica is known to have, e.g. when a replica is
+  // replaced by another one.
+  void reset() {
+    _sent_digests.clear();
+    _synced_digests.clear();
+  }
+
+  const NetworkTraffic &traffic() const { return _traffic; }
+  NetworkMetrics metrics() const { return {_traffic, _merge_metrics}; }
+
+ private:
+  void send(size_t bytes) {
+    _traffic.messages += 1;
+    _traffic.bytes += bytes;
+  }
+
+  void merge(CRDT *replica, const Payload &payload) {
+    const MergeMetrics before = replica->metrics();
+    replica->merge(payload);
+    _traffic.merges += 1;
+    _merge_metrics += replica->metrics() - before;
+  }
+
+  std::unordered_map<std::pair<size_t, size_t>, uint64_t> _sent_digests;  // (from, to)
+  std::unordered_map<size_t, uint64_t> _synced_digests;  // client -> digest after its exchange
+  NetworkTraffic _traffic;
+  MergeMetrics _merge_metrics;
+};
+
+template <typename CRDT>
+class P2PNetwork {
+ public:
+  size_t add(CRDT *crdt) {
+    _replicas.push_back(crdt);
+    return _replicas.size() - 1;
+  }
+
+  void disconnect(size_t i) {
+    TRACE_SCOPE("network", "disconnect");
+    CRDT *replica = _replicas[i];
+    if (replica) {
+      LOG("Disconnect '%s' from the network.\n", replica->name().c_str());
+      _replicas[i] = nullptr;
+      _offline_set.emplace(i, replica);
+    }
+  }
+
+  void reconnect(size_t i) {
+    TRACE_SCOPE("network", "reconnect");
+    for (auto it = _offline_set.begin(); it != _offline_set.end(); ++it) {
+      if (it->first == i) {
+        assert(_replicas[i] == nullptr);
+        LOG("Reconnecting '%s' to the network.\n", it->second->name().c_str());
+        _replicas[i] = it->second;
+        _offline_set.erase(it);
+        break;
+      }
+    }
+  }
+
+  void broadcast(size_t i) {
+    TRACE_SCOPE("network", "broadcast");
+    const CRDT *replica = _replicas[i];
+    if (!replica) {
+      return;
+    }
+    LOG("Broadcasting from '%s' to all connected replicas...\n", replica->name().c_str());
+    for (size_t j = 0; j < _replicas.size(); j++) {
+      if (j != i) {
+        auto *other = _replicas[j];
+        if (other) {
+          _transport.push(i, j, replica->payload(), other);
+        }
+      }
+    }
+  }
+
+  // CRDTs with batch merges merge the payloads all the other replicas had at
+  // the start of the round at once. The others merge one payload at a time,
+  // as every replica broadcasts in turn.
+  void broadcastAll() {
+    TRACE_SCOPE("network", "broadcastAll");
+    if constexpr (CRDTTraits<CRDT>::has_batch_merge) {
+      LOG("Broadcasting from all replicas to all connected replicas...\n");
+      std::vector<std::optional<typename CRDT::Payload>> snapshot(_replicas.size());
+      for (size_t i = 0; i < _replicas.size(); i++) {
+        if (_replicas[i]) {
+          snapshot[i].emplace(_replicas[i]->payload());
+        }
+      }
+      std::vector<std::pair<size_t, const typename CRDT::Payload *>> payloads;
+      for (size_t j = 0; j < _replicas.size(); j++) {
+        if (!_replicas[j]) {
+          continue;
+        }
+        payloads.clear();
+        for (size_t i = 0; i < _replicas.size(); i++) {
+          if (i != j && snapshot[i]) {
+            payloads.emplace_back(i, &*snapshot[i]);
+          }
+        }
+        _transport.pushBatch(payloads, j, _replicas[j]);
+      }
+    } else {
+      for (size_t i = 0; i < _replicas.size(); i++) {
+        broadcast(i);
+      }
+    }
+  }
+
+  int countPartitions() const {
+    std::unordered_set<typename CRDT::ValueType> distinct_values;
+    for (auto *replica : _replicas) {
+      if (replica) {
+        const auto value = replica->query();
+        distinct_values.insert(value);
+      }
+    }
+    for (auto & [ _, replica ] : _offline_set) {
+      const auto value = replica->query();
+      distinct_values.insert(value);
+    }
+    return (int)distinct_values.size();
+  }
+
+  void dump() const {
+    printf("P2P network state:\n");
+    if (!_offline_set.empty()) {
+      printf("- online:\n");
+    }
+    for (auto *replica : _replicas) {
+      if (replica) {
+        replica->dump();
+      }
+    }
+    if (!_offline_set.empty()) {
+      printf("- offline\n");
+      for (auto[_, replica] : _offline_set) {
+        replica->dump();
+      }
+    }
+    if (countPartitions() == 1) {
+      puts("ALL CONVERGED!");
+    }
+    printf("\n");
+  }
+
+  const NetworkTraffic &traffic() const { return _transport.traffic(); }
+  NetworkMetrics metrics() const { return _transport.metrics(); }
+
+ private:
+  std::vector<CRDT *> _replicas;
+  std::unordered_set<std::pair<size_t, CRDT *>> _offline_set;
+  SyncTransport<CRDT> _transport;
+};
+
+template <typename CRDT>
+class StarNetwork {
+ public:
+  size_t setServerReplica(CRDT *crdt) {
+    if (_replicas.empty()) {
+      _replicas.push_back(crdt);
+    } else {
+      _replicas[0] = crdt;
+    }
+    _transport.reset();
+    return 0;
+  }
+
+  size_t add(CRDT *crdt) {
+    if (_replicas.empty()) {
+      _replicas.push_back(nullptr);  // The 0-th replica is the server replica
+    }
+    _replicas.push_back(crdt);
+    return _replicas.size() - 1;
+  }
+
+  void disconnect(size_t i) {
+    TRACE_SCOPE("network", "disconnect");
+    CRDT *replica = _replicas[i];
+    if (replica) {
+      if (i == 0) {
+        LOG("Server is down.\n");
+      } else {
+        LOG("Disconnect '%s' from the network.\n", replica->name().c_str());
+      }
+      _replicas[i] = nullptr;
+      _offline_set.emplace(i, replica);
+    }
+  }
+
+  void reconnect(size_t i) {
+    TRACE_SCOPE("network", "reconnect");
+    for (auto it = _offline_set.begin(); it != _offline_set.end(); ++it) {
+      if (it->first == i) {
+        assert(_replicas[i] == nullptr);
+        if (i == 0) {
+          LOG("Server is back up.\n");
+        } else {
+          LOG("Reconnecting '%s' to the network.\n", it->second->name().c_str());
+        }
+        _replicas[i] = it->second;
+        _offline_set.erase(it);
+        break;
+      }
+    }
+  }
+
+  void syncWithServer(size_t i) {
+    TRACE_SCOPE("network", "syncWithServer");
+    if (i == 0) {
+      return;  // 0 is the server
+    }
+    auto *server = _replicas[0];
+    auto *replica = _replicas[i];
+    if (!replica) {
+      return;
+    }
+    if (!server) {
+      LOG("Server is not reachable from replica '%s'.\n", replica->name().c_str());
+      return;
+    }
+    LOG("Replica '%s' is syncing with %s.\n", replica->name().c_str(), server->name().c_str());
+    // This simulates a request/response transaction in which the server
+    // immediatelly replies with what it has and performs the merge
+    // asynchrnously (i.e. after replying) for low-latency. Due to merge's
+    // commutativity, both replicas (client and server) will reach the same CRDT
+    // state.
+    _transport.exchange(i, replica, server);
+    assert(replica->query() == server->query());
+  }
+
+  void syncAllReplicasToServer() {
+    TRACE_SCOPE("network", "syncAllReplicasToServer");
+    // i=0 is skipped (0 is the server)
+    for (size_t i = 1; i < _replicas.size(); i++) {
+      syncWithServer(i);
+    }
+  }
+
+  int countPartitions() const {
+    std::unordered_set<typename CRDT::ValueType> distinct_values;
+    for (auto *replica : _replicas) {
+      if (replica) {
+        const auto value = replica->query();
+        distinct_values.insert(value);
+      }
+    }
+    for (auto & [ _, replica ] : _offline_set) {
+      const auto value = replica->query();
+      distinct_values.insert(value);
+    }
+    return (int)distinct_values.size();
+  }
+
+  void dump() const {
+    printf("Star-network state:\n");
+    if (!_offline_set.empty()) {
+      printf("- online:\n");
+    }
+    for (auto *replica : _replicas) {
+      if (replica) {
+        replica->dump();
+      }
+    }
+    if (!_offline_set.empty()) {
+      printf("- offline\n");
+      for (auto[_, replica] : _offline_set) {
+        replica->dump();
+      }
+    }
+    if (countPartitions() == 1) {
+      puts("ALL CONVERGED!");
+    }
+    printf("\n");
+  }
+
+  const NetworkTraffic &traffic() const { return _transport.traffic(); }
+  NetworkMetrics metrics() const { return _transport.metrics(); }
+
+ private:
+  std::vector<CRDT *> _replicas;
+  std::unordered_set<std::pair<size_t, CRDT *>> _offline_set;
+  SyncTransport<CRDT> _transport;
+};
+
+// Replicas are arranged in a ring and only ever talk to the next online
+// replica clockwise. Cheap on messages (one per replica per round) but
+// updates take up to N rounds to go around the ring.
+template <typename CRDT>
+class RingNetwork {
+ public:
+  size_t add(CRDT *crdt) {
+    _replicas.push_back(crdt);
+    return _replicas.size() - 1;
+  }
+
+  void disconnect(size_t i) {
+    TRACE_SCOPE("network", "disconnect");
+    CRDT *replica = _replicas[i];
+    if (replica) {
+      LOG("Disconnect '%s' from the network.\n", replica->name().c_str());
+      _replicas[i] = nullptr;
+      _offline_set.emplace(i, replica);
+    }
+  }
+
+  void reconnect(size_t i) {
+    TRACE_SCOPE("network", "reconnect");
+    for (auto it = _offline_set.begin(); it != _offline_set.end(); ++it) {
+      if (it->first == i) {
+        assert(_replicas[i] == nullptr);
+        LOG("Reconnecting '%s' to the network.\n", it->second->name().c_str());
+        _replicas[i] = it->second;
+        _offline_set.erase(it);
+        break;
+      }
+    }
+  }
+
+  void gossip(size_t i) {
+    TRACE_SCOPE("network", "gossip");
+    const CRDT *replica = _replicas[i];
+    if (!replica) {
+      return;
+    }
+    for (size_t k = 1; k < _replicas.size(); k++) {
+      const size_t j = (i + k) % _replicas.size();
+      auto *successor = _replicas[j];
+      if (successor) {
+        LOG("Replica '%s' is gossiping to '%s'.\n",
+            replica->name().c_str(),
+            successor->name().c_str());
+        _transport.push(i, j, replica->payload(), successor);
+        return;
+      }
+    }
+  }
+
+  void gossipAll() {
+    TRACE_SCOPE("network", "gossipAll");
+    for (size_t i = 0; i < _replicas.size(); i++) {
+      gossip(i);
+    }
+  }
+
+  int countPartitions() const {
+    std::unordered_set<typename CRDT::ValueType> distinct_values;
+    for (auto *replica : _replicas) {
+      if (replica) {
+        const auto value = replica->query();
+        distinct_values.insert(value);
+      }
+    }
+    for (auto & [ _, replica ] : _offline_set) {
+      const auto value = replica->query();
+      distinct_values.insert(value);
+    }
+    return (int)distinct_values.size();
+  }
+
+  void dump() const {
+    printf("Ring-network state:\n");
+    if (!_offline_set.empty()) {
+      printf("- online:\n");
+    }
+    for (auto *replica : _replicas) {
+      if (replica) {
+        replica->dump();
+      }
+    }
+    if (!_offline_set.empty()) {
+      printf("- offline\n");
+      for (auto[_, replica] : _offline_set) {
+        replica->dump();
+      }
+    }
+    if (countPartitions() == 1) {
+      puts("ALL CONVERGED!");
+    }
+    printf("\n");
+  }
+
+  const NetworkTraffic &traffic() const { return _transport.traffic(); }
+  NetworkMetrics metrics() const { return _transport.metrics(); }
+
+ private:
+  std::vector<CRDT *> _replicas;
+  std::unordered_set<std::pair<size_t, CRDT *>> _offline_set;
+  SyncTransport<CRDT> _transport;
+};
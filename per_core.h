@@ -0,0 +1,252 @@
+// Copyright (C) 2020 Felipe O. Carvalho
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "hash.h"
+#include "store.h"
+
+// Thread-per-core keyspaces
+//
+// A PerCoreStore is a ReplicaStore whose keyspace is hash-partitioned onto a
+// fixed set of cores (threads). Every core owns the ReplicaStore of its
+// partition and is the only thread that ever touches it, so objects are never
+// locked. Local mutations, merges and sync batches are sent to the owning
+// core as tasks through a single-producer single-consumer queue, and sync
+// batches are built by all cores in parallel.
+//
+// Tasks are submitted by a single thread, the one that owns the
+// PerCoreStore. They run asynchronously: drain() waits for all of them, and
+// the methods that return results wait for the tasks they submitted.
+//
+//   PerCoreStore<GCounter> store("A", 4);
+//   store.update("/home", [](GCounter &views) { views.increment(1); });
+//   peer.merge(store.name(), store.syncBatches(peer.name()));
+
+// Bounded lock-free queue for one producer thread and one consumer thread.
+template <typename T>
+class SpscQueue {
+ public:
+  explicit SpscQueue(size_t capacity) {
+    size_t slots = 1;
+    while (slots < capacity) {
+      slots *= 2;
+    }
+    _slots.resize(slots);
+    _mask = slots - 1;
+  }
+
+  // Called by the producer. Fails when the queue is full.
+  bool tryPush(T &&value) {
+    const size_t tail = _tail.load(std::memory_order_relaxed);
+    if (tail - _cached_head == _slots.size()) {
+      _cached_head = _head.load(std::memory_order_acquire);
+      if (tail - _cached_head == _slots.size()) {
+        return false;
+      }
+    }
+    _slots[tail & _mask] = std::move(value);
+    _tail.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Called by the consumer. Fails when the queue is empty.
+  bool tryPop(T &value) {
+    const size_t head = _head.load(std::memory_order_relaxed);
+    if (head == _cached_tail) {
+      _cached_tail = _tail.load(std::memory_order_acquire);
+      if (head == _cached_tail) {
+        return false;
+      }
+    }
+    value = std::move(_slots[head & _mask]);
+    _head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+ private:
+  std::vector<T> _slots;
+  size_t _mask;
+  // The producer and the consumer each write their own cache line and keep a
+  // cached copy of the other index, which they only reload when it looks
+  // like the queue is full (or empty).
+  alignas(64) std::atomic<size_t> _head{0};
+  size_t _cached_tail = 0;
+  alignas(64) std::atomic<size_t> _tail{0};
+  size_t _cached_head = 0;
+};
+
+template <typename CRDT, typename Key = std::string>
+class PerCoreStore {
+ public:
+  using Store = ReplicaStore<CRDT, Key>;
+  using SyncBatch = typename Store::SyncBatch;
+  // One batch per core of the sending store.
+  using SyncBatches = std::vector<SyncBatch>;
+
+  static constexpr size_t kQueueCapacity = 1024;
+
+  explicit PerCoreStore(std::string name,
+                        size_t cores = std::max(1u, std::thread::hardware_concurrency()))
+      : _name(std::move(name)) {
+    for (size_t i = 0; i < std::max<size_t>(1, cores); i++) {
+      _cores.push_back(std::make_unique<Core>(_name));
+    }
+    for (auto &core : _cores) {
+      core->thread = std::thread([this, c = core.get()] { run(*c); });
+    }
+  }
+
+  PerCoreStore(const PerCoreStore &) = delete;
+  PerCoreStore &operator=(const PerCoreStore &) = delete;
+
+  ~PerCoreStore() {
+    _stop.store(true, std::memory_order_release);
+    for (auto &core : _cores) {
+      core->thread.join();
+    }
+  }
+
+  const std::string &name() const { return _name; }
+  size_t coreCount() const { return _cores.size(); }
+
+  size_t coreFor(const Key &key) const {
+    return (size_t)(hashing::hash(key) % _cores.size());
+  }
+
+  // Runs f(crdt) on the core that owns key, creating the object if needed.
+  template <typename F>
+  void update(const Key &key, F f) {
+    submit(coreFor(key), [key, f = std::move(f)](Store &store) mutable { store.update(key, f); });
+  }
+
+  // Merges batches built by the PerCoreStore peer. When both stores have the
+  // same number of cores, every batch goes straight to the core with the
+  // same index; otherwise the objects are regrouped by owning core first.
+  void merge(const std::string &peer, SyncBatches batches) {
+    if (batches.size() != _cores.size()) {
+      SyncBatches regrouped(_cores.size());
+      for (auto &batch : batches) {
+        for (auto &object : batch.objects) {
+          regrouped[coreFor(object.first)].objects.push_back(std::move(object));
+        }
+      }
+      batches = std::move(regrouped);
+    }
+    for (size_t i = 0; i < _cores.size(); i++) {
+      if (!batches[i].empty()) {
+        submit(i, [peer, batch = std::move(batches[i])](Store &store) {
+          store.merge(peer, batch);
+        });
+      }
+    }
+  }
+
+  // Every core builds the batch of its partition for peer.
+  SyncBatches syncBatches(const std::string &peer) {
+    SyncBatches batches(_cores.size());
+    for (size_t i = 0; i < _cores.size(); i++) {
+      submit(i, [&peer, batch = &batches[i]](Store &store) { *batch = store.syncBatch(peer); });
+    }
+    drain();
+    return batches;
+  }
+
+  // Calls f(crdt) with the object with the given key, or nullptr, on the
+  // core that owns it, and returns what f returned.
+  template <typename F>
+  auto read(const Key &key, F &&f) {
+    using Result = decltype(f(std::declval<const CRDT *>()));
+    std::optional<Result> result;
+    const size_t i = coreFor(key);
+    submit(i, [&](Store &store) { result.emplace(f(store.find(key))); });
+    wait(*_cores[i]);
+    return std::move(*result);
+  }
+
+  // Runs f(store) on every core, in parallel, and waits for all of them. f
+  // must be safe to call concurrently.
+  template <typename F>
+  void forEachCore(F &&f) {
+    for (size_t i = 0; i < _cores.size(); i++) {
+      submit(i, [&f](Store &store) { f(static_cast<const Store &>(store)); });
+    }
+    drain();
+  }
+
+  // Waits until every submitted task ran.
+  void drain() {
+    for (auto &core : _cores) {
+      wait(*core);
+    }
+  }
+
+ private:
+  using Task = std::function<void(Store &)>;
+
+  struct Core {
+    explicit Core(const std::string &name) : store(name), inbox(kQueueCapacity) {}
+
+    Store store;
+    SpscQueue<Task> inbox;
+    std::atomic<uint64_t> completed{0};
+    uint64_t submitted = 0;  // only accessed by the submitting thread
+    std::thread thread;
+  };
+
+  // Spins first, then yields and then sleeps, so that idle cores don't keep
+  // a CPU busy when there are more cores than CPUs.
+  static void backoff(size_t attempt) {
+    if (attempt < 64) {
+      return;
+    } else if (attempt < 1024) {
+      std::this_thread::yield();
+    } else {
+      std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+  }
+
+  void submit(size_t i, Task task) {
+    Core &core = *_cores[i];
+    for (size_t attempt = 0; !core.inbox.tryPush(std::move(task)); attempt++) {
+      backoff(attempt);
+    }
+    core.submitted += 1;
+  }
+
+  void wait(const Core &core) const {
+    for (size_t attempt = 0; core.completed.load(std::memory_order_acquire) < core.submitted;
+         attempt++) {
+      backoff(attempt);
+    }
+  }
+
+  void run(Core &core) {
+    Task task;
+    for (size_t attempt = 0;; attempt++) {
+      if (core.inbox.tryPop(task)) {
+        task(core.store);
+        task = nullptr;
+        core.completed.fetch_add(1, std::memory_order_release);
+        attempt = 0;
+      } else if (_stop.load(std::memory_order_acquire)) {
+        return;
+      } else {
+        backoff(attempt);
+      }
+    }
+  }
+
+  std::string _name;
+  std::vector<std::unique_ptr<Core>> _cores;
+  std::atomic<bool> _stop{false};
+};
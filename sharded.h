@@ -0,0 +1,227 @@
+// Copyright (C) 2020 Felipe O. Carvalho
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include "crdt.h"
+#include "thread_pool.h"
+
+// Hash-partitioned sets
+//
+// A Sharded2PSet behaves exactly like a _2PSet, but its payload is split by
+// element hash into a fixed number of shards, each an ordinary
+// _2PSet::Payload. Two payloads with the same number of shards are
+// partitioned the same way, so merging them merges shard i into shard i, and
+// all shards can be merged in parallel without any locking. Use it for sets
+// with millions of elements, where a sequential anti-entropy merge takes too
+// long.
+
+template <typename T>
+class Sharded2PSet {
+ public:
+  using ValueType = std::unordered_set<T>;
+  using Shard = typename _2PSet<T>::Payload;
+
+  static constexpr size_t kDefaultShards = 64;
+  // Merges of fewer incoming elements run on the calling thread.
+  static constexpr size_t kParallelMergeThreshold = 1 << 14;
+
+  class Payload {
+   public:
+    explicit Payload(size_t shards = kDefaultShards) : _shards(std::max<size_t>(1, shards)) {}
+
+    // Partitions a plain _2PSet payload. Buckets of the source are split
+    // into ranges that are grouped by shard in parallel, then every shard is
+    // filled by a single task.
+    static Payload partition(const Shard &source,
+                             size_t shards = kDefaultShards,
+                             ThreadPool &pool = ThreadPool::shared()) {
+      Payload payload(shards);
+      const auto added = payload.groupByShard(source.added(), pool);
+      const auto removed = payload.groupByShard(source.removed(), pool);
+      pool.parallelFor(payload._shards.size(), [&](size_t i) {
+        Shard &shard = payload._shards[i];
+        for (auto &batches : added) {
+          for (const T *value : batches[i]) {
+            shard.add(*value);
+          }
+        }
+        for (auto &batches : removed) {
+          for (const T *value : batches[i]) {
+            REQUIRE(shard.remove(*value));
+          }
+        }
+      });
+      return payload;
+    }
+
+    size_t shardCount() const { return _shards.size(); }
+    const Shard &shard(size_t i) const { return _shards[i]; }
+
+    size_t shardFor(const T &value) const {
+      return (size_t)(hashing::hash(value) % _shards.size());
+    }
+
+    ValueType query() const {
+      ValueType ret;
+      for (auto &shard : _shards) {
+        auto values = shard.query();
+        ret.insert(values.begin(), values.end());
+      }
+      return ret;
+    }
+
+    bool contains(const T &value) const { return _shards[shardFor(value)].contains(value); }
+    void add(const T &value) { _shards[shardFor(value)].add(value); }
+    [[nodiscard]] bool remove(const T &value) { return _shards[shardFor(value)].remove(value); }
+
+    size_t size() const {
+      size_t size = 0;
+      for (auto &shard : _shards) {
+        size += shard.added().size() + shard.removed().size();
+      }
+      return size;
+    }
+
+    size_t encodedSize() const {
+      size_t size = sizeof(uint32_t);
+      for (auto &shard : _shards) {
+        size += shard.encodedSize();
+      }
+      return size;
+    }
+
+    MemoryUsage memoryUsage() const {
+      MemoryUsage usage;
+      usage.metadata = sizeof(*this);
+      for (auto &shard : _shards) {
+        usage += shard.memoryUsage();
+      }
+      return usage;
+    }
+
+    // The result is the same as merging the union of the shards of other
+    // into a plain _2PSet payload.
+    // Returns whether any shard changed.
+    bool merge(const Payload &other,
+               MergeMetrics *metrics = nullptr,
+               ThreadPool &pool = ThreadPool::shared()) {
+      if (other._shards.size() != _shards.size()) {
+        bool changed = false;
+        for (auto &shard : other._shards) {
+          changed = mergeUnpartitioned(shard, metrics) || changed;
+        }
+        return changed;
+      }
+      std::vector<MergeMetrics> shard_metrics(metrics ? _shards.size() : 0);
+      std::vector<char> shard_changed(_shards.size(), false);
+      auto mergeShard = [&](size_t i) {
+        shard_changed[i] =
+            _shards[i].merge(other._shards[i], metrics ? &shard_metrics[i] : nullptr);
+      };
+      if (other.size() < kParallelMergeThreshold) {
+        for (size_t i = 0; i < _shards.size(); i++) {
+          mergeShard(i);
+        }
+      } else {
+        pool.parallelFor(_shards.size(), mergeShard);
+      }
+      for (auto &m : shard_metrics) {
+        *metrics += m;
+      }
+      return std::any_of(shard_changed.begin(), shard_changed.end(), [](char c) { return c; });
+    }
+
+   private:
+    // Per task, per shard, pointers to the elements of source.
+    std::vector<std::vector<std::vector<const T *>>> groupByShard(
+        const std::unordered_set<T> &source, ThreadPool &pool) const {
+      const size_t buckets = source.bucket_count();
+      const size_t tasks = std::min(buckets, pool.size() * 4);
+      std::vector<std::vector<std::vector<const T *>>> grouped(
+          tasks, std::vector<std::vector<const T *>>(_shards.size()));
+      pool.parallelFor(tasks, [&](size_t task) {
+        for (size_t b = buckets * task / tasks; b < buckets * (task + 1) / tasks; b++) {
+          for (auto it = source.begin(b); it != source.end(b); ++it) {
+            grouped[task][shardFor(*it)].push_back(&*it);
+          }
+        }
+      });
+      return grouped;
+    }
+
+    bool mergeUnpartitioned(const Shard &other, MergeMetrics *metrics) {
+      size_t updated = 0;
+      for (const auto &value : other.added()) {
+        Shard &shard = _shards[shardFor(value)];
+        updated += ::contains(shard.added(), value) ? 0 : 1;
+        shard.add(value);
+      }
+      for (const auto &value : other.removed()) {
+        Shard &shard = _shards[shardFor(value)];
+        updated += ::contains(shard.removed(), value) ? 0 : 1;
+        REQUIRE(shard.remove(value));
+      }
+      if (metrics) {
+        metrics->entries_examined += other.added().size() + other.removed().size();
+        metrics->entries_updated += updated;
+      }
+      return updated > 0;
+    }
+
+    std::vector<Shard> _shards;
+  };
+
+  // Sharded2PSet Definition {{{
+  explicit Sharded2PSet(std::string name,
+                        size_t shards = kDefaultShards,
+                        ThreadPool *pool = &ThreadPool::shared())
+      : _name(std::move(name)), _payload(shards), _pool(pool) {}
+
+  bool contains(const T &value) const { return _payload.contains(value); }
+  void add(const T &value) {
+    _payload.add(value);
+    _generation += 1;
+  }
+  [[nodiscard]] bool remove(const T &value) {
+    const bool removed = _payload.remove(value);
+    _generation += removed ? 1 : 0;
+    return removed;
+  }
+  void merge(const Payload &other) {
+    TRACE_SCOPE("crdt", "Sharded2PSet::merge");
+    MergeRecorder recorder(_metrics, other);
+    _generation += _payload.merge(other, recorder.sink(), *_pool) ? 1 : 0;
+  }
+  // }}}
+
+  const ValueType &query() const {
+    TRACE_SCOPE("crdt", "Sharded2PSet::query");
+    return _query.get(_generation, [&] { return _payload.query(); });
+  }
+
+  const std::string &name() const { return _name; }
+  const Payload &payload() const { return _payload; }
+  uint64_t generation() const { return _generation; }
+  const MergeMetrics &metrics() const { return _metrics; }
+
+  void dump() {
+    printf("Sharded2PSet('%s', ", _name.c_str());
+    ValuePrinter<ValueType> printer;
+    printer.print(query());
+    puts(")");
+  }
+
+ private:
+  std::string _name;
+  Payload _payload;
+  ThreadPool *_pool;
+  uint64_t _generation = 0;
+  QueryCache<ValueType> _query;
+  MergeMetrics _metrics;
+};
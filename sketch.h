@@ -0,0 +1,774 @@
+// Copyright (C) 2020 Felipe O. Carvalho
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cinttypes>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "crdt.h"
+#include "hash.h"
+#include "lib.h"
+#include "memory.h"
+#include "metrics.h"
+#include "trace.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Sketches
+//
+// CRDTs that answer approximately in exchange for a state whose size has an
+// upper bound, however many elements were added. They are state-based CRDTs
+// like the ones in crdt.h and can be used with the same networks.
+
+// Kernels {{{
+
+namespace sketch_detail {
+
+// dst[i] = max(dst[i], src[i]) for n bytes, n a multiple of 16. Returns how
+// many bytes of dst changed.
+inline size_t maxBytes(uint8_t *dst, const uint8_t *src, size_t n) {
+  size_t changed = 0;
+#if defined(__SSE2__)
+  for (size_t i = 0; i < n; i += 16) {
+    const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(dst + i));
+    const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+    const __m128i max = _mm_max_epu8(a, b);
+    const int same = _mm_movemask_epi8(_mm_cmpeq_epi8(max, a));
+    if (same != 0xffff) {
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), max);
+      changed += (size_t)__builtin_popcount(~same & 0xffff);
+    }
+  }
+#else
+  for (size_t i = 0; i < n; i++) {
+    const bool newer = src[i] > dst[i];
+    dst[i] = newer ? src[i] : dst[i];
+    changed += newer ? 1 : 0;
+  }
+#endif
+  return changed;
+}
+
+// total[i] += next[i] - current[i] for n words, n even, with wrap-around
+// arithmetic: adding the difference is correct even when it is "negative".
+inline void addDifference(uint64_t *total,
+                          const uint64_t *next,
+                          const uint64_t *current,
+                          size_t n) {
+#if defined(__SSE2__)
+  for (size_t i = 0; i < n; i += 2) {
+    const __m128i t = _mm_loadu_si128(reinterpret_cast<const __m128i *>(total + i));
+    const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(next + i));
+    const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(current + i));
+    const __m128i sum = _mm_add_epi64(t, _mm_sub_epi64(a, b));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(total + i), sum);
+  }
+#else
+  for (size_t i = 0; i < n; i++) {
+    total[i] += next[i] - current[i];
+  }
+#endif
+}
+
+}  // namespace sketch_detail
+
+// }}}
+
+// HyperLogLog {{{
+
+// Estimates the number of distinct elements added to it, with a standard
+// error of 1.04 / sqrt(2^Precision), in 2^Precision bytes at most.
+//
+// An element is hashed and the first Precision bits of the hash pick one of
+// 2^Precision registers, which keeps the longest run of leading zeros (plus
+// one) seen in the rest of the hashes that picked it. Merging is the
+// register-wise max, so it is idempotent, commutative and associative, and
+// adding the same element twice is a no-op.
+//
+// Small payloads are sparse: only non-zero registers are stored, as sorted
+// (index, rank) pairs. A payload becomes dense, an array of all registers,
+// once the pairs would take as much space.
+template <uint8_t Precision = 14>
+class HyperLogLog {
+  static_assert(Precision >= 4 && Precision <= 18, "Precision must be in [4, 18]");
+
+ public:
+  using ValueType = uint64_t;
+
+  static constexpr size_t kRegisters = size_t{1} << Precision;
+
+  class Payload {
+   public:
+    // Sparse entries are index << 8 | rank.
+    static constexpr size_t kMaxSparseEntries = kRegisters / sizeof(uint32_t);
+
+    bool isDense() const { return !_dense.empty(); }
+
+    // Returns whether a register changed.
+    bool add(uint64_t hash) {
+      const auto index = (uint32_t)(hash >> (64 - Precision));
+      // The sentinel bit caps the rank at 64 - Precision + 1 when the rest
+      // of the hash is all zeros.
+      const uint64_t rest = (hash << Precision) | (uint64_t{1} << (Precision - 1));
+      const auto rank = (uint8_t)(__builtin_clzll(rest) + 1);
+      return updateRegister(index, rank);
+    }
+
+    uint8_t registerAt(uint32_t index) const {
+      if (isDense()) {
+        return _dense[index];
+      }
+      auto it = findSparse(index);
+      return it != _sparse.end() && sparseIndex(*it) == index ? sparseRank(*it) : 0;
+    }
+
+    // Calls f(index, rank) for every non-zero register, by index.
+    template <typename F>
+    void forEachRegister(F &&f) const {
+      if (isDense()) {
+        for (uint32_t i = 0; i < kRegisters; i++) {
+          if (_dense[i] != 0) {
+            f(i, _dense[i]);
+          }
+        }
+      } else {
+        for (uint32_t entry : _sparse) {
+          f(sparseIndex(entry), sparseRank(entry));
+        }
+      }
+    }
+
+    // Ertl's improved raw estimator ("New cardinality estimation algorithms
+    // for HyperLogLog sketches", 2017), computed from the histogram of the
+    // registers. Unlike the original estimator with linear counting for small
+    // cardinalities, it needs no empirical bias correction in between.
+    double estimate() const {
+      constexpr size_t q = 64 - Precision;
+      std::array<size_t, q + 2> histogram{};
+      histogram[0] = kRegisters;
+      forEachRegister([&](uint32_t, uint8_t rank) {
+        histogram[0] -= 1;
+        histogram[rank] += 1;
+      });
+      const double m = (double)kRegisters;
+      double z = m * tau(1 - (double)histogram[q + 1] / m);
+      for (size_t k = q; k >= 1; k--) {
+        z = 0.5 * (z + (double)histogram[k]);
+      }
+      z += m * sigma((double)histogram[0] / m);
+      return 0.5 / std::log(2) * m * m / z;
+    }
+
+    size_t encodedSize() const {
+      return sizeof(uint8_t) +
+             (isDense() ? kRegisters : sizeof(uint32_t) + _sparse.size() * sizeof(uint32_t));
+    }
+
+    MemoryUsage memoryUsage() const {
+      MemoryUsage usage;
+      usage.metadata = sizeof(*this);
+      if (isDense()) {
+        usage.live = kRegisters;
+      } else {
+        usage.live = _sparse.size() * sizeof(uint32_t);
+        usage.metadata += (_sparse.capacity() - _sparse.size()) * sizeof(uint32_t);
+      }
+      return usage;
+    }
+
+    // Register-wise max. Two dense payloads are merged 16 registers at a
+    // time where SSE2 is available.
+    bool merge(const Payload &other, MergeMetrics *metrics = nullptr) {
+      size_t updated = 0;
+      if (other.isDense()) {
+        if (!isDense()) {
+          toDense();
+        }
+        updated = sketch_detail::maxBytes(_dense.data(), other._dense.data(), kRegisters);
+      } else if (isDense()) {
+        for (uint32_t entry : other._sparse) {
+          updated += updateRegister(sparseIndex(entry), sparseRank(entry)) ? 1 : 0;
+        }
+      } else {
+        updated = mergeSparse(other._sparse);
+      }
+      if (metrics) {
+        metrics->entries_examined += other.isDense() ? kRegisters : other._sparse.size();
+        metrics->entries_updated += updated;
+      }
+      return updated > 0;
+    }
+
+    // The registers that are greater than in known, as a sparse payload
+    // unless there are too many.
+    Payload delta(const Payload &known) const {
+      Payload ret;
+      forEachRegister([&](uint32_t index, uint8_t rank) {
+        if (rank > known.registerAt(index)) {
+          ret.updateRegister(index, rank);
+        }
+      });
+      return ret;
+    }
+
+   private:
+    static double sigma(double x) {
+      if (x == 1) {
+        return INFINITY;
+      }
+      double y = 1;
+      double z = x;
+      for (double previous = -1; z != previous; y += y) {
+        x *= x;
+        previous = z;
+        z += x * y;
+      }
+      return z;
+    }
+
+    static double tau(double x) {
+      if (x == 0 || x == 1) {
+        return 0;
+      }
+      double y = 1;
+      double z = 1 - x;
+      for (double previous = -1; z != previous;) {
+        x = std::sqrt(x);
+        previous = z;
+        y *= 0.5;
+        z -= (1 - x) * (1 - x) * y;
+      }
+      return z / 3;
+    }
+
+    static uint32_t sparseEntry(uint32_t index, uint8_t rank) { return index << 8 | rank; }
+    static uint32_t sparseIndex(uint32_t entry) { return entry >> 8; }
+    static uint8_t sparseRank(uint32_t entry) { return (uint8_t)(entry & 0xff); }
+
+    std::vector<uint32_t>::const_iterator findSparse(uint32_t index) const {
+      return std::lower_bound(_sparse.begin(), _sparse.end(), sparseEntry(index, 0));
+    }
+
+    bool updateRegister(uint32_t index, uint8_t rank) {
+      if (isDense()) {
+        if (_dense[index] >= rank) {
+          return false;
+        }
+        _dense[index] = rank;
+        return true;
+      }
+      auto it = _sparse.begin() + (findSparse(index) - _sparse.cbegin());
+      if (it != _sparse.end() && sparseIndex(*it) == index) {
+        if (sparseRank(*it) >= rank) {
+          return false;
+        }
+        *it = sparseEntry(index, rank);
+        return true;
+      }
+      _sparse.insert(it, sparseEntry(index, rank));
+      if (_sparse.size() > kMaxSparseEntries) {
+        toDense();
+      }
+      return true;
+    }
+
+    // Merges two sorted lists of entries. Returns how many registers changed.
+    // Redundant merges are detected before allocating anything.
+    size_t mergeSparse(const std::vector<uint32_t> &other) {
+      if (!anyGreater(other)) {
+        return 0;
+      }
+      std::vector<uint32_t> merged;
+      merged.reserve(_sparse.size() + other.size());
+      size_t updated = 0;
+      auto a = _sparse.begin();
+      auto b = other.begin();
+      while (a != _sparse.end() || b != other.end()) {
+        if (b == other.end() || (a != _sparse.end() && sparseIndex(*a) < sparseIndex(*b))) {
+          merged.push_back(*a++);
+        } else if (a == _sparse.end() || sparseIndex(*b) < sparseIndex(*a)) {
+          merged.push_back(*b++);
+          updated += 1;
+        } else {
+          updated += *b > *a ? 1 : 0;
+          merged.push_back(std::max(*a++, *b++));
+        }
+      }
+      if (updated > 0) {
+        _sparse = std::move(merged);
+        if (_sparse.size() > kMaxSparseEntries) {
+          toDense();
+        }
+      }
+      return updated;
+    }
+
+    bool anyGreater(const std::vector<uint32_t> &other) const {
+      auto a = _sparse.begin();
+      for (uint32_t entry : other) {
+        while (a != _sparse.end() && sparseIndex(*a) < sparseIndex(entry)) {
+          ++a;
+        }
+        if (a == _sparse.end() || sparseIndex(*a) != sparseIndex(entry) || *a < entry) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    void toDense() {
+      _dense.assign(kRegisters, 0);
+      for (uint32_t entry : _sparse) {
+        _dense[sparseIndex(entry)] = sparseRank(entry);
+      }
+      _sparse.clear();
+      _sparse.shrink_to_fit();
+    }
+
+    std::vector<uint32_t> _sparse;  // sorted, while not dense
+    std::vector<uint8_t> _dense;    // kRegisters registers, or empty while sparse
+  };
+
+  // HyperLogLog definition {{{
+  explicit HyperLogLog(std::string name) : _name(std::move(name)) {}
+
+  template <typename T>
+  void add(const T &value) {
+    _generation += _payload.add(hashing::hash(value)) ? 1 : 0;
+  }
+
+  uint64_t query() const {
+    TRACE_SCOPE("crdt", "HyperLogLog::query");
+    return _query.get(_generation, [&] { return (uint64_t)std::llround(_payload.estimate()); });
+  }
+
+  void merge(const Payload &other) {
+    TRACE_SCOPE("crdt", "HyperLogLog::merge");
+    MergeRecorder recorder(_metrics, other);
+    _generation += _payload.merge(other, recorder.sink()) ? 1 : 0;
+  }
+  // }}}
+
+  const std::string &name() const { return _name; }
+  const Payload &payload() const { return _payload; }
+  uint64_t generation() const { return _generation; }
+  const MergeMetrics &metrics() const { return _metrics; }
+  void dump() { printf("HyperLogLog('%s', ~%" PRIu64 ")\n", _name.c_str(), query()); }
+
+ private:
+  std::string _name;
+  Payload _payload;
+  uint64_t _generation = 0;
+  QueryCache<ValueType> _query;
+  MergeMetrics _metrics;
+};
+
+// }}}
+
+// Count-Min Sketch {{{
+
+// Estimates how many times every key was added, in Depth * Width counters
+// per replica no matter how many keys there are. An estimate is never lower
+// than the real count and, with probability 1 - e^-Depth, exceeds it by at
+// most e / Width of the total count.
+//
+// Every key is hashed into one counter per row, and its estimate is the
+// smallest of them. Adding the counters of two sketches cell by cell is not
+// idempotent, so the payload is a GCounter of sketches instead: every
+// replica only adds to a sketch of its own, versioned by how many times it
+// added, and the estimates use the sum of all of them. A replica's sketch
+// only grows, so the one with the highest version contains all the others
+// and merging takes the newest sketch of every replica.
+template <typename T = std::string, size_t Depth = 4, size_t Width = 1024>
+class CountMinSketch {
+  static_assert(Depth > 0, "Depth must be positive");
+  static_assert(Width >= 2 && (Width & (Width - 1)) == 0, "Width must be a power of two");
+
+ public:
+  // The total count of all keys.
+  using ValueType = uint64_t;
+
+  static constexpr size_t kCells = Depth * Width;
+
+  class Payload {
+   public:
+    // Returns the counter of every row key is hashed into.
+    static std::array<size_t, Depth> cellsFor(const T &key) {
+      // Rows use h1 + i * h2 from a single 64-bit hash (Kirsch and
+      // Mitzenmacher), h2 odd so that it never repeats a column.
+      const uint64_t h = hashing::hash(key);
+      const auto h1 = (uint32_t)h;
+      const auto h2 = (uint32_t)(h >> 32) | 1;
+      std::array<size_t, Depth> cells;
+      for (size_t i = 0; i < Depth; i++) {
+        cells[i] = i * Width + ((h1 + i * h2) & (Width - 1));
+      }
+      return cells;
+    }
+
+    void add(const T &key, uint64_t count, const std::string &replica_name) {
+      std::vector<uint64_t> &sketch = _sketches[replica_name];
+      if (sketch.empty()) {
+        sketch.resize(kCells);
+      }
+      if (_total.empty()) {
+        _total.resize(kCells);
+      }
+      for (size_t cell : cellsFor(key)) {
+        sketch[cell] += count;
+        _total[cell] += count;
+      }
+      _versions.increment(replica_name, count);
+    }
+
+    uint64_t estimate(const T &key) const {
+      if (_total.empty()) {
+        return 0;
+      }
+      uint64_t estimate = UINT64_MAX;
+      for (size_t cell : cellsFor(key)) {
+        estimate = std::min(estimate, _total[cell]);
+      }
+      return estimate;
+    }
+
+    uint64_t totalCount() const { return _versions.max(); }
+
+    size_t encodedSize() const {
+      return _versions.encodedSize() + _sketches.size() * kCells * sizeof(uint64_t);
+    }
+
+    // The sketches of the replicas are live data. Their sum, kept for
+    // estimates, is metadata like the versions and the hash table.
+    MemoryUsage memoryUsage() const {
+      MemoryUsage usage = _versions.memoryUsage();
+      usage.metadata += sizeof(*this) - sizeof(VersionVec) + hashTableOverhead(_sketches);
+      usage.metadata += _total.size() * sizeof(uint64_t);
+      for (auto & [ replica_name, sketch ] : _sketches) {
+        usage.metadata += sizeof(std::string) + heapBytes(replica_name);
+        usage.live += sketch.size() * sizeof(uint64_t);
+      }
+      return usage;
+    }
+
+    // Takes the sketches of other that are newer and updates the sum by the
+    // difference, two counters at a time where SSE2 is available.
+    bool merge(const Payload &other, MergeMetrics *metrics = nullptr) {
+      if (other._sketches.empty() || other._versions.digest() == _versions.digest()) {
+        return false;
+      }
+      size_t updated = 0;
+      for (auto & [ replica_name, other_sketch ] : other._sketches) {
+        const uint64_t other_version = other._versions.localVersionForReplica(replica_name);
+        if (other_version <= _versions.localVersionForReplica(replica_name)) {
+          continue;
+        }
+        auto[it, inserted] = _sketches.try_emplace(replica_name);
+        std::vector<uint64_t> &sketch = it->second;
+        if (inserted) {
+          sketch.resize(kCells);
+        }
+        if (_total.empty()) {
+          _total.resize(kCells);
+        }
+        sketch_detail::addDifference(_total.data(), other_sketch.data(), sketch.data(), kCells);
+        memcpy(sketch.data(), other_sketch.data(), kCells * sizeof(uint64_t));
+        _versions.mergeVersionForReplica(replica_name, other_version);
+        updated += 1;
+        if (metrics) {
+          metrics->allocations += inserted ? 1 : 0;
+        }
+      }
+      if (metrics) {
+        metrics->entries_examined += other._sketches.size();
+        metrics->entries_updated += updated;
+      }
+      return updated > 0;
+    }
+
+    uint64_t digest() const { return _versions.digest(); }
+
+    // The sketches that are newer than in known.
+    Payload delta(const Payload &known) const {
+      Payload ret;
+      for (auto & [ replica_name, sketch ] : _sketches) {
+        const uint64_t version = _versions.localVersionForReplica(replica_name);
+        if (version > known._versions.localVersionForReplica(replica_name)) {
+          ret._sketches.emplace(replica_name, sketch);
+          ret._versions.increment(replica_name, version);
+        }
+      }
+      return ret;
+    }
+
+   private:
+    VersionVec _versions;  // how many times every replica added
+    std::unordered_map<std::string, std::vector<uint64_t>> _sketches;  // kCells per replica
+    std::vector<uint64_t> _total;  // sum of _sketches, empty until something is added
+  };
+
+  // CountMinSketch definition {{{
+  explicit CountMinSketch(std::string name) : _name(std::move(name)) {}
+
+  // Adds count occurrences of key.
+  void add(const T &key, uint64_t count = 1) {
+    if (count > 0) {
+      _payload.add(key, count, _name);
+      _generation += 1;
+    }
+  }
+
+  uint64_t estimate(const T &key) const {
+    TRACE_SCOPE("crdt", "CountMinSketch::estimate");
+    return _payload.estimate(key);
+  }
+
+  uint64_t query() const {
+    TRACE_SCOPE("crdt", "CountMinSketch::query");
+    return _payload.totalCount();
+  }
+
+  void merge(const Payload &other) {
+    TRACE_SCOPE("crdt", "CountMinSketch::merge");
+    MergeRecorder recorder(_metrics, other);
+    _generation += _payload.merge(other, recorder.sink()) ? 1 : 0;
+  }
+  // }}}
+
+  const std::string &name() const { return _name; }
+  const Payload &payload() const { return _payload; }
+  uint64_t generation() const { return _generation; }
+  const MergeMetrics &metrics() const { return _metrics; }
+  void dump() { printf("CountMinSketch('%s', total=%" PRIu64 ")\n", _name.c_str(), query()); }
+
+ private:
+  std::string _name;
+  Payload _payload;
+  uint64_t _generation = 0;
+  MergeMetrics _metrics;
+};
+
+// }}}
+
+// Top-K {{{
+
+// The K most frequent items and their counts, estimated from Space-Saving
+// summaries of Capacity counters, so memory doesn't grow with the number of
+// distinct items. Estimated counts are off by at most N / Capacity, N being
+// the total count of all items.
+//
+// Like CountMinSketch, the payload is a GCounter of summaries: every
+// replica counts into a summary of its own, versioned by its total count,
+// and merges keep the newest summary of every replica. That makes merges
+// idempotent and commutative, which merging Space-Saving summaries into
+// each other is not. The estimate of an item is the sum of its counts in
+// all summaries and the top K is ordered by estimate, then by item, so all
+// replicas with the same summaries agree on it.
+template <typename T = std::string, size_t K = 10, size_t Capacity = 4 * K>
+class TopK {
+  static_assert(K > 0 && Capacity >= K, "Capacity must be at least K");
+
+ public:
+  using Entry = std::pair<T, uint64_t>;
+  // By estimated count, the highest first.
+  using ValueType = std::vector<Entry>;
+
+  // A Space-Saving counter. count can exceed the occurrences of item seen
+  // by its summary, by at most the count of the counter item took over.
+  struct Counter {
+    T item;
+    uint64_t count;
+  };
+
+  class Payload {
+   public:
+    // When the summary of the replica is full, the item takes over the
+    // counter with the smallest count, the smallest item among ties, so
+    // summaries are a function of the updates. O(Capacity).
+    void add(const T &item, uint64_t count, const std::string &replica_name) {
+      _versions.increment(replica_name, count);
+      std::vector<Counter> &summary = _summaries[replica_name];
+      for (Counter &counter : summary) {
+        if (counter.item == item) {
+          counter.count += count;
+          return;
+        }
+      }
+      if (summary.size() < Capacity) {
+        summary.reserve(Capacity);
+        summary.push_back({item, count});
+        return;
+      }
+      Counter &min = *std::min_element(
+          summary.begin(), summary.end(), [](const Counter &a, const Counter &b) {
+            return a.count != b.count ? a.count < b.count : a.item < b.item;
+          });
+      min = {item, min.count + count};
+    }
+
+    uint64_t estimate(const T &item) const {
+      uint64_t estimate = 0;
+      for (auto & [ _, summary ] : _summaries) {
+        for (const Counter &counter : summary) {
+          if (counter.item == item) {
+            estimate += counter.count;
+            break;
+          }
+        }
+      }
+      return estimate;
+    }
+
+    ValueType top() const {
+      std::unordered_map<T, uint64_t> estimates;
+      for (auto & [ _, summary ] : _summaries) {
+        for (const Counter &counter : summary) {
+          estimates[counter.item] += counter.count;
+        }
+      }
+      ValueType ret(estimates.begin(), estimates.end());
+      auto by_estimate = [](const Entry &a, const Entry &b) {
+        return a.second != b.second ? a.second > b.second : a.first < b.first;
+      };
+      if (ret.size() > K) {
+        std::partial_sort(ret.begin(), ret.begin() + K, ret.end(), by_estimate);
+        ret.resize(K);
+      } else {
+        std::sort(ret.begin(), ret.end(), by_estimate);
+      }
+      return ret;
+    }
+
+    uint64_t totalCount() const { return _versions.max(); }
+
+    size_t encodedSize() const {
+      size_t size = _versions.encodedSize();
+      for (auto & [ _, summary ] : _summaries) {
+        size += sizeof(uint32_t);
+        for (const Counter &counter : summary) {
+          size += ::encodedSize(counter.item) + sizeof(uint64_t);
+        }
+      }
+      return size;
+    }
+
+    MemoryUsage memoryUsage() const {
+      MemoryUsage usage = _versions.memoryUsage();
+      usage.metadata += sizeof(*this) - sizeof(VersionVec) + hashTableOverhead(_summaries);
+      for (auto & [ replica_name, summary ] : _summaries) {
+        usage.metadata += sizeof(std::string) + heapBytes(replica_name);
+        usage.metadata += (summary.capacity() - summary.size()) * sizeof(Counter);
+        for (const Counter &counter : summary) {
+          usage.live += sizeof(Counter) + heapBytes(counter.item);
+        }
+      }
+      return usage;
+    }
+
+    // Takes the summaries of other that are newer.
+    bool merge(const Payload &other, MergeMetrics *metrics = nullptr) {
+      if (other._summaries.empty() || other._versions.digest() == _versions.digest()) {
+        return false;
+      }
+      size_t updated = 0;
+      for (auto & [ replica_name, other_summary ] : other._summaries) {
+        const uint64_t other_version = other._versions.localVersionForReplica(replica_name);
+        if (other_version <= _versions.localVersionForReplica(replica_name)) {
+          continue;
+        }
+        auto[it, inserted] = _summaries.try_emplace(replica_name);
+        it->second = other_summary;
+        _versions.mergeVersionForReplica(replica_name, other_version);
+        updated += 1;
+        if (metrics) {
+          metrics->allocations += inserted ? 2 : 0;
+        }
+      }
+      if (metrics) {
+        metrics->entries_examined += other._summaries.size();
+        metrics->entries_updated += updated;
+      }
+      return updated > 0;
+    }
+
+    uint64_t digest() const { return _versions.digest(); }
+
+    // The summaries that are newer than in known.
+    Payload delta(const Payload &known) const {
+      Payload ret;
+      for (auto & [ replica_name, summary ] : _summaries) {
+        const uint64_t version = _versions.localVersionForReplica(replica_name);
+        if (version > known._versions.localVersionForReplica(replica_name)) {
+          ret._summaries.emplace(replica_name, summary);
+          ret._versions.increment(replica_name, version);
+        }
+      }
+      return ret;
+    }
+
+   private:
+    VersionVec _versions;  // total count of every replica
+    std::unordered_map<std::string, std::vector<Counter>> _summaries;  // by replica
+  };
+
+  // TopK definition {{{
+  explicit TopK(std::string name) : _name(std::move(name)) {}
+
+  // Adds count occurrences of item.
+  void add(const T &item, uint64_t count = 1) {
+    if (count > 0) {
+      _payload.add(item, count, _name);
+      _generation += 1;
+    }
+  }
+
+  uint64_t estimate(const T &item) const { return _payload.estimate(item); }
+
+  const ValueType &query() const {
+    TRACE_SCOPE("crdt", "TopK::query");
+    return _query.get(_generation, [&] { return _payload.top(); });
+  }
+
+  void merge(const Payload &other) {
+    TRACE_SCOPE("crdt", "TopK::merge");
+    MergeRecorder recorder(_metrics, other);
+    _generation += _payload.merge(other, recorder.sink()) ? 1 : 0;
+  }
+  // }}}
+
+  const std::string &name() const { return _name; }
+  const Payload &payload() const { return _payload; }
+  uint64_t generation() const { return _generation; }
+  const MergeMetrics &metrics() const { return _metrics; }
+
+  void dump() {
+    printf("TopK('%s', [", _name.c_str());
+    ValuePrinter<T> printer;
+    bool first = true;
+    for (auto & [ item, count ] : query()) {
+      printf(first ? "" : ", ");
+      first = false;
+      printer.print(item);
+      printf(": %" PRIu64, count);
+    }
+    puts("])");
+  }
+
+ private:
+  std::string _name;
+  Payload _payload;
+  uint64_t _generation = 0;
+  QueryCache<ValueType> _query;
+  MergeMetrics _metrics;
+};
+
+// }}}
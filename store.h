@@ -0,0 +1,213 @@
+// Copyright (C) 2020 Felipe O. Carvalho
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "crdt.h"
+#include "traits.h"
+
+// Keyspaces
+//
+// A ReplicaStore is one replica of many CRDT objects of the same type keyed
+// by ID, e.g. a counter per page or a register per user. Every object uses
+// the name of the store as its replica name.
+//
+// Syncing object by object costs a message per object and ships objects that
+// didn't change. Instead, the store remembers when it last built a batch for
+// every peer, and syncBatch(peer) multiplexes the payloads of the objects
+// that changed since then into a single message. Changes are detected with
+// CRDT::generation(), so local mutations go through update().
+//
+// Objects are kept in the order of their last change, so building a batch
+// costs O(dirty objects) no matter how large the keyspace is.
+//
+// An object that a merge left equal to the payload the peer sent isn't sent
+// back to that peer: it has nothing the peer lacks. Equality is detected
+// with Payload::digest() (see traits.h), so CRDTs without digests are
+// always sent back.
+
+template <typename CRDT, typename Key = std::string>
+class ReplicaStore {
+ public:
+  using Payload = typename CRDT::Payload;
+
+  // A multiplexed sync message: the payloads of the objects that changed
+  // since the previous batch for the same peer.
+  struct SyncBatch {
+    std::vector<std::pair<Key, Payload>> objects;
+
+    bool empty() const { return objects.empty(); }
+    size_t size() const { return objects.size(); }
+
+    size_t encodedSize() const {
+      size_t size = sizeof(uint32_t);
+      for (auto & [ key, payload ] : objects) {
+        size += ::encodedSize(key) + payload.encodedSize();
+      }
+      return size;
+    }
+  };
+
+  explicit ReplicaStore(std::string name) : _name(std::move(name)) {}
+
+  ReplicaStore(const ReplicaStore &) = delete;
+  ReplicaStore &operator=(const ReplicaStore &) = delete;
+  ReplicaStore(ReplicaStore &&) = default;
+  ReplicaStore &operator=(ReplicaStore &&) = default;
+
+  // Runs f(crdt) on the object with the given key, creating it if needed.
+  template <typename F>
+  void update(const Key &key, F &&f) {
+    Object &object = findOrCreate(key);
+    const uint64_t generation = object.crdt.generation();
+    f(object.crdt);
+    touchIfChanged(object, generation);
+  }
+
+  const CRDT *find(const Key &key) const {
+    const Object *object = lookup(_objects, key);
+    return object ? &object->crdt : nullptr;
+  }
+
+  template <typename F>
+  void forEach(F &&f) const {
+    for (auto & [ key, object ] : _objects) {
+      f(key, object.crdt);
+    }
+  }
+
+  // Objects that syncBatch(peer) would send.
+  size_t dirtyCount(const std::string &peer) const {
+    auto peer_it = _sent.find(peer);
+    const uint64_t sent = peer_it != _sent.end() ? peer_it->second : 0;
+    const std::string *peer_name = peer_it != _sent.end() ? &peer_it->first : nullptr;
+    size_t dirty = 0;
+    for (auto it = _changes.rbegin(); it != _changes.rend() && (*it)->changed_at > sent; ++it) {
+      dirty += peer_name && (*it)->same_as_peer == peer_name ? 0 : 1;
+    }
+    return dirty;
+  }
+
+  // Builds the batch for peer and considers it sent.
+  SyncBatch syncBatch(const std::string &peer) {
+    TRACE_SCOPE("store", "ReplicaStore::syncBatch");
+    auto & [ peer_name, sent ] = *_sent.try_emplace(peer, 0).first;
+    SyncBatch batch;
+    for (auto it = _changes.rbegin(); it != _changes.rend() && (*it)->changed_at > sent; ++it) {
+      if ((*it)->same_as_peer != &peer_name) {
+        batch.objects.emplace_back(*(*it)->key, (*it)->crdt.payload());
+      }
+    }
+    sent = _clock;
+    return batch;
+  }
+
+  // Merges a batch that peer sent. Objects changed by the merge become
+  // dirty for every peer, and for peer as well unless they are now equal to
+  // what it sent.
+  void merge(const std::string &peer, const SyncBatch &batch) {
+    TRACE_SCOPE("store", "ReplicaStore::merge");
+    const std::string *peer_name = &_sent.try_emplace(peer, 0).first->first;
+    for (auto & [ key, payload ] : batch.objects) {
+      Object *object = lookup(_objects, key);
+      uint64_t generation;
+      if (object) {
+        generation = object->crdt.generation();
+        object->crdt.merge(payload);
+      } else {
+        // Unknown keys are only added when the payload changes a new object.
+        CRDT crdt(_name);
+        generation = crdt.generation();
+        crdt.merge(payload);
+        if (crdt.generation() == generation) {
+          continue;
+        }
+        object = &findOrInsert(key, std::move(crdt));
+      }
+      if (touchIfChanged(*object, generation)) {
+        if constexpr (CRDTTraits<CRDT>::has_digest) {
+          if (object->crdt.payload().digest() == payload.digest()) {
+            object->same_as_peer = peer_name;
+          }
+        }
+      }
+    }
+  }
+
+  const std::string &name() const { return _name; }
+  size_t size() const { return _objects.size(); }
+
+  MergeMetrics metrics() const {
+    MergeMetrics metrics;
+    for (auto & [ _, object ] : _objects) {
+      metrics += object.crdt.metrics();
+    }
+    return metrics;
+  }
+
+  MemoryUsage memoryUsage() const {
+    MemoryUsage usage;
+    // Every object is a hash table node and a node of the change list.
+    usage.metadata = sizeof(*this) + hashTableOverhead(_objects) +
+                     _objects.size() * (sizeof(Object) + 3 * sizeof(void *));
+    for (auto & [ key, object ] : _objects) {
+      usage.metadata += sizeof(Key) + heapBytes(key);
+      usage += object.crdt.payload().memoryUsage();
+    }
+    return usage;
+  }
+
+ private:
+  struct Object {
+    explicit Object(const std::string &replica_name) : crdt(replica_name) {}
+    explicit Object(CRDT &&crdt) : crdt(std::move(crdt)) {}
+
+    CRDT crdt;
+    const Key *key = nullptr;
+    uint64_t changed_at = 0;  // value of _clock after the last change
+    // Key in _sent of the peer whose payload the last change made this
+    // object equal to, if any.
+    const std::string *same_as_peer = nullptr;
+    typename std::list<Object *>::iterator position;
+  };
+
+  Object &findOrCreate(const Key &key) { return findOrInsert(key, _name); }
+
+  // Constructs the object from arg, the replica name or a CRDT, if the key
+  // is new.
+  template <typename Arg>
+  Object &findOrInsert(const Key &key, Arg &&arg) {
+    auto[it, inserted] = _objects.try_emplace(key, std::forward<Arg>(arg));
+    Object &object = it->second;
+    if (inserted) {
+      object.key = &it->first;
+      // Never changed, so it goes before every changed object.
+      object.position = _changes.insert(_changes.begin(), &object);
+    }
+    return object;
+  }
+
+  // Returns whether the object changed.
+  bool touchIfChanged(Object &object, uint64_t generation) {
+    if (object.crdt.generation() == generation) {
+      return false;
+    }
+    _clock += 1;
+    object.changed_at = _clock;
+    object.same_as_peer = nullptr;
+    _changes.splice(_changes.end(), _changes, object.position);
+    return true;
+  }
+
+  std::string _name;
+  std::unordered_map<Key, Object> _objects;
+  std::list<Object *> _changes;  // by changed_at, the most recent last
+  // peer -> _clock at the last batch. Node-based, so Object::same_as_peer
+  // can point to the keys.
+  std::unordered_map<std::string, uint64_t> _sent;
+  uint64_t _clock = 0;
+};
@@ -0,0 +1,126 @@
+// Copyright (C) 2020 Felipe O. Carvalho
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// A fixed set of worker threads that run parallel loops.
+//
+//   ThreadPool::shared().parallelFor(shards, [&](size_t i) { mergeShard(i); });
+//
+// The calling thread takes part in the loop, so a pool with no workers runs
+// loops inline. Loops from different threads are serialized, and a task must
+// not start a loop on the pool that runs it.
+class ThreadPool {
+ public:
+  // Threads that run loops, including the caller.
+  explicit ThreadPool(size_t threads = std::max(1u, std::thread::hardware_concurrency())) {
+    for (size_t i = 1; i < threads; i++) {
+      _workers.emplace_back([this] { workerLoop(); });
+    }
+  }
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _stop = true;
+    }
+    _wake.notify_all();
+    for (auto &worker : _workers) {
+      worker.join();
+    }
+  }
+
+  static ThreadPool &shared() {
+    static ThreadPool pool;
+    return pool;
+  }
+
+  size_t size() const { return _workers.size() + 1; }
+
+  // Runs f(i) for every i in [0, n) and returns when all calls returned.
+  template <typename F>
+  void parallelFor(size_t n, F &&f) {
+    if (n <= 1 || _workers.empty()) {
+      for (size_t i = 0; i < n; i++) {
+        f(i);
+      }
+      return;
+    }
+    using Fn = std::remove_reference_t<F>;
+    std::lock_guard<std::mutex> submit_lock(_submit_mutex);
+    Loop loop(n,
+              [](void *f, size_t i) { (*static_cast<Fn *>(f))(i); },
+              const_cast<void *>(static_cast<const void *>(&f)));
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _loop = &loop;
+      _generation += 1;
+    }
+    _wake.notify_all();
+    loop.run();
+    std::unique_lock<std::mutex> lock(_mutex);
+    _done.wait(lock, [&] { return loop.completed.load() == n && _active == 0; });
+    _loop = nullptr;
+  }
+
+ private:
+  struct Loop {
+    const size_t n;
+    void (*const call)(void *, size_t);
+    void *const f;
+    std::atomic<size_t> next{0};
+    std::atomic<size_t> completed{0};
+
+    Loop(size_t n_, void (*call_)(void *, size_t), void *f_) : n(n_), call(call_), f(f_) {}
+
+    void run() {
+      for (size_t i = next++; i < n; i = next++) {
+        call(f, i);
+        completed += 1;
+      }
+    }
+  };
+
+  void workerLoop() {
+    uint64_t seen = 0;
+    std::unique_lock<std::mutex> lock(_mutex);
+    for (;;) {
+      _wake.wait(lock, [&] { return _stop || _generation != seen; });
+      if (_stop) {
+        return;
+      }
+      seen = _generation;
+      Loop *loop = _loop;
+      if (!loop) {
+        continue;  // woke up after the loop finished
+      }
+      _active += 1;
+      lock.unlock();
+      loop->run();
+      lock.lock();
+      _active -= 1;
+      _done.notify_all();
+    }
+  }
+
+  std::vector<std::thread> _workers;
+  std::mutex _submit_mutex;
+  std::mutex _mutex;  // guards the members below
+  std::condition_variable _wake;
+  std::condition_variable _done;
+  Loop *_loop = nullptr;
+  uint64_t _generation = 0;
+  size_t _active = 0;
+  bool _stop = false;
+};
@@ -0,0 +1,171 @@
+// Copyright (C) 2020 Felipe O. Carvalho
+#pragma once
+
+#include <chrono>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Scoped trace events exportable in the Chrome trace-event format, which can
+// be opened in chrome://tracing or https://ui.perfetto.dev.
+//
+//   TRACE_SCOPE("network", "broadcastAll");
+//
+// records a complete event spanning the rest of the enclosing scope. Events
+// go to a per-thread ring buffer (the oldest events are overwritten when it
+// fills up), so recording takes no locks. Recording only happens while
+// tracingEnabled() is set; define CRDT_DISABLE_TRACING to compile the
+// trace points out entirely.
+
+inline bool &tracingEnabled() {
+  static bool enabled = false;
+  return enabled;
+}
+
+struct TraceEvent {
+  const char *category;  // string literals only: they are kept by pointer
+  const char *name;
+  uint64_t start_ns;
+  uint64_t duration_ns;
+};
+
+class TraceBuffer {
+ public:
+  static constexpr size_t kCapacity = 1 << 16;  // events per thread
+
+  explicit TraceBuffer(uint32_t tid) : _tid(tid), _events(kCapacity) {}
+
+  void record(const TraceEvent &event) {
+    _events[_next & (kCapacity - 1)] = event;
+    _next += 1;
+  }
+
+  template <typename F>
+  void forEach(F &&f) const {
+    const uint64_t first = _next > kCapacity ? _next - kCapacity : 0;
+    for (uint64_t i = first; i < _next; i++) {
+      f(_events[i & (kCapacity - 1)]);
+    }
+  }
+
+  void clear() { _next = 0; }
+  uint32_t tid() const { return _tid; }
+
+ private:
+  const uint32_t _tid;
+  std::vector<TraceEvent> _events;
+  uint64_t _next = 0;
+};
+
+class Tracer {
+ public:
+  static Tracer &instance() {
+    static Tracer tracer;
+    return tracer;
+  }
+
+  uint64_t now() const {
+    const auto elapsed = std::chrono::steady_clock::now() - _epoch;
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+  }
+
+  // The calling thread's buffer. Buffers are owned by the tracer, so events
+  // recorded by threads that already exited can still be exported.
+  TraceBuffer &threadBuffer() {
+    static thread_local TraceBuffer *buffer = nullptr;
+    if (!buffer) {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _buffers.push_back(std::make_unique<TraceBuffer>((uint32_t)_buffers.size()));
+      buffer = _buffers.back().get();
+    }
+    return *buffer;
+  }
+
+  // Must not race with threads that are recording events.
+  void clear() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (auto &buffer : _buffers) {
+      buffer->clear();
+    }
+  }
+
+  // Must not race with threads that are recording events.
+  void writeChromeTrace(FILE *out) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    fputs("{\"traceEvents\": [\n", out);
+    bool first = true;
+    for (auto &buffer : _buffers) {
+      buffer->forEach([&](const TraceEvent &event) {
+        fprintf(out,
+                "%s{\"cat\": \"%s\", \"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, "
+                "\"tid\": %" PRIu32 ", \"ts\": %.3f, \"dur\": %.3f}",
+                first ? "" : ",\n",
+                event.category,
+                event.name,
+                buffer->tid(),
+                (double)event.start_ns / 1e3,
+                (double)event.duration_ns / 1e3);
+        first = false;
+      });
+    }
+    fputs("\n], \"displayTimeUnit\": \"ns\"}\n", out);
+  }
+
+  bool writeChromeTrace(const char *path) {
+    FILE *out = fopen(path, "w");
+    if (!out) {
+      return false;
+    }
+    writeChromeTrace(out);
+    return fclose(out) == 0;
+  }
+
+ private:
+  Tracer() : _epoch(std::chrono::steady_clock::now()) {}
+
+  const std::chrono::steady_clock::time_point _epoch;
+  std::mutex _mutex;
+  std::vector<std::unique_ptr<TraceBuffer>> _buffers;
+};
+
+class TraceScope {
+ public:
+  TraceScope(const char *category, const char *name) {
+    if (tracingEnabled()) {
+      _event.category = category;
+      _event.name = name;
+      _event.start_ns = Tracer::instance().now();
+      _recording = true;
+    }
+  }
+
+  ~TraceScope() {
+    if (_recording) {
+      auto &tracer = Tracer::instance();
+      _event.duration_ns = tracer.now() - _event.start_ns;
+      tracer.threadBuffer().record(_event);
+    }
+  }
+
+  TraceScope(const TraceScope &) = delete;
+  TraceScope &operator=(const TraceScope &) = delete;
+
+ private:
+  TraceEvent _event{};
+  bool _recording = false;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+#ifdef CRDT_DISABLE_TRACING
+#define TRACE_SCOPE(category, name) \
+  do {                              \
+  } while (0)
+#else
+#define TRACE_SCOPE(category, name) \
+  TraceScope TRACE_CONCAT(_trace_scope_, __LINE__)(category, name)
+#endif
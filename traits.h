@@ -0,0 +1,84 @@
+// Copyright (C) 2020 Felipe O. Carvalho
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// CRDT traits
+//
+// merge(payload()) is all networks need from a CRDT for replicas to converge,
+// but shipping the whole state on every sync is the most expensive way to
+// get there. CRDTTraits<CRDT> tells, at compile time, what else a CRDT
+// supports:
+//
+// - has_digest: Payload::digest() is a cheap hash of the state. Equal
+//   digests mean equal states, so a replica that remembers what it sent to a
+//   peer doesn't send an unchanged state again.
+// - has_delta: Payload::delta(known) is the part of the payload that known
+//   is missing. Merging it into known is the same as merging the payload.
+// - has_batch_merge: CRDT::mergeBatch(payloads) merges many payloads at
+//   once, with the same result as merging them one by one.
+// - is_trivially_serializable: the payload is trivially copyable, so it goes
+//   on the wire as sizeof(Payload) bytes without encoding.
+//
+// Networks pick the cheapest sync strategy of their CRDT with if constexpr,
+// so there is no branching at runtime for capabilities a CRDT doesn't have.
+// The traits are detected from the CRDT and its payload. Specialize
+// CRDTTraits to override them, as FullStateReplica does.
+
+namespace traits_detail {
+
+#define TRAITS_DETECT(trait, expr)                                           \
+  template <typename T, typename = void>                                     \
+  struct trait : std::false_type {};                                         \
+  template <typename T>                                                      \
+  struct trait<T, std::void_t<decltype(expr)>> : std::true_type {}
+
+TRAITS_DETECT(has_digest, uint64_t{std::declval<const T &>().digest()});
+TRAITS_DETECT(has_delta,
+              std::declval<T &>() = std::declval<const T &>().delta(std::declval<const T &>()));
+TRAITS_DETECT(has_batch_merge,
+              std::declval<T &>().mergeBatch(
+                  std::declval<const std::vector<const typename T::Payload *> &>()));
+
+#undef TRAITS_DETECT
+
+}  // namespace traits_detail
+
+template <typename CRDT>
+struct CRDTTraits {
+  using Payload = typename CRDT::Payload;
+
+  static constexpr bool has_digest = traits_detail::has_digest<Payload>::value;
+  static constexpr bool has_delta = traits_detail::has_delta<Payload>::value;
+  static constexpr bool has_batch_merge = traits_detail::has_batch_merge<CRDT>::value;
+  static constexpr bool is_trivially_serializable = std::is_trivially_copyable_v<Payload>;
+};
+
+// Bytes a payload takes on the wire.
+template <typename CRDT>
+size_t wireSize(const typename CRDT::Payload &payload) {
+  if constexpr (CRDTTraits<CRDT>::is_trivially_serializable) {
+    return sizeof(payload);
+  } else {
+    return payload.encodedSize();
+  }
+}
+
+// A CRDT that networks sync by shipping the full state every time, whatever
+// it supports. Meant for measuring what the other strategies save.
+template <typename CRDT>
+class FullStateReplica : public CRDT {
+ public:
+  using CRDT::CRDT;
+};
+
+template <typename CRDT>
+struct CRDTTraits<FullStateReplica<CRDT>> : CRDTTraits<CRDT> {
+  static constexpr bool has_digest = false;
+  static constexpr bool has_delta = false;
+  static constexpr bool has_batch_merge = false;
+};
@@ -0,0 +1,557 @@
+// Copyright (C) 2020 Felipe O. Carvalho
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <optional>
+#include <random>
+#include <string>
+#include <type_traits>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include "lib.h"
+
+// Deterministic workloads
+//
+// A workload is the sequence of operations a simulation applies to its
+// replicas and to the network connecting them. WorkloadRunner applies
+// operations to N replicas of any CRDT type on any network and, given a
+// WorkloadRecorder, logs them into a compact binary trace. A trace can then
+// be decoded and replayed against other CRDT implementations or topologies.
+//
+// Operations a CRDT or network doesn't support (e.g. add() on a counter or
+// syncWithServer() on a P2P network) are skipped and counted.
+//
+// Trace format: the magic "CRDTWL1\n", the number of replicas (varint) and
+// then one record per operation: the op code (1 byte), the replica index
+// (varint) and op-specific fields -- a zigzag varint delta for increments and
+// a varint count followed by length-prefixed strings for assign/add/remove.
+
+enum class WorkloadOpCode : uint8_t {
+  kIncrement = 1,
+  kAssign,
+  kClear,
+  kAdd,
+  kRemove,
+  kBroadcast,
+  kBroadcastAll,
+  kSyncWithServer,
+  kSyncAll,
+  kGossip,
+  kGossipAll,
+  kDisconnect,
+  kReconnect,
+  kQuery,
+};
+
+struct WorkloadOp {
+  WorkloadOpCode code;
+  uint32_t replica = 0;             // the replica or network node the op applies to
+  int64_t delta = 0;                // kIncrement
+  std::vector<std::string> values;  // kAssign (any number), kAdd and kRemove (one)
+};
+
+class WorkloadRecorder {
+ public:
+  explicit WorkloadRecorder(uint32_t replicas) {
+    _bytes.insert(_bytes.end(), kMagic, kMagic + sizeof(kMagic) - 1);
+    putVarint(replicas);
+  }
+
+  void record(const WorkloadOp &op) {
+    _bytes.push_back((uint8_t)op.code);
+    putVarint(op.replica);
+    switch (op.code) {
+      case WorkloadOpCode::kIncrement:
+        putVarint(((uint64_t)op.delta << 1) ^ (uint64_t)(op.delta >> 63));
+        break;
+      case WorkloadOpCode::kAssign:
+      case WorkloadOpCode::kAdd:
+      case WorkloadOpCode::kRemove:
+        putVarint(op.values.size());
+        for (auto &value : op.values) {
+          putVarint(value.size());
+          _bytes.insert(_bytes.end(), value.begin(), value.end());
+        }
+        break;
+      default:
+        break;
+    }
+    _ops += 1;
+  }
+
+  const std::vector<uint8_t> &bytes() const { return _bytes; }
+  uint64_t ops() const { return _ops; }
+
+  bool save(const char *path) const {
+    FILE *out = fopen(path, "wb");
+    if (!out) {
+      return false;
+    }
+    const bool written = fwrite(_bytes.data(), 1, _bytes.size(), out) == _bytes.size();
+    return fclose(out) == 0 && written;
+  }
+
+  static constexpr char kMagic[] = "CRDTWL1\n";
+
+ private:
+  void putVarint(uint64_t v) {
+    while (v >= 0x80) {
+      _bytes.push_back((uint8_t)(v | 0x80));
+      v >>= 7;
+    }
+    _bytes.push_back((uint8_t)v);
+  }
+
+  std::vector<uint8_t> _bytes;
+  uint64_t _ops = 0;
+};
+
+struct WorkloadTrace {
+  uint32_t replicas = 0;
+  std::vector<WorkloadOp> ops;
+
+  // Returns nullopt if the trace is malformed or truncated.
+  static std::optional<WorkloadTrace> decode(const uint8_t *data, size_t size) {
+    Reader reader{data, data + size};
+    const size_t magic_len = sizeof(WorkloadRecorder::kMagic) - 1;
+    if (size < magic_len || memcmp(data, WorkloadRecorder::kMagic, magic_len) != 0) {
+      return std::nullopt;
+    }
+    reader.p += magic_len;
+    WorkloadTrace trace;
+    uint64_t replicas;
+    if (!reader.varint(&replicas) || replicas == 0 || replicas > UINT32_MAX) {
+      return std::nullopt;
+    }
+    trace.replicas = (uint32_t)replicas;
+    while (reader.p != reader.end) {
+      WorkloadOp op;
+      const uint8_t code = *reader.p++;
+      if (code < (uint8_t)WorkloadOpCode::kIncrement ||
+          code > (uint8_t)WorkloadOpCode::kQuery) {
+        return std::nullopt;
+      }
+      op.code = (WorkloadOpCode)code;
+      uint64_t replica;
+      if (!reader.varint(&replica) || replica >= replicas) {
+        return std::nullopt;
+      }
+      op.replica = (uint32_t)replica;
+      switch (op.code) {
+        case WorkloadOpCode::kIncrement: {
+          uint64_t zigzag;
+          if (!reader.varint(&zigzag)) {
+            return std::nullopt;
+          }
+          op.delta = (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+          break;
+        }
+        case WorkloadOpCode::kAssign:
+        case WorkloadOpCode::kAdd:
+        case WorkloadOpCode::kRemove: {
+          uint64_t count;
+          if (!reader.varint(&count) || count > (size_t)(reader.end - reader.p)) {
+            return std::nullopt;
+          }
+          if (op.code != WorkloadOpCode::kAssign && count != 1) {
+            return std::nullopt;
+          }
+          op.values.resize(count);
+          for (auto &value : op.values) {
+            uint64_t len;
+            if (!reader.varint(&len) || len > (size_t)(reader.end - reader.p)) {
+              return std::nullopt;
+            }
+            value.assign((const char *)reader.p, len);
+            reader.p += len;
+          }
+          break;
+        }
+        default:
+          break;
+      }
+      trace.ops.push_back(std::move(op));
+    }
+    return trace;
+  }
+
+  static std::optional<WorkloadTrace> load(const char *path) {
+    FILE *in = fopen(path, "rb");
+    if (!in) {
+      return std::nullopt;
+    }
+    std::vector<uint8_t> bytes;
+    uint8_t buf[1 << 16];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+      bytes.insert(bytes.end(), buf, buf + n);
+    }
+    fclose(in);
+    return decode(bytes.data(), bytes.size());
+  }
+
+ private:
+  struct Reader {
+    const uint8_t *p;
+    const uint8_t *end;
+
+    bool varint(uint64_t *out) {
+      uint64_t v = 0;
+      for (int shift = 0; shift < 64 && p != end; shift += 7) {
+        const uint8_t byte = *p++;
+        v |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+          *out = v;
+          return true;
+        }
+      }
+      return false;
+    }
+  };
+};
+
+// Detection of the operations CRDTs and networks support.
+#define WORKLOAD_DETECT(trait, expr)                                         \
+  template <typename T, typename = void>                                     \
+  struct trait : std::false_type {};                                         \
+  template <typename T>                                                      \
+  struct trait<T, std::void_t<decltype(std::declval<T &>().expr)>> : std::true_type {}
+
+namespace workload_detail {
+WORKLOAD_DETECT(has_increment, increment(1));
+WORKLOAD_DETECT(has_assign_value, assign(std::declval<const std::string &>()));
+WORKLOAD_DETECT(has_assign_set, assign(std::unordered_set<std::string>{}));
+WORKLOAD_DETECT(has_clear, clear());
+WORKLOAD_DETECT(has_add, add(std::declval<const std::string &>()));
+WORKLOAD_DETECT(has_remove, remove(std::declval<const std::string &>()));
+WORKLOAD_DETECT(has_server, setServerReplica(nullptr));
+WORKLOAD_DETECT(has_broadcast, broadcast(0));
+WORKLOAD_DETECT(has_broadcast_all, broadcastAll());
+WORKLOAD_DETECT(has_sync_with_server, syncWithServer(0));
+WORKLOAD_DETECT(has_sync_all, syncAllReplicasToServer());
+WORKLOAD_DETECT(has_gossip, gossip(0));
+WORKLOAD_DETECT(has_gossip_all, gossipAll());
+}  // namespace workload_detail
+
+#undef WORKLOAD_DETECT
+
+// The operation that syncs a single node with the rest of the network, and
+// the operation that runs a sync round over all nodes.
+template <typename Network>
+constexpr WorkloadOpCode syncOpCode() {
+  if constexpr (workload_detail::has_broadcast<Network>::value) {
+    return WorkloadOpCode::kBroadcast;
+  } else if constexpr (workload_detail::has_sync_with_server<Network>::value) {
+    return WorkloadOpCode::kSyncWithServer;
+  } else {
+    return WorkloadOpCode::kGossip;
+  }
+}
+
+template <typename Network>
+constexpr WorkloadOpCode syncRoundOpCode() {
+  if constexpr (workload_detail::has_broadcast_all<Network>::value) {
+    return WorkloadOpCode::kBroadcastAll;
+  } else if constexpr (workload_detail::has_sync_all<Network>::value) {
+    return WorkloadOpCode::kSyncAll;
+  } else {
+    return WorkloadOpCode::kGossipAll;
+  }
+}
+
+template <template <typename> class Network, typename CRDT>
+class WorkloadRunner {
+ public:
+  // Replica i is named "R<i>". On networks with a server, replica 0 is it.
+  explicit WorkloadRunner(size_t replicas, WorkloadRecorder *recorder = nullptr)
+      : _recorder(recorder) {
+    _replicas.reserve(replicas);
+    for (size_t i = 0; i < replicas; i++) {
+      _replicas.emplace_back("R" + std::to_string(i));
+    }
+    size_t first = 0;
+    if constexpr (workload_detail::has_server<Network<CRDT>>::value) {
+      _network.setServerReplica(&_replicas[0]);
+      first = 1;
+    }
+    for (size_t i = first; i < replicas; i++) {
+      _network.add(&_replicas[i]);
+    }
+  }
+
+  WorkloadRunner(const WorkloadRunner &) = delete;
+  WorkloadRunner &operator=(const WorkloadRunner &) = delete;
+
+  void apply(const WorkloadOp &op) {
+    if (_recorder) {
+      _recorder->record(op);
+    }
+    if (tryApply(op)) {
+      _applied += 1;
+    } else {
+      _skipped += 1;
+    }
+  }
+
+  CRDT &replica(size_t i) { return _replicas[i]; }
+  std::vector<CRDT> &replicas() { return _replicas; }
+  Network<CRDT> &network() { return _network; }
+  uint64_t applied() const { return _applied; }
+  uint64_t skipped() const { return _skipped; }
+
+ private:
+  bool tryApply(const WorkloadOp &op) {
+    using namespace workload_detail;
+    CRDT &replica = _replicas[op.replica];
+    switch (op.code) {
+      case WorkloadOpCode::kIncrement:
+        if constexpr (has_increment<CRDT>::value) {
+          if (std::is_unsigned_v<typename CRDT::ValueType> && op.delta < 0) {
+            return false;
+          }
+          replica.increment(op.delta);
+          return true;
+        }
+        return false;
+      case WorkloadOpCode::kAssign:
+        if constexpr (has_assign_set<CRDT>::value) {
+          replica.assign(std::unordered_set<std::string>(op.values.begin(), op.values.end()));
+          return true;
+        } else if constexpr (has_assign_value<CRDT>::value) {
+          if (op.values.size() != 1) {
+            return false;
+          }
+          replica.assign(op.values[0]);
+          return true;
+        }
+        return false;
+      case WorkloadOpCode::kClear:
+        if constexpr (has_clear<CRDT>::value) {
+          replica.clear();
+          return true;
+        }
+        return false;
+      case WorkloadOpCode::kAdd:
+        if constexpr (has_add<CRDT>::value) {
+          replica.add(op.values[0]);
+          return true;
+        }
+        return false;
+      case WorkloadOpCode::kRemove:
+        if constexpr (has_remove<CRDT>::value) {
+          (void)replica.remove(op.values[0]);
+          return true;
+        }
+        return false;
+      case WorkloadOpCode::kBroadcast:
+        if constexpr (has_broadcast<Network<CRDT>>::value) {
+          _network.broadcast(op.replica);
+          return true;
+        }
+        return false;
+      case WorkloadOpCode::kBroadcastAll:
+        if constexpr (has_broadcast_all<Network<CRDT>>::value) {
+          _network.broadcastAll();
+          return true;
+        }
+        return false;
+      case WorkloadOpCode::kSyncWithServer:
+        if constexpr (has_sync_with_server<Network<CRDT>>::value) {
+          _network.syncWithServer(op.replica);
+          return true;
+        }
+        return false;
+      case WorkloadOpCode::kSyncAll:
+        if constexpr (has_sync_all<Network<CRDT>>::value) {
+          _network.syncAllReplicasToServer();
+          return true;
+        }
+        return false;
+      case WorkloadOpCode::kGossip:
+        if constexpr (has_gossip<Network<CRDT>>::value) {
+          _network.gossip(op.replica);
+          return true;
+        }
+        return false;
+      case WorkloadOpCode::kGossipAll:
+        if constexpr (has_gossip_all<Network<CRDT>>::value) {
+          _network.gossipAll();
+          return true;
+        }
+        return false;
+      case WorkloadOpCode::kDisconnect:
+        _network.disconnect(op.replica);
+        return true;
+      case WorkloadOpCode::kReconnect:
+        _network.reconnect(op.replica);
+        return true;
+      case WorkloadOpCode::kQuery: {
+        const auto &value = replica.query();
+        (void)value;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  WorkloadRecorder *_recorder;
+  std::vector<CRDT> _replicas;
+  Network<CRDT> _network;
+  uint64_t _applied = 0;
+  uint64_t _skipped = 0;
+};
+
+// Synthetic workloads {{{
+
+// Zipf distribution over [0, n): P(k) is proportional to 1 / (k + 1)^s. The
+// larger s, the more skewed. s = 0 is the uniform distribution.
+class ZipfDistribution {
+ public:
+  ZipfDistribution(size_t n, double s) : _cdf(std::max<size_t>(n, 1)) {
+    double sum = 0;
+    for (size_t k = 0; k < _cdf.size(); k++) {
+      sum += 1.0 / std::pow((double)(k + 1), s);
+      _cdf[k] = sum;
+    }
+    for (auto &p : _cdf) {
+      p /= sum;
+    }
+  }
+
+  template <typename Rng>
+  size_t operator()(Rng &rng) const {
+    const double u = std::uniform_real_distribution<double>(0, 1)(rng);
+    const auto it = std::lower_bound(_cdf.begin(), _cdf.end(), u);
+    return std::min((size_t)(it - _cdf.begin()), _cdf.size() - 1);
+  }
+
+ private:
+  std::vector<double> _cdf;
+};
+
+struct SyntheticWorkloadParams {
+  uint32_t replicas = 16;
+  // Operation mix: relative weights of updates, queries and single-node syncs.
+  double update_weight = 80;
+  double query_weight = 15;
+  double sync_weight = 5;
+  // Fraction of set updates that are removes and of counter updates that are
+  // decrements (on counters that can decrement).
+  double remove_ratio = 0.1;
+  // Updates pick keys from a keyspace of this size with Zipfian skew. Keys are
+  // padded to value_size bytes.
+  size_t keys = 10000;
+  double zipf = 0.99;
+  size_t value_size = 16;
+  // Every partition_every ops, partition_fraction of the replicas are
+  // disconnected for partition_length ops, but at most partition_every - 1
+  // ops. 0 in either (or a partition_every of 1) disables partitions.
+  uint64_t partition_every = 0;
+  uint64_t partition_length = 0;
+  double partition_fraction = 0.25;
+};
+
+// Generates random operations for WorkloadRunner<Network, CRDT>. Updates are
+// whatever the CRDT supports: add/remove for sets, assign for registers and
+// increments for counters.
+template <template <typename> class Network, typename CRDT>
+class SyntheticWorkload {
+ public:
+  SyntheticWorkload(const SyntheticWorkloadParams &params, uint64_t seed)
+      : _params(params),
+        _rng(seed),
+        _keys(params.keys, params.zipf),
+        _mix({params.update_weight, params.query_weight, params.sync_weight}),
+        _offline(params.replicas, false) {}
+
+  WorkloadOp next() {
+    schedulePartitions();
+    _ops += 1;
+    if (!_pending.empty()) {
+      WorkloadOp op = std::move(_pending.front());
+      _pending.pop_front();
+      return op;
+    }
+    const uint32_t replica = (uint32_t)(_rng() % _params.replicas);
+    switch (_mix(_rng)) {
+      case 0:
+        return update(replica);
+      case 1:
+        return {WorkloadOpCode::kQuery, replica, 0, {}};
+      default:
+        return {syncOpCode<Network<CRDT>>(), replica, 0, {}};
+    }
+  }
+
+  // Reconnects every replica the partition schedule disconnected.
+  std::vector<WorkloadOp> healPartitions() {
+    std::vector<WorkloadOp> ops;
+    for (uint32_t i = 0; i < _params.replicas; i++) {
+      if (_offline[i]) {
+        ops.push_back({WorkloadOpCode::kReconnect, i, 0, {}});
+        _offline[i] = false;
+      }
+    }
+    _pending.clear();
+    return ops;
+  }
+
+ private:
+  void schedulePartitions() {
+    // Partitions that would heal right when the next one starts never heal.
+    if (_params.partition_every < 2 || !_params.partition_length) {
+      return;
+    }
+    const uint64_t phase = _ops % _params.partition_every;
+    if (phase == 0 && _ops > 0) {
+      for (uint32_t i = 0; i < _params.replicas; i++) {
+        if (!_offline[i] && std::bernoulli_distribution(_params.partition_fraction)(_rng)) {
+          _pending.push_back({WorkloadOpCode::kDisconnect, i, 0, {}});
+          _offline[i] = true;
+        }
+      }
+    } else if (phase == std::min(_params.partition_length, _params.partition_every - 1)) {
+      for (auto &op : healPartitions()) {
+        _pending.push_back(std::move(op));
+      }
+    }
+  }
+
+  WorkloadOp update(uint32_t replica) {
+    using namespace workload_detail;
+    const bool remove = std::bernoulli_distribution(_params.remove_ratio)(_rng);
+    if constexpr (has_add<CRDT>::value) {
+      return {remove ? WorkloadOpCode::kRemove : WorkloadOpCode::kAdd, replica, 0, {key()}};
+    } else if constexpr (has_increment<CRDT>::value) {
+      const int64_t delta = 1 + (int64_t)(_rng() % 10);
+      const bool can_decrement = std::is_signed_v<typename CRDT::ValueType>;
+      return {WorkloadOpCode::kIncrement, replica, remove && can_decrement ? -delta : delta, {}};
+    } else {
+      return {WorkloadOpCode::kAssign, replica, 0, {key()}};
+    }
+  }
+
+  std::string key() {
+    std::string key = "k" + std::to_string(_keys(_rng));
+    if (key.size() < _params.value_size) {
+      key.append(_params.value_size - key.size(), '.');
+    }
+    return key;
+  }
+
+  const SyntheticWorkloadParams _params;
+  std::mt19937_64 _rng;
+  ZipfDistribution _keys;
+  std::discrete_distribution<int> _mix;
+  std::vector<bool> _offline;
+  std::deque<WorkloadOp> _pending;
+  uint64_t _ops = 0;
+};
+
+// }}}